@@ -0,0 +1,105 @@
+/*
+* Compression benchmark, which measures the effective bandwidth of large EDAT_DOUBLE events sent from rank 0 to rank 1 with and without payload
+* compression, for fields of increasing compressibility. Each field is a smooth function where all but the given number of leading mantissa bits of
+* each value are zeroed, and the compression ratio is that of the in-tree codec on the field. The effective bandwidth is the uncompressed payload
+* size over the time taken to send the events and for them to be consumed (which includes compressing and decompressing.) This is C++ as it calls
+* the codec directly to report the compression ratio. Run with two processes, e.g.
+*
+* mpiexec -np 2 ./compression [number events] [number elements per event]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include "edat.h"
+#include "compression.h"
+
+#define NUMBER_FIELDS 5
+
+static void consumeTask(EDAT_Event*, int);
+static void generateField(double*, int, int);
+static double getCompressionRatio(double*, int);
+static double getWallTime(void);
+
+static int number_events=20, number_elements=1048576, number_consumed=0;
+static int mantissa_bits[NUMBER_FIELDS]={52, 32, 20, 12, 4};
+
+int main(int argc, char * argv[]) {
+  if (argc >= 2) number_events=atoi(argv[1]);
+  if (argc >= 3) number_elements=atoi(argv[2]);
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  if (edatGetRank() == 0) {
+    double * field=(double*) malloc(sizeof(double) * number_elements);
+    double payload_mb=(sizeof(double) * (double) number_elements * number_events) / 1e6;
+    printf("Events: %d, payload: %d doubles\n", number_events, number_elements);
+    printf("Mantissa bits\tRatio\t\tRaw (MB/s)\tCompressed (MB/s)\n");
+    for (int i=0;i<NUMBER_FIELDS;i++) {
+      generateField(field, number_elements, mantissa_bits[i]);
+      double bandwidths[2];
+      for (int compressed=0;compressed<2;compressed++) {
+        double start=getWallTime();
+        for (int j=0;j<number_events;j++) {
+          if (compressed) {
+            edatFireEventCompressed(field, EDAT_DOUBLE, number_elements, 1, "field");
+          } else {
+            edatFireEvent(field, EDAT_DOUBLE, number_elements, 1, "field");
+          }
+        }
+        edatWait(1, 1, "received");
+        bandwidths[compressed]=payload_mb / (getWallTime() - start);
+      }
+      printf("%d\t\t%.2f\t\t%.1f\t\t%.1f\n", mantissa_bits[i], getCompressionRatio(field, number_elements), bandwidths[0], bandwidths[1]);
+    }
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+    free(field);
+  } else {
+    edatSubmitPersistentNamedTask(consumeTask, "consume_task", 1, 0, "field");
+    edatWait(1, 0, "complete");
+    edatRemoveTask("consume_task");
+  }
+  edatFinalise();
+  return 0;
+}
+
+static void consumeTask(EDAT_Event * events, int num_events) {
+  // Copies of this persistent task might run concurrently on different workers, hence the atomic update
+  if (__atomic_add_fetch(&number_consumed, 1, __ATOMIC_SEQ_CST) % number_events == 0) {
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 0, "received");
+  }
+}
+
+/**
+* Generates a smooth field, keeping only the given number of leading bits of the mantissa of each value
+*/
+static void generateField(double * field, int size, int bits) {
+  uint64_t mask=~((((uint64_t) 1) << (52 - bits)) - 1);
+  for (int i=0;i<size;i++) {
+    double value=sin(i * 0.001) + 2.0;
+    uint64_t raw;
+    memcpy(&raw, &value, sizeof(double));
+    raw&=mask;
+    memcpy(&field[i], &raw, sizeof(double));
+  }
+}
+
+static double getCompressionRatio(double * field, int size) {
+  int data_size=sizeof(double) * size;
+  char * compressed=(char*) malloc(getCompressedPayloadBound(data_size));
+  int compressed_size=compressPayload((char*) field, data_size, sizeof(double), compressed, getCompressedPayloadBound(data_size));
+  free(compressed);
+  return (double) data_size / compressed_size;
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
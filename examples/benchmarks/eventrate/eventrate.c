@@ -0,0 +1,71 @@
+/*
+* Event rate benchmark for small payloads, which measures the bandwidth efficiency of the wire format where the header is significant compared to the
+* payload. Rank 0 fires a stream of events to rank 1 for each payload size from 0 to 64 bytes, rank 1 consumes these with a persistent task and once all
+* have arrived it fires an event back. The rate of events and the payload bandwidth (excluding headers) is reported for each size, and building EDAT with
+* metrics enabled reports the header bytes per event. Setting EDAT_COALESCE_EVENTS=true will aggregate the events into fewer messages. Run with two
+* processes, e.g.
+*
+* mpiexec -np 2 ./eventrate [number events per size] [event identifier]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "edat.h"
+
+#define MAX_PAYLOAD_SIZE 64
+#define PAYLOAD_SIZE_STEP 8
+
+static void consumeTask(EDAT_Event*, int);
+static double getWallTime(void);
+
+static int number_events=100000, number_consumed=0;
+
+int main(int argc, char * argv[]) {
+  int i, size;
+  const char * event_id="payload";
+  if (argc >= 2) number_events=atoi(argv[1]);
+  if (argc >= 3) event_id=argv[2];
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  if (edatGetRank() == 0) {
+    char payload[MAX_PAYLOAD_SIZE];
+    for (i=0;i<MAX_PAYLOAD_SIZE;i++) payload[i]=(char) i;
+    printf("Events per size: %d, event identifier: \"%s\"\n", number_events, event_id);
+    printf("Size (bytes)\tEvents/s\tPayload (MB/s)\n");
+    for (size=0;size<=MAX_PAYLOAD_SIZE;size+=PAYLOAD_SIZE_STEP) {
+      double start=getWallTime();
+      for (i=0;i<number_events;i++) {
+        edatFireEvent(size > 0 ? payload : NULL, size > 0 ? EDAT_BYTE : EDAT_NOTYPE, size, 1, event_id);
+      }
+      edatWait(1, 1, "received");
+      double elapsed=getWallTime() - start;
+      printf("%d\t\t%.0f\t\t%.2f\n", size, number_events / elapsed, ((double) number_events * size) / elapsed / 1e6);
+    }
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+  } else {
+    edatSubmitPersistentNamedTask(consumeTask, "consume_task", 1, 0, event_id);
+    edatWait(1, 0, "complete");
+    edatRemoveTask("consume_task");
+  }
+  edatFinalise();
+  return 0;
+}
+
+static void consumeTask(EDAT_Event * events, int num_events) {
+  // Copies of this persistent task might run concurrently on different workers, hence the atomic update
+  if (__atomic_add_fetch(&number_consumed, 1, __ATOMIC_SEQ_CST) == number_events) {
+    number_consumed=0;
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 0, "received");
+  }
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
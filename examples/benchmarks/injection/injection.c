@@ -0,0 +1,78 @@
+/*
+* Injection rate benchmark for concurrently firing workers, which measures how the rate at which events can be sent scales with the number of workers
+* firing them. Rank 0 runs one firing task on each of its workers, each of these fires a stream of small events to rank 1 which consumes them with a
+* persistent task and fires an event back once all have arrived. The aggregate rate of events sent is reported. Comparing runs with
+* EDAT_MPI_THREAD_MULTIPLE=true, where each worker sends on its own communicator without serialising on a lock around MPI, against the default
+* serialised mode shows the contention between workers. Run with two processes, e.g.
+*
+* for w in 1 2 4 8 16 32 64; do EDAT_NUM_WORKERS=$w mpiexec -np 2 ./injection [events per worker] [payload bytes]; done
+* for w in 1 2 4 8 16 32 64; do EDAT_MPI_THREAD_MULTIPLE=true EDAT_NUM_WORKERS=$w mpiexec -np 2 ./injection [events per worker] [payload bytes]; done
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "edat.h"
+#include "edat_debug.h"
+
+#define MAX_PAYLOAD_SIZE 1024
+
+static void fireTask(EDAT_Event*, int);
+static void consumeTask(EDAT_Event*, int);
+static double getWallTime(void);
+
+static int number_events=100000, payload_size=8, number_expected=0, number_consumed=0;
+
+int main(int argc, char * argv[]) {
+  int i;
+  if (argc >= 2) number_events=atoi(argv[1]);
+  if (argc >= 3) payload_size=atoi(argv[2]);
+  if (payload_size > MAX_PAYLOAD_SIZE) payload_size=MAX_PAYLOAD_SIZE;
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  if (edatGetRank() == 0) {
+    int number_workers=edatGetNumWorkers(), total_events=number_workers * number_events;
+    edatFireEvent(&total_events, EDAT_INT, 1, 1, "expected");
+    double start=getWallTime();
+    for (i=0;i<number_workers;i++) edatSubmitTask(fireTask, 0);
+    edatWait(1, 1, "received");
+    double elapsed=getWallTime() - start;
+    printf("Workers: %d, events per worker: %d, payload: %d bytes\n", number_workers, number_events, payload_size);
+    printf("Total events: %d, time: %.4f s, injection rate: %.0f events/s\n", total_events, elapsed, total_events / elapsed);
+  } else {
+    EDAT_Event * events=edatWait(1, 0, "expected");
+    number_expected=*((int*) events[0].data);
+    edatSubmitPersistentNamedTask(consumeTask, "consume_task", 1, 0, "payload");
+    edatWait(1, 0, "complete");
+    edatRemoveTask("consume_task");
+  }
+  if (edatGetRank() == 0) edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+  edatFinalise();
+  return 0;
+}
+
+static void fireTask(EDAT_Event * events, int num_events) {
+  int i;
+  char payload[MAX_PAYLOAD_SIZE];
+  for (i=0;i<payload_size;i++) payload[i]=(char) i;
+  for (i=0;i<number_events;i++) {
+    edatFireEvent(payload_size > 0 ? payload : NULL, payload_size > 0 ? EDAT_BYTE : EDAT_NOTYPE, payload_size, 1, "payload");
+  }
+}
+
+static void consumeTask(EDAT_Event * events, int num_events) {
+  // Copies of this persistent task might run concurrently on different workers, hence the atomic update
+  if (__atomic_add_fetch(&number_consumed, 1, __ATOMIC_SEQ_CST) == number_expected) {
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 0, "received");
+  }
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
@@ -0,0 +1,53 @@
+/*
+* Local event benchmark, which measures the cost of firing events to the same rank. A task fires a stream of events to EDAT_SELF that are consumed by
+* a persistent task, and both the time spent in the firing calls and the time until all the events have been consumed are reported. Comparing runs
+* with EDAT_BATCH_LOCAL_EVENTS set to true (events are buffered by the firing worker and registered in batches by the progress engine) against the
+* default (registered synchronously by the firing worker) shows the cost taken off the firing task, and building EDAT with metrics enabled reports
+* the time per registration for each. Run with any number of processes, e.g.
+*
+* EDAT_BATCH_LOCAL_EVENTS=true mpiexec -np 1 ./localevents [number events]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "edat.h"
+
+static void fireTask(EDAT_Event*, int);
+static void consumeTask(EDAT_Event*, int);
+static double getWallTime(void);
+
+static int number_events=100000, number_consumed=0;
+static double start_time;
+
+int main(int argc, char * argv[]) {
+  if (argc >= 2) number_events=atoi(argv[1]);
+  edatInit();
+  edatSubmitPersistentNamedTask(consumeTask, "consume_task", 1, EDAT_SELF, "local");
+  edatSubmitTask(fireTask, 0);
+  edatFinalise();
+  return 0;
+}
+
+static void fireTask(EDAT_Event * events, int num_events) {
+  const char * batched=getenv("EDAT_BATCH_LOCAL_EVENTS");
+  start_time=getWallTime();
+  for (int i=0;i<number_events;i++) edatFireEvent(&i, EDAT_INT, 1, EDAT_SELF, "local");
+  double fire_time=getWallTime() - start_time;
+  printf("[%d] Batched: %s, events: %d, firing cost: %.3f us/event\n", edatGetRank(), batched != NULL ? batched : "false", number_events,
+         (fire_time / number_events) * 1e6);
+}
+
+static void consumeTask(EDAT_Event * events, int num_events) {
+  // Copies of this persistent task might run concurrently on different workers, hence the atomic update
+  if (__atomic_add_fetch(&number_consumed, 1, __ATOMIC_SEQ_CST) == number_events) {
+    printf("[%d] Consumed all events in %.3f s\n", edatGetRank(), getWallTime() - start_time);
+    edatRemoveTask("consume_task");
+  }
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
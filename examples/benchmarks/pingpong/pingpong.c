@@ -0,0 +1,64 @@
+/*
+* Ping-pong benchmark between two processes for a range of event payload sizes. Rank 0 sends a ping event with the payload to rank 1, which
+* responds with a pong event carrying the same payload, and the average round trip latency is reported for each size. Messages up to
+* EDAT_EAGER_THRESHOLD bytes are sent eagerly, so comparing runs with this set to zero (all sends synchronous) against the default shows the
+* latency gained by avoiding the rendezvous. Run with two processes, e.g.
+*
+* EDAT_EAGER_THRESHOLD=0 mpiexec -np 2 ./pingpong [number round trips] [maximum payload size in bytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "edat.h"
+
+static void pingTask(EDAT_Event*, int);
+static double getWallTime(void);
+
+int main(int argc, char * argv[]) {
+  int i, size, number_round_trips=1000, max_size=65536;
+  if (argc >= 2) number_round_trips=atoi(argv[1]);
+  if (argc >= 3) max_size=atoi(argv[2]);
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  if (edatGetRank() == 0) {
+    char * payload=(char*) malloc(max_size);
+    for (i=0;i<max_size;i++) payload[i]=(char) i;
+    const char * threshold=getenv("EDAT_EAGER_THRESHOLD");
+    printf("Eager threshold: %s bytes, round trips per size: %d\n", threshold == NULL ? "default" : threshold, number_round_trips);
+    printf("Size (bytes)\tLatency (us)\n");
+    for (size=4;size<=max_size;size*=4) {
+      // Warm up round trip for this size that is not included in the timing
+      edatFireEvent(payload, EDAT_BYTE, size, 1, "ping");
+      edatWait(1, 1, "pong");
+      double start=getWallTime();
+      for (i=0;i<number_round_trips;i++) {
+        edatFireEvent(payload, EDAT_BYTE, size, 1, "ping");
+        edatWait(1, 1, "pong");
+      }
+      printf("%d\t\t%.2f\n", size, ((getWallTime() - start) / number_round_trips) * 1000000);
+    }
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+    free(payload);
+  } else {
+    edatSubmitPersistentNamedTask(pingTask, "ping_task", 1, 0, "ping");
+    edatWait(1, 0, "complete");
+    edatRemoveTask("ping_task");
+  }
+  edatFinalise();
+  return 0;
+}
+
+static void pingTask(EDAT_Event * events, int num_events) {
+  edatFireEvent(events[0].data, EDAT_BYTE, events[0].metadata.number_elements, 0, "pong");
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
@@ -0,0 +1,73 @@
+/*
+* Benchmark for the different progress thread modes (selected via EDAT_PROGRESS_MODE of busy, backoff or hybrid.) Rank 0 repeatedly sends a
+* ping event to rank 1, which responds with a pong, and in between each round trip rank 0 sleeps to emulate a compute phase where there is no
+* message traffic. The average round trip latency is reported along with the CPU usage of each rank (CPU time as a proportion of wall time),
+* for the busy mode the CPU usage will be at least one core per rank due to the progress thread spinning. Run with two processes, e.g.
+*
+* EDAT_PROGRESS_MODE=hybrid mpiexec -np 2 ./progress_modes [number round trips] [compute gap in microseconds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "edat.h"
+
+static void pingTask(EDAT_Event*, int);
+static double getWallTime(void);
+static double getCPUTime(void);
+
+int main(int argc, char * argv[]) {
+  int i, number_round_trips=1000, compute_gap=1000;
+  if (argc >= 2) number_round_trips=atoi(argv[1]);
+  if (argc >= 3) compute_gap=atoi(argv[2]);
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  double wall_start=getWallTime(), cpu_start=getCPUTime();
+  if (edatGetRank() == 0) {
+    double total_latency=0.0;
+    struct timespec gap;
+    gap.tv_sec=compute_gap / 1000000;
+    gap.tv_nsec=(compute_gap % 1000000) * 1000;
+    for (i=0;i<number_round_trips;i++) {
+      double start=getWallTime();
+      edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "ping");
+      edatWait(1, 1, "pong");
+      total_latency+=getWallTime() - start;
+      nanosleep(&gap, NULL);
+    }
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+    const char * mode=getenv("EDAT_PROGRESS_MODE");
+    printf("Mode: %s, round trips: %d, compute gap: %d us, average round trip latency: %.2f us\n", mode == NULL ? "busy" : mode,
+      number_round_trips, compute_gap, (total_latency / number_round_trips) * 1000000);
+  } else {
+    edatSubmitPersistentNamedTask(pingTask, "ping_task", 1, 0, "ping");
+    edatWait(1, 0, "complete");
+    edatRemoveTask("ping_task");
+  }
+  double cpu_usage=(getCPUTime() - cpu_start) / (getWallTime() - wall_start);
+  printf("[%d] CPU usage during benchmark: %.1f%% of a core\n", edatGetRank(), cpu_usage * 100);
+  edatFinalise();
+  return 0;
+}
+
+static void pingTask(EDAT_Event * events, int num_events) {
+  edatFireEvent(NULL, EDAT_NOTYPE, 0, 0, "pong");
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static double getCPUTime(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + (usage.ru_utime.tv_usec / 1e6) + usage.ru_stime.tv_sec + (usage.ru_stime.tv_usec / 1e6);
+}
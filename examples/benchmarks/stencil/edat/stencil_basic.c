@@ -6,6 +6,7 @@
 #if DOUBLE
   #define DTYPE     double
   #define MPI_DTYPE MPI_DOUBLE
+  #define EDAT_DTYPE EDAT_DOUBLE
   #define EPSILON   1.e-8
   #define COEFX     1.0
   #define COEFY     1.0
@@ -13,6 +14,7 @@
 #else
   #define DTYPE     float
   #define MPI_DTYPE MPI_FLOAT
+  #define EDAT_DTYPE EDAT_FLOAT
   #define EPSILON   0.0001f
   #define COEFX     1.0f
   #define COEFY     1.0f
@@ -31,10 +33,10 @@ static void displayPreamble(int, int, int, int, int, int);
 static void errorCheckParameters(int, int, int, long, int, int, int);
 static void initialise_in_out_arrays(DTYPE ** RESTRICT, DTYPE ** RESTRICT, int, int, int, int, int, int, int);
 static void initialise_stencil_weights(DTYPE [2*RADIUS+1][2*RADIUS+1]);
-static void allocate_comms_buffers(DTYPE**, DTYPE**, DTYPE**, DTYPE**, int, int, int);
 static void displayResults(int, DTYPE, int, double, int);
 static void complete_run(EDAT_Event*, int);
 static void compute_kernel(EDAT_Event*, int);
+static void fire_halo(int, int, int, int, int);
 static void halo_swap_from_up(EDAT_Event*, int);
 static void halo_swap_to_up(EDAT_Event*, int);
 static void halo_swap_from_down(EDAT_Event*, int);
@@ -46,7 +48,6 @@ static void halo_swap_to_right(EDAT_Event*, int);
 
 int Num_procsx, Num_procsy, my_IDx, my_IDy, right_nbr, left_nbr, top_nbr, bottom_nbr, n, width, height, istart, iend, jstart, jend, iterations,
   num_neighbours;
-DTYPE * comm_buffer_up, * comm_buffer_down, * comm_buffer_left, * comm_buffer_right;
 long nsquare;
 DTYPE * RESTRICT in, * RESTRICT out;
 DTYPE weight[2*RADIUS+1][2*RADIUS+1];
@@ -134,10 +135,6 @@ int main(int argc, char ** argv) {
   if (my_IDx > 0) num_neighbours++;
   if (my_IDx < Num_procsx-1) num_neighbours++;
 
-  if (Num_procs > 1) {
-    allocate_comms_buffers(&comm_buffer_up, &comm_buffer_down, &comm_buffer_left, &comm_buffer_right, width, height, my_ID);
-  }
-
   if (my_ID == ROOT_PROCESS) {
     edatSubmitTask(complete_run, 2, EDAT_ALL, "runtime", EDAT_ALL, "localnorm");
   }
@@ -201,8 +198,15 @@ int main(int argc, char ** argv) {
   exit(EXIT_SUCCESS);
 }
 
+/* Fires the block of rows by columns of the interior starting at the given row and column (of the input array including its halo) to the
+   neighbour, this is sent directly from the array rather than packed into a buffer first */
+static void fire_halo(int start_row, int start_col, int rows, int cols, int target) {
+  int sizes[2]={height+2*RADIUS, width+2*RADIUS}, subsizes[2]={rows, cols}, starts[2]={start_row, start_col};
+  edatFireEventSubarray(in, EDAT_DTYPE, 2, sizes, subsizes, starts, target, "buffer");
+}
+
 static void halo_swap_from_up(EDAT_Event * events, int num_events) {
-  double * buffer = (double*) events[0].data;
+  DTYPE * buffer = (DTYPE*) events[0].data;
 
   for (int kk=0,j=jend+1; j<=jend+RADIUS; j++) {
     for (int i=istart; i<=iend; i++) {
@@ -213,17 +217,12 @@ static void halo_swap_from_up(EDAT_Event * events, int num_events) {
 }
 
 static void halo_swap_to_up(EDAT_Event * events, int num_events) {
-  for (int kk=0,j=jend-RADIUS+1; j<=jend; j++) {
-    for (int i=istart; i<=iend; i++) {
-      comm_buffer_up[kk++]= IN(i,j);
-    }
-  }
-  edatFireEvent(comm_buffer_up, EDAT_DOUBLE, RADIUS*width, top_nbr, "buffer");
+  fire_halo(height, RADIUS, RADIUS, width, top_nbr);
   edatFireEvent(NULL, EDAT_NOTYPE, 0, EDAT_SELF, "halosend");
 }
 
 static void halo_swap_from_down(EDAT_Event * events, int num_events) {
-  double * buffer = (double*) events[0].data;
+  DTYPE * buffer = (DTYPE*) events[0].data;
 
   for (int kk=0,j=jstart-RADIUS; j<=jstart-1; j++) {
     for (int i=istart; i<=iend; i++) {
@@ -234,17 +233,12 @@ static void halo_swap_from_down(EDAT_Event * events, int num_events) {
 }
 
 static void halo_swap_to_down(EDAT_Event * events, int num_events) {
-  for (int kk=0,j=jstart; j<=jstart+RADIUS-1; j++) {
-    for (int i=istart; i<=iend; i++) {
-      comm_buffer_down[kk++]= IN(i,j);
-    }
-  }
-  edatFireEvent(comm_buffer_down, EDAT_DOUBLE, RADIUS*width, bottom_nbr, "buffer");
+  fire_halo(RADIUS, RADIUS, RADIUS, width, bottom_nbr);
   edatFireEvent(NULL, EDAT_NOTYPE, 0, EDAT_SELF, "halosend");
 }
 
 static void halo_swap_from_left(EDAT_Event * events, int num_events) {
-  double * buffer = (double*) events[0].data;
+  DTYPE * buffer = (DTYPE*) events[0].data;
 
   for (int kk=0,j=jstart; j<=jend; j++) {
     for (int i=istart-RADIUS; i<=istart-1; i++) {
@@ -255,17 +249,12 @@ static void halo_swap_from_left(EDAT_Event * events, int num_events) {
 }
 
 static void halo_swap_to_left(EDAT_Event * events, int num_events) {
-  for (int kk=0,j=jstart; j<=jend; j++) {
-    for (int i=istart; i<=istart+RADIUS-1; i++) {
-      comm_buffer_left[kk++]= IN(i,j);
-    }
-  }
-  edatFireEvent(comm_buffer_left, EDAT_DOUBLE, RADIUS*height, left_nbr, "buffer");
+  fire_halo(RADIUS, RADIUS, height, RADIUS, left_nbr);
   edatFireEvent(NULL, EDAT_NOTYPE, 0, EDAT_SELF, "halosend");
 }
 
 static void halo_swap_from_right(EDAT_Event * events, int num_events) {
-  double * buffer = (double*) events[0].data;
+  DTYPE * buffer = (DTYPE*) events[0].data;
 
   for (int kk=0,j=jstart; j<=jend; j++) {
     for (int i=iend+1; i<=iend+RADIUS; i++) {
@@ -276,12 +265,7 @@ static void halo_swap_from_right(EDAT_Event * events, int num_events) {
 }
 
 static void halo_swap_to_right(EDAT_Event * events, int num_events) {
-  for (int kk=0,j=jstart; j<=jend; j++) {
-    for (int i=iend-RADIUS+1; i<=iend; i++) {
-      comm_buffer_right[kk++]= IN(i,j);
-    }
-  }
-  edatFireEvent(comm_buffer_right, EDAT_DOUBLE, RADIUS*height, right_nbr, "buffer");
+  fire_halo(RADIUS, width, height, RADIUS, right_nbr);
   edatFireEvent(NULL, EDAT_NOTYPE, 0, EDAT_SELF, "halosend");
 }
 
@@ -412,29 +396,6 @@ static void initialise_in_out_arrays(DTYPE  ** RESTRICT in_x, DTYPE  ** RESTRICT
   }
 }
 
-static void allocate_comms_buffers(DTYPE **comm_buffer_up, DTYPE **comm_buffer_down, DTYPE **comm_buffer_left, DTYPE **comm_buffer_right, int width, int height, int my_ID) {
-  *comm_buffer_up = (DTYPE *) prk_malloc(4*sizeof(DTYPE) * RADIUS * width);
-  if (!*comm_buffer_up) {
-    printf("ERROR: Rank %d could not allocated comm_buffer_up\n", my_ID);
-    exit(EXIT_FAILURE);
-  }
-  *comm_buffer_down = (DTYPE *) prk_malloc(4*sizeof(DTYPE) * RADIUS * width);
-  if (!*comm_buffer_down) {
-    printf("ERROR: Rank %d could not allocated comm_buffer_down\n", my_ID);
-    exit(EXIT_FAILURE);
-  }
-  *comm_buffer_left = (DTYPE *) prk_malloc(4*sizeof(DTYPE) * RADIUS * height);
-  if (!*comm_buffer_left) {
-    printf("ERROR: Rank %d could not allocated comm_buffer_left\n", my_ID);
-    exit(EXIT_FAILURE);
-  }
-  *comm_buffer_right = (DTYPE *) prk_malloc(4*sizeof(DTYPE) * RADIUS * height);
-  if (!*comm_buffer_right) {
-    printf("ERROR: Rank %d could not allocated comm_buffer_right\n", my_ID);
-    exit(EXIT_FAILURE);
-  }
-}
-
 static void errorCheckParameters(int my_ID, int argc, int iterations, long nsquare, int num_procs, int radius, int n) {
   if (my_ID == ROOT_PROCESS) {
     printf("Parallel Research Kernels version %s\n", PRKVERSION);
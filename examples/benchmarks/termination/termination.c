@@ -0,0 +1,73 @@
+/*
+* Termination detection benchmark, which measures the time from global quiescence (when the last task in the system completes) to the main thread
+* returning from edatPauseMainThread and edatFinalise on every process. Each round passes a token around all the processes for a number of hops, the
+* task that handles the final hop records the time of quiescence and then the processes are left to detect termination. MPI is initialised here, rather
+* than by EDAT, so that the times can be compared across processes once EDAT has gone idle. Run with any number of processes, e.g.
+*
+* mpiexec -np 64 ./termination [number rounds] [hops per round]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include "edat.h"
+#include "edat_debug.h"
+
+static void tokenTask(EDAT_Event*, int);
+static double getQuiescenceLatency(void);
+
+static int number_hops=1000;
+static double quiescence_time=0.0;
+
+int main(int argc, char * argv[]) {
+  int i, provided, number_rounds=10;
+  double total_latency=0.0, max_latency=0.0;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+  if (argc >= 2) number_rounds=atoi(argv[1]);
+  if (argc >= 3) number_hops=atoi(argv[2]);
+  edatInit();
+  edatSubmitPersistentTask(tokenTask, 1, EDAT_ANY, "token");
+  for (i=0;i<number_rounds;i++) {
+    int hops=0;
+    quiescence_time=0.0;
+    if (edatGetRank() == 0) edatFireEvent(&hops, EDAT_INT, 1, 0, "token");
+    edatPauseMainThread();
+    double latency=getQuiescenceLatency();
+    total_latency+=latency;
+    if (latency > max_latency) max_latency=latency;
+    edatRestart();
+  }
+  int hops=0;
+  quiescence_time=0.0;
+  if (edatGetRank() == 0) edatFireEvent(&hops, EDAT_INT, 1, 0, "token");
+  edatFinalise();
+  double finalise_latency=getQuiescenceLatency();
+  if (edatGetRank() == 0) {
+    printf("Processes: %d, rounds: %d, hops per round: %d\n", edatGetNumRanks(), number_rounds, number_hops);
+    printf("Quiescence to pause return: mean %.6f s, max %.6f s\n", number_rounds > 0 ? total_latency / number_rounds : 0.0, max_latency);
+    printf("Quiescence to finalise return: %.6f s\n", finalise_latency);
+  }
+  MPI_Finalize();
+  return 0;
+}
+
+static void tokenTask(EDAT_Event * events, int num_events) {
+  int hops=*((int*) events[0].data) + 1;
+  if (hops < number_hops) {
+    edatFireEvent(&hops, EDAT_INT, 1, (edatGetRank() + 1) % edatGetNumRanks(), "token");
+  } else {
+    quiescence_time=MPI_Wtime();
+  }
+}
+
+/**
+* Determines the time from global quiescence, recorded by whichever process handled the final hop, to the last process returning from waiting for
+* termination. Called once EDAT is idle, hence there is no contention with it for MPI
+*/
+static double getQuiescenceLatency(void) {
+  double times[2], max_times[2];
+  times[0]=quiescence_time;
+  times[1]=MPI_Wtime();
+  MPI_Allreduce(times, max_times, 2, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+  return max_times[1] - max_times[0];
+}
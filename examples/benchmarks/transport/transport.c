@@ -0,0 +1,84 @@
+/*
+* Transport comparison benchmark, which measures the latency and message rate of small events so that the messaging backends can be compared. The
+* latency is half the round trip time of an event bounced between rank 0 and rank 1, and the rate is that of a stream of events from rank 0 consumed
+* on rank 1 by a persistent task. Run with two processes for each backend, e.g.
+*
+* EDAT_TRANSPORT=p2p mpiexec -np 2 ./transport [number events] [payload bytes]
+* EDAT_TRANSPORT=rma mpiexec -np 2 ./transport [number events] [payload bytes]
+* EDAT_TRANSPORT=threads EDAT_NUM_RANKS=2 ./transport [number events] [payload bytes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "edat.h"
+
+#define MAX_PAYLOAD_SIZE 1024
+
+static int runRank(int, char**);
+static void pingTask(EDAT_Event*, int);
+static void consumeTask(EDAT_Event*, int);
+static double getWallTime(void);
+
+// The ranks of the threads transport share these, which is fine as the count of events consumed is only updated on rank 1 and every rank sets the others to the same values
+static int number_events=10000, payload_size=8, number_consumed=0;
+static char payload[MAX_PAYLOAD_SIZE];
+
+int main(int argc, char * argv[]) {
+  return edatRunRanks(runRank, argc, argv);
+}
+
+static int runRank(int argc, char * argv[]) {
+  int i;
+  if (argc >= 2) number_events=atoi(argv[1]);
+  if (argc >= 3) payload_size=atoi(argv[2]);
+  if (payload_size > MAX_PAYLOAD_SIZE) payload_size=MAX_PAYLOAD_SIZE;
+  edatInit();
+  if (edatGetNumRanks() != 2) {
+    if (edatGetRank() == 0) fprintf(stderr, "This benchmark must be run with two processes\n");
+    edatFinalise();
+    return 1;
+  }
+  int other_rank=edatGetRank() == 0 ? 1 : 0;
+  edatSubmitPersistentNamedTask(pingTask, "ping_task", 1, other_rank, "ping");
+  if (edatGetRank() == 0) {
+    const char * transport=getenv("EDAT_TRANSPORT");
+    double start=getWallTime();
+    for (i=0;i<number_events;i++) {
+      edatFireEvent(payload, EDAT_BYTE, payload_size, 1, "ping");
+      edatWait(1, 1, "pong");
+    }
+    double latency=(getWallTime() - start) / (2.0 * number_events);
+    start=getWallTime();
+    for (i=0;i<number_events;i++) edatFireEvent(payload, EDAT_BYTE, payload_size, 1, "stream");
+    edatWait(1, 1, "received");
+    double elapsed=getWallTime() - start;
+    printf("Transport: %s, events: %d, payload: %d bytes\n", transport != NULL ? transport : "p2p", number_events, payload_size);
+    printf("Latency: %.2f us, message rate: %.0f events/s\n", latency * 1e6, number_events / elapsed);
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 1, "complete");
+  } else {
+    edatSubmitPersistentNamedTask(consumeTask, "consume_task", 1, 0, "stream");
+    edatWait(1, 0, "complete");
+    edatRemoveTask("consume_task");
+  }
+  edatRemoveTask("ping_task");
+  edatFinalise();
+  return 0;
+}
+
+static void pingTask(EDAT_Event * events, int num_events) {
+  edatFireEvent(payload, EDAT_BYTE, payload_size, 0, "pong");
+}
+
+static void consumeTask(EDAT_Event * events, int num_events) {
+  // Copies of this persistent task might run concurrently on different workers, hence the atomic update
+  if (__atomic_add_fetch(&number_consumed, 1, __ATOMIC_SEQ_CST) == number_events) {
+    edatFireEvent(NULL, EDAT_NOTYPE, 0, 0, "received");
+  }
+}
+
+static double getWallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
@@ -50,7 +50,6 @@ void domainDecomposition(int, int, int, int, int*, int*, int*);
 void findMyNeighbours(int, int*, int*, int*);
 void initJacobi(int*, int*, int*, int*, double**, double**);
 void computeJacobi(double**, double**, int*, int*);
-void haloExtract(double*, int*, int*, double*);
 double localNorm(double*, int*, int*);
 
 // EDAT tasks
@@ -277,39 +276,6 @@ void computeJacobi(double ** u_k, double ** u_kp1, int * local_dims, int * mem_d
 	return;
 }
 
-void haloExtract(double * u_k, int * local_dims, int * mem_dims, double * boundary) {
-	/* extract internal boundary of array and store it in a new array,
-	 * in preparation for sending to neighbours
-	 */
-	int i, j=0, numel;
-	int north_start, east_start, south_start, west_start;
-
-	numel = mem_dims[0] * mem_dims[1];
-	north_start = 1 + mem_dims[0];
-	east_start = 1 + mem_dims[0];
-	south_start = numel-(2*mem_dims[0])+1;
-	west_start = 2*mem_dims[0]-2;
-
-	for (i=north_start; i<north_start+local_dims[0]; i++) {
-		boundary[j] = u_k[i];
-		j++;
-	}
-	for (i=east_start; i<numel-mem_dims[0]+1; i+=mem_dims[0]) {
-		boundary[j] = u_k[i];
-		j++;
-	}
-	for (i=south_start; i<south_start+local_dims[0]; i++) {
-		boundary[j] = u_k[i];
-		j++;
-	}
-	for (i=west_start; i<numel-2; i+=mem_dims[0]) {
-		boundary[j] = u_k[i];
-		j++;
-	}
-
-	return;
-}
-
 double localNorm(double * u_k, int * local_dims, int * mem_dims) {
 	/* calculate the local norm value */
 	int row, col, lindex, northdex, eastdex, southdex, westdex;
@@ -346,8 +312,7 @@ void iterTask(EDAT_Event * events, int num_events) {
 	 * this task requires an event fired by normUpdateTask when the new norm
 	 * is greater than the convergence_accuracy
 	 */
-	int i, boundary_length, neighbour=0;
-	double *boundary_start=NULL, *boundary;
+	int i, neighbour=0, boundary_start[4];
 	const char *compass[] = {"north", "east", "south", "west"};
 	int iter_index = edatFindEvent(events, num_events, MASTER, "iterate");
 	int neighbour_index = edatFindEvent(events, num_events, EDAT_SELF, "neighbours");
@@ -386,17 +351,22 @@ void iterTask(EDAT_Event * events, int num_events) {
 		computeJacobi(&u_k, &u_kp1, local_dims, mem_dims);
 		edatFireEvent(&u_k, EDAT_ADDRESS, 1, EDAT_SELF, "lnorm_u_k_addr");
 
-		// halo swap
-		boundary_length = 2 * (local_dims[0] + local_dims[1]);
-		boundary_start = (double*) malloc(sizeof(double) * boundary_length);
-		haloExtract(u_k, local_dims, mem_dims, boundary_start);
-		boundary = boundary_start;
+		// halo swap, the internal boundary is sent directly from the array
+		// north and south are rows, east and west are strided columns
+		boundary_start[0] = 1 + mem_dims[0];
+		boundary_start[1] = 1 + mem_dims[0];
+		boundary_start[2] = (mem_dims[0] * mem_dims[1]) - (2*mem_dims[0]) + 1;
+		boundary_start[3] = 2*mem_dims[0] - 2;
 
 		for (i=0; i<4; ++i) {
 			neighbour = neighbours[i];
 			if(neighbour != INT_MIN) {
 				// send boundary to neighbour
-				edatFireEvent(boundary, EDAT_DOUBLE, local_dims[i%2], neighbour, "boundary");
+				if (i%2 == 0) {
+					edatFireEvent(&u_k[boundary_start[i]], EDAT_DOUBLE, local_dims[0], neighbour, "boundary");
+				} else {
+					edatFireEventStrided(&u_k[boundary_start[i]], EDAT_DOUBLE, local_dims[1], 1, mem_dims[0], neighbour, "boundary");
+				}
 				// expect boundary to be received from neighbour
 				edatFireEvent(&neighbour, EDAT_INT, 1, EDAT_SELF, "halo_neighbour");
 				edatFireEvent(&i, EDAT_INT, 1, EDAT_SELF, "direction");
@@ -407,7 +377,6 @@ void iterTask(EDAT_Event * events, int num_events) {
 			} else {
 				edatFireEvent(NULL, EDAT_NOTYPE, 0, EDAT_SELF, compass[i]);
 			}
-			boundary += local_dims[i%2];
 		}
 
 		// have master fire non-synching events for norm update
@@ -433,7 +402,6 @@ void iterTask(EDAT_Event * events, int num_events) {
 		if (edatGetRank() == MASTER) printf("\nIteration limit reached. Calculation failed.\n");
 	}
 
-	free(boundary_start);
 	return;
 }
 
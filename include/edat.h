@@ -67,8 +67,11 @@ typedef struct edat_struct_event EDAT_Event;
 void edatInit();
 void edatInitWithConfiguration(int, char **, char **);
 void edatFinalise(void);
+int edatRunRanks(int (*)(int, char**), int, char**);
 int edatGetRank(void);
 int edatGetNumRanks(void);
+int edatGetNumTaskThreads(void);
+int edatGetMaxNumTaskThreads(void);
 void edatSubmitTask(void (*)(EDAT_Event*, int), int, ...);
 void edatSubmitNamedTask(void (*)(EDAT_Event*, int), const char*, int, ...);
 void edatSubmitPersistentTask(void (*)(EDAT_Event*, int), int, ...);
@@ -79,9 +82,20 @@ int edatIsTaskSubmitted(const char*);
 int edatRemoveTask(const char*);
 void edatFireEvent(void*, int, int, int, const char *);
 void edatFirePersistentEvent(void*, int, int, int, const char *);
+void edatFireEventOwned(void*, int, int, int, const char *, void (*)(void*));
+void edatFireEventCompressed(void*, int, int, int, const char *);
+void edatFireUrgentEvent(void*, int, int, int, const char *);
+void edatFireEventStrided(void*, int, int, int, int, int, const char *);
+void edatFireEventSubarray(void*, int, int, int*, int*, int*, int, const char *);
+int edatOpenChannel(int, const char *, int, int);
+void edatFireEventOnChannel(void*, int);
+int edatRegisterCommunicator(int, int);
+void edatFireEventOnCommunicator(void*, int, int, int, int, const char *);
 int edatFindEvent(EDAT_Event*, int, int, const char*);
 int edatDefineContext(size_t);
 void* edatCreateContext(int);
+void edatReleaseContext(void*);
+void edatSetContextSerialiser(int, size_t (*)(void*, void*), void (*)(void*, void*, size_t));
 void edatLock(char*);
 void edatUnlock(char*);
 int edatTestLock(char*);
@@ -0,0 +1,287 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+* The payload codec used to compress events, this is a byte shuffle (which groups together the bytes of the same significance of each element, as
+* for numerical data these are often similar) followed by a fast LZ77 coding of the shuffled bytes. The coded stream is a sequence of tokens, each
+* giving the number of literal bytes that follow it and then the offset and length of a match to copy from earlier in the output. The last token
+* only has literals
+*/
+
+#include "compression.h"
+#include "misc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HASH_LOG 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define RUN_MASK 15
+#define SEARCH_ACCELERATION 6
+
+static void shuffleBytes(const char*, char*, int, int);
+static void unshuffleBytes(const char*, char*, int, int);
+static int lzCompress(const unsigned char*, int, unsigned char*, int);
+static void lzDecompress(const unsigned char*, int, unsigned char*, int);
+static unsigned char * writeLength(unsigned char*, unsigned char*, int);
+static int readLength(const unsigned char**, const unsigned char*, int);
+
+static inline uint32_t read32(const unsigned char * p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(uint32_t));
+  return value;
+}
+
+static inline int hashSequence(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+* The largest size that the coded stream can be for a payload of a given size, which is when no matches are found at all
+*/
+int getCompressedPayloadBound(int size) {
+  return size + (size / 255) + 16;
+}
+
+/**
+* Compresses a payload of elements of the given type size into the destination, returning the compressed size. If this would not fit into the
+* capacity of the destination then zero is returned, which is how the caller finds out that compression is not worthwhile
+*/
+int compressPayload(const char * source, int size, int type_size, char * destination, int capacity) {
+  if (size <= 0 || capacity <= 0) return 0;
+  if (type_size > 1 && size % type_size == 0) {
+    char * shuffled=(char*) malloc(size);
+    shuffleBytes(source, shuffled, size / type_size, type_size);
+    int compressed_size=lzCompress((unsigned char*) shuffled, size, (unsigned char*) destination, capacity);
+    free(shuffled);
+    return compressed_size;
+  }
+  return lzCompress((const unsigned char*) source, size, (unsigned char*) destination, capacity);
+}
+
+/**
+* Decompresses a payload that was compressed with the same type size into the destination, which is the size of the original payload
+*/
+void decompressPayload(const char * source, int compressed_size, int type_size, char * destination, int size) {
+  if (type_size > 1 && size % type_size == 0) {
+    char * shuffled=(char*) malloc(size);
+    lzDecompress((const unsigned char*) source, compressed_size, (unsigned char*) shuffled, size);
+    unshuffleBytes(shuffled, destination, size / type_size, type_size);
+    free(shuffled);
+  } else {
+    lzDecompress((const unsigned char*) source, compressed_size, (unsigned char*) destination, size);
+  }
+}
+
+#ifdef __SSE2__
+/**
+* A single butterfly step of the byte transpose, this interleaves the bytes of each vector in the first half with the corresponding vector of the
+* second half. Each step moves one bit of the element index from the vector index into the byte index (and one bit of the byte index into the vector
+* index), so applying it four times shuffles a block of 16 elements and applying it log2(type size) times reverses that
+*/
+static inline void interleaveVectors(__m128i * in, __m128i * out, int number_vectors) {
+  int half=number_vectors / 2;
+  for (int i=0;i<half;i++) {
+    out[2*i]=_mm_unpacklo_epi8(in[i], in[i + half]);
+    out[2*i + 1]=_mm_unpackhi_epi8(in[i], in[i + half]);
+  }
+}
+
+static inline bool isVectorisableTypeSize(int type_size) {
+  return type_size == 2 || type_size == 4 || type_size == 8 || type_size == 16;
+}
+#endif
+
+/**
+* Shuffles the bytes of the elements, such that the destination holds the first byte of every element, then the second byte of every element etc.
+* Blocks of 16 elements are transposed with SSE2 where available and the remainder byte by byte
+*/
+static void shuffleBytes(const char * source, char * destination, int number_elements, int type_size) {
+  int i=0;
+#ifdef __SSE2__
+  if (isVectorisableTypeSize(type_size)) {
+    __m128i a[16], b[16];
+    for (;i + 16 <= number_elements;i+=16) {
+      for (int k=0;k<type_size;k++) a[k]=_mm_loadu_si128((const __m128i*) &source[(i * type_size) + (k * 16)]);
+      interleaveVectors(a, b, type_size);
+      interleaveVectors(b, a, type_size);
+      interleaveVectors(a, b, type_size);
+      interleaveVectors(b, a, type_size);
+      for (int k=0;k<type_size;k++) _mm_storeu_si128((__m128i*) &destination[(k * number_elements) + i], a[k]);
+    }
+  }
+#endif
+  for (;i<number_elements;i++) {
+    for (int k=0;k<type_size;k++) destination[(k * number_elements) + i]=source[(i * type_size) + k];
+  }
+}
+
+/**
+* Reverses the byte shuffle, such that the destination holds the elements in their original form
+*/
+static void unshuffleBytes(const char * source, char * destination, int number_elements, int type_size) {
+  int i=0;
+#ifdef __SSE2__
+  if (isVectorisableTypeSize(type_size)) {
+    __m128i a[16], b[16];
+    for (;i + 16 <= number_elements;i+=16) {
+      for (int k=0;k<type_size;k++) a[k]=_mm_loadu_si128((const __m128i*) &source[(k * number_elements) + i]);
+      __m128i * in=a, * out=b;
+      for (int steps=type_size;steps > 1;steps/=2) {
+        interleaveVectors(in, out, type_size);
+        __m128i * swap=in;
+        in=out;
+        out=swap;
+      }
+      for (int k=0;k<type_size;k++) _mm_storeu_si128((__m128i*) &destination[(i * type_size) + (k * 16)], in[k]);
+    }
+  }
+#endif
+  for (;i<number_elements;i++) {
+    for (int k=0;k<type_size;k++) destination[(i * type_size) + k]=source[(k * number_elements) + i];
+  }
+}
+
+/**
+* Writes the remainder of a literal or match length that did not fit into the token, returning NULL if this overflows the output
+*/
+static unsigned char * writeLength(unsigned char * op, unsigned char * oend, int length) {
+  while (length >= 255) {
+    if (op >= oend) return NULL;
+    *op++=255;
+    length-=255;
+  }
+  if (op >= oend) return NULL;
+  *op++=(unsigned char) length;
+  return op;
+}
+
+/**
+* Codes the input with LZ77, matches are found via a hash table of the most recent position of each four byte sequence. The search steps over the
+* input more quickly the longer it goes without finding a match, so incompressible data is passed over cheaply. Returns zero if the coded stream
+* does not fit into the capacity
+*/
+static int lzCompress(const unsigned char * source, int size, unsigned char * destination, int capacity) {
+  int hash_table[1 << HASH_LOG];
+  for (int i=0;i<(1 << HASH_LOG);i++) hash_table[i]=-1;
+  const unsigned char * ip=source, * anchor=source, * iend=source + size;
+  unsigned char * op=destination, * oend=destination + capacity;
+  int misses=0;
+  while (ip + MIN_MATCH <= iend) {
+    uint32_t sequence=read32(ip);
+    int hash=hashSequence(sequence);
+    int candidate=hash_table[hash];
+    hash_table[hash]=ip - source;
+    if (candidate < 0 || (ip - source) - candidate > MAX_OFFSET || read32(&source[candidate]) != sequence) {
+      ip+=1 + (misses++ >> SEARCH_ACCELERATION);
+      continue;
+    }
+    misses=0;
+    const unsigned char * match=&source[candidate];
+    int match_length=MIN_MATCH;
+    while (ip + match_length < iend && ip[match_length] == match[match_length]) match_length++;
+    int literal_length=ip - anchor;
+    if (op + 1 + literal_length + 2 > oend) return 0;
+    unsigned char * token=op++;
+    *token=(unsigned char) (((literal_length < RUN_MASK ? literal_length : RUN_MASK) << 4) |
+                             (match_length - MIN_MATCH < RUN_MASK ? match_length - MIN_MATCH : RUN_MASK));
+    if (literal_length >= RUN_MASK && (op=writeLength(op, oend, literal_length - RUN_MASK)) == NULL) return 0;
+    if (op + literal_length + 2 > oend) return 0;
+    memcpy(op, anchor, literal_length);
+    op+=literal_length;
+    int offset=ip - match;
+    *op++=(unsigned char) (offset & 0xFF);
+    *op++=(unsigned char) (offset >> 8);
+    if (match_length - MIN_MATCH >= RUN_MASK && (op=writeLength(op, oend, match_length - MIN_MATCH - RUN_MASK)) == NULL) return 0;
+    ip+=match_length;
+    anchor=ip;
+  }
+  int literal_length=iend - anchor;
+  if (op + 1 > oend) return 0;
+  unsigned char * token=op++;
+  *token=(unsigned char) ((literal_length < RUN_MASK ? literal_length : RUN_MASK) << 4);
+  if (literal_length >= RUN_MASK && (op=writeLength(op, oend, literal_length - RUN_MASK)) == NULL) return 0;
+  if (op + literal_length > oend) return 0;
+  memcpy(op, anchor, literal_length);
+  op+=literal_length;
+  return op - destination;
+}
+
+/**
+* Reads the remainder of a literal or match length that did not fit into the token
+*/
+static int readLength(const unsigned char ** ip, const unsigned char * iend, int length) {
+  unsigned char next;
+  do {
+    if (*ip >= iend) raiseError("Compressed payload is truncated");
+    next=*(*ip)++;
+    length+=next;
+  } while (next == 255);
+  return length;
+}
+
+/**
+* Decodes the LZ77 stream into the destination, which must be exactly filled by it. Matches can overlap the bytes that they produce (e.g. a run of the
+* same value) and so are copied in pieces that do not overlap
+*/
+static void lzDecompress(const unsigned char * source, int compressed_size, unsigned char * destination, int size) {
+  const unsigned char * ip=source, * iend=source + compressed_size;
+  unsigned char * op=destination, * oend=destination + size;
+  while (ip < iend) {
+    int token=*ip++;
+    int literal_length=token >> 4;
+    if (literal_length == RUN_MASK) literal_length=readLength(&ip, iend, literal_length);
+    if (ip + literal_length > iend || op + literal_length > oend) raiseError("Compressed payload is corrupt");
+    memcpy(op, ip, literal_length);
+    ip+=literal_length;
+    op+=literal_length;
+    if (ip == iend) break;
+    if (ip + 2 > iend) raiseError("Compressed payload is truncated");
+    int offset=ip[0] | (ip[1] << 8);
+    ip+=2;
+    int match_length=(token & RUN_MASK);
+    if (match_length == RUN_MASK) match_length=readLength(&ip, iend, match_length);
+    match_length+=MIN_MATCH;
+    if (offset == 0 || offset > op - destination || op + match_length > oend) raiseError("Compressed payload is corrupt");
+    // The bytes from the start of the match are periodic with the offset, so copying as many as have been produced since then doubles each time
+    const unsigned char * match=op - offset;
+    while (match_length > 0) {
+      int bytes=match_length < op - match ? match_length : op - match;
+      memcpy(op, match, bytes);
+      op+=bytes;
+      match_length-=bytes;
+    }
+  }
+  if (op != oend) raiseError("Compressed payload does not match the size of the event");
+}
@@ -36,7 +36,18 @@
 
 // These are configuration keys that might be found set in the environment and if so we want to read and store their values
 std::string Configuration::envKeys[] = { "EDAT_NUM_WORKERS", "EDAT_MAIN_THREAD_WORKER", "EDAT_REPORT_WORKER_MAPPING", "EDAT_PROGRESS_THREAD" ,
-                                        "EDAT_BATCH_EVENTS", "EDAT_MAX_BATCHED_EVENTS", "EDAT_BATCHING_EVENTS_TIMEOUT", "EDAT_ENABLE_BRIDGE"};
+                                        "EDAT_BATCH_EVENTS", "EDAT_MAX_BATCHED_EVENTS", "EDAT_BATCHING_EVENTS_TIMEOUT", "EDAT_ENABLE_BRIDGE",
+                                        "EDAT_WORKER_MAPPING", "EDAT_PROGRESS_MODE", "EDAT_PROGRESS_THREAD_CORE", "EDAT_PROGRESS_BACKOFF_MIN",
+                                        "EDAT_PROGRESS_BACKOFF_MAX", "EDAT_PROGRESS_POLL_FREQUENCY",
+                                        "EDAT_MAX_IDLE_THREADS_PER_WORKER", "EDAT_IDLE_THREAD_TIMEOUT", "EDAT_PAUSED_THREAD_STACK_SIZE",
+                                        "EDAT_EAGER_THRESHOLD", "EDAT_COALESCE_EVENTS", "EDAT_COALESCE_MAX_BYTES", "EDAT_COALESCE_MAX_EVENTS",
+                                        "EDAT_COALESCE_TIMEOUT", "EDAT_RECV_BUFFER_SIZE", "EDAT_RECV_RING_SIZE", "EDAT_RECV_COPY_THRESHOLD",
+                                        "EDAT_SEND_SLAB_SIZE", "EDAT_MPI_THREAD_MULTIPLE", "EDAT_SHARED_MEMORY", "EDAT_SHARED_RING_SIZE",
+                                        "EDAT_SHARED_SLAB_SIZE", "EDAT_TRANSPORT", "EDAT_RMA_MAILBOX_SLOTS", "EDAT_RMA_SLOT_SIZE",
+                                        "EDAT_NUM_RANKS", "EDAT_CHUNK_THRESHOLD", "EDAT_CHUNK_SIZE", "EDAT_CHUNKS_IN_FLIGHT",
+                                        "EDAT_CHUNK_STREAMING", "EDAT_COMPRESSION_THRESHOLD", "EDAT_BATCH_LOCAL_EVENTS",
+                                        "EDAT_POLL_MESSAGE_BUDGET", "EDAT_POLL_TIME_BUDGET", "EDAT_CHANNEL_DEPTH",
+                                        "EDAT_CHANNEL_SEND_BUFFERS", "EDAT_MAX_PROBE_INTERVAL", "EDAT_CONTEXT_HUGE_PAGE_THRESHOLD"};
 
 /**
 * The constructor which will initialise the configuration settings from the environment variables (if set) and then from the provided
@@ -34,6 +34,7 @@
 #include <map>
 #include <string>
 #include <algorithm>
+#include <strings.h>
 #include "edat.h"
 
 class Configuration {
@@ -56,8 +57,10 @@ public:
     std::transform(keyStr.begin(), keyStr.end(),keyStr.begin(), ::toupper);
     std::map<std::string, std::string>::iterator it=configSettings.find(keyStr);
     if (it != configSettings.end()) {
-      typename std::map<const char*, T>::iterator providedMapit=lookupMap.find(it->second.c_str());
-      if (providedMapit != lookupMap.end()) return providedMapit->second;
+      // The lookup map is keyed on C strings, hence compare the contents rather than the pointers
+      for (typename std::map<const char*, T>::iterator providedMapit=lookupMap.begin();providedMapit != lookupMap.end();providedMapit++) {
+        if (strcasecmp(providedMapit->first, it->second.c_str()) == 0) return providedMapit->second;
+      }
     }
     return defaultValue;
   }
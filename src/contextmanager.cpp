@@ -29,13 +29,29 @@
 */
 
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "contextmanager.h"
 #include "misc.h"
 
+// Instances are aligned to (and padded out to a multiple of) a cache line, so that contexts used by different workers never share a line
+#define CONTEXT_ALIGNMENT 64
+#define HUGE_PAGE_SIZE 2097152
+
+/**
+* Creates the manager, contexts of at least the huge page threshold in bytes are backed by huge pages (zero, the default, disables this)
+*/
+ContextManager::ContextManager(Configuration & aconfig) : configuration(aconfig) {
+  definitionId = BASE_CONTEXT_ID;
+  int threshold=configuration.get("EDAT_CONTEXT_HUGE_PAGE_THRESHOLD", 0);
+  huge_page_threshold=threshold > 0 ? threshold : 0;
+}
+
 /**
 * Adds the definition of a context to the manager, this will also update the unique context definition id that is used as the type
 */
 int ContextManager::addDefinition(ContextDefinition * definition) {
+  definition->setHugePages(huge_page_threshold > 0 && definition->getSize() >= huge_page_threshold);
   definitions.insert(std::pair<int, ContextDefinition*>(definitionId, definition));
   definitionId++;
   return definitionId-1;
@@ -55,6 +71,60 @@ void* ContextManager::createContext(int contextType) {
   }
 }
 
+/**
+* Releases a context that was created by the manager, so that it is reused by a subsequent creation of a context of the same type
+*/
+void ContextManager::releaseContext(void * context) {
+  for (std::map<int, ContextDefinition*>::iterator it = definitions.begin(); it != definitions.end(); ++it) {
+    if (it->second->release(context)) return;
+  }
+  raiseError("Can not release the context, either it was not created by EDAT or it has already been released");
+}
+
+/**
+* Sets the pair of functions that pack and unpack contexts of a specific type when these are sent to other processes, rather than sending their bytes.
+* These are needed where the context refers to other memory
+*/
+void ContextManager::setContextSerialiser(int contextType, ContextPackFunction pack_fn, ContextUnpackFunction unpack_fn) {
+  if ((pack_fn == NULL) != (unpack_fn == NULL)) raiseError("Both the pack and unpack functions of a context must be provided");
+  getDefinition(contextType)->setSerialiser(pack_fn, unpack_fn);
+}
+
+/**
+* Retrieves the number of bytes that a context of a specific type packs into for sending to another process
+*/
+size_t ContextManager::getPackedContextSize(int contextType, void * context) {
+  return getDefinition(contextType)->getPackedSize(context);
+}
+
+/**
+* Packs a context of a specific type into the buffer, which must be at least the packed size of the context
+*/
+void ContextManager::packContext(int contextType, void * context, void * buffer) {
+  getDefinition(contextType)->pack(context, buffer);
+}
+
+/**
+* Re-materialises a context that has been sent from another process, creating a context of the type (which reuses a released one if there is one)
+* and unpacking the buffer into it
+*/
+void* ContextManager::unpackContext(int contextType, void * buffer, size_t size) {
+  ContextDefinition * definition=getDefinition(contextType);
+  void * context=definition->create();
+  definition->unpack(context, buffer, size);
+  return context;
+}
+
+/**
+* Retrieves the definition of a context type, raising an error if there is none
+*/
+ContextDefinition * ContextManager::getDefinition(int contextType) {
+  std::map<int, ContextDefinition*>::iterator it = definitions.find(contextType);
+  if (it != definitions.end()) return it->second;
+  raiseError("Can not find context type, make sure you have defined it correctly");
+  return NULL;
+}
+
 /**
 * Determines whether a specific type is a context type or not (in such case it would be a base type or errornous.) This is mainly
 * for firing events.
@@ -81,10 +151,80 @@ int ContextManager::getContextEventPayloadSize(int contextType) {
 }
 
 /**
-* Creates a specific instantiation of a context and stores a pointer to it.
+* Creates a specific instantiation of a context, reusing one that has been released if there is one and otherwise allocating it. The contents of a
+* reused context are whatever was left in it
 */
 void* ContextDefinition::create() {
-  char * data=(char*) malloc(numberBytes);
-  dataInstances.push_back((void*) data);
-  return (void*) data;
+  std::lock_guard<std::mutex> lock(instances_mutex);
+  void * data;
+  if (!freeInstances.empty()) {
+    data=freeInstances.back();
+    freeInstances.pop_back();
+  } else {
+    data=allocate();
+  }
+  liveInstances.insert(data);
+  return data;
+}
+
+/**
+* Releases an instance of this context, which is kept for reuse. Returns false if it is not a live instance of this context
+*/
+bool ContextDefinition::release(void * data) {
+  std::lock_guard<std::mutex> lock(instances_mutex);
+  if (liveInstances.erase(data) == 0) return false;
+  freeInstances.push_back(data);
+  return true;
+}
+
+/**
+* Retrieves the number of bytes that an instance of this context packs into, which is its size unless there is a pack function
+*/
+size_t ContextDefinition::getPackedSize(void * data) {
+  return pack_fn != NULL ? pack_fn(data, NULL) : numberBytes;
+}
+
+/**
+* Packs an instance of this context into the buffer, via the pack function if there is one and otherwise as a copy of its bytes
+*/
+void ContextDefinition::pack(void * data, void * buffer) {
+  if (pack_fn != NULL) {
+    pack_fn(data, buffer);
+  } else {
+    memcpy(buffer, data, numberBytes);
+  }
+}
+
+/**
+* Unpacks the buffer into an instance of this context, via the unpack function if there is one and otherwise as a copy of the bytes
+*/
+void ContextDefinition::unpack(void * data, void * buffer, size_t size) {
+  if (unpack_fn != NULL) {
+    unpack_fn(data, buffer, size);
+  } else {
+    if (size != numberBytes) raiseError("The size of a context received from another process does not match its definition");
+    memcpy(data, buffer, size);
+  }
+}
+
+/**
+* Allocates the memory of an instance, aligned to a cache line. For large contexts this is instead a mapping that is advised to be backed by
+* transparent huge pages, where the system supports these. Instances are never freed as they are reused once released
+*/
+void* ContextDefinition::allocate() {
+  size_t size=numberBytes > 0 ? numberBytes : 1;
+#ifdef MADV_HUGEPAGE
+  if (hugePages) {
+    size_t mapping_size=(size + HUGE_PAGE_SIZE - 1) & ~((size_t) HUGE_PAGE_SIZE - 1);
+    void * memory=mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) raiseError("Unable to map memory for a context");
+    madvise(memory, mapping_size, MADV_HUGEPAGE);
+    return memory;
+  }
+#endif
+  void * memory;
+  if (posix_memalign(&memory, CONTEXT_ALIGNMENT, (size + CONTEXT_ALIGNMENT - 1) & ~((size_t) CONTEXT_ALIGNMENT - 1)) != 0) {
+    raiseError("Unable to allocate memory for a context");
+  }
+  return memory;
 }
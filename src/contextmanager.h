@@ -33,28 +33,56 @@
 
 #include <map>
 #include <vector>
+#include <unordered_set>
+#include <mutex>
 #include <stddef.h>
 #include "configuration.h"
 
 static int BASE_CONTEXT_ID=2000;
 
+// Packs a context into the buffer and returns the number of bytes packed, if the buffer is null then just returns the number of bytes needed
+typedef size_t (*ContextPackFunction)(void*, void*);
+// Unpacks the given number of bytes from the buffer into a context
+typedef void (*ContextUnpackFunction)(void*, void*, size_t);
+
 class ContextDefinition {
   size_t numberBytes;
-  std::vector<void*> dataInstances;
+  bool hugePages;
+  // Contexts are sent to other processes by value, either their bytes or as packed by a user provided pair of functions if these are set
+  ContextPackFunction pack_fn;
+  ContextUnpackFunction unpack_fn;
+  // Instances that have been created and not released, and those that have been released which are reused before any more are allocated
+  std::unordered_set<void*> liveInstances;
+  std::vector<void*> freeInstances;
+  std::mutex instances_mutex;
+  void* allocate();
 public:
-  ContextDefinition(size_t numberBytes) { this->numberBytes = numberBytes; }
+  ContextDefinition(size_t numberBytes) : numberBytes(numberBytes), hugePages(false), pack_fn(NULL), unpack_fn(NULL) { }
   size_t getSize() { return numberBytes; }
+  void setHugePages(bool hugePages) { this->hugePages = hugePages; }
+  void setSerialiser(ContextPackFunction pack_fn, ContextUnpackFunction unpack_fn) { this->pack_fn = pack_fn; this->unpack_fn = unpack_fn; }
+  size_t getPackedSize(void*);
+  void pack(void*, void*);
+  void unpack(void*, void*, size_t);
   void* create();
+  bool release(void*);
 };
 
 class ContextManager {
   Configuration & configuration;
   int definitionId;
+  size_t huge_page_threshold;
   std::map<int, ContextDefinition*> definitions;
+  ContextDefinition * getDefinition(int);
 public:
-  ContextManager(Configuration & aconfig) : configuration(aconfig) { definitionId = BASE_CONTEXT_ID; }
+  ContextManager(Configuration&);
   int addDefinition(ContextDefinition*);
   void* createContext(int);
+  void releaseContext(void*);
+  void setContextSerialiser(int, ContextPackFunction, ContextUnpackFunction);
+  size_t getPackedContextSize(int, void*);
+  void packContext(int, void*, void*);
+  void* unpackContext(int, void*, size_t);
   int getContextEventPayloadSize(int);
   bool isTypeAContext(int);
 };
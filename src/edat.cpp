@@ -38,80 +38,174 @@
 #include "scheduler.h"
 #include "messaging.h"
 #include "mpi_p2p_messaging.h"
+#include "mpi_rma_messaging.h"
+#include "threads_messaging.h"
 #include "contextmanager.h"
 #include "concurrency_ctrl.h"
 #include "metrics.h"
+#include "misc.h"
 
 #ifndef DO_METRICS
 #define DO_METRICS false
 #endif
 
-static ThreadPool * threadPool;
-static Scheduler * scheduler;
-static Messaging * messaging;
-static ContextManager * contextManager;
-static Configuration * configuration;
-static ConcurrencyControl * concurrencyControl;
-
-static bool edatActive;
+#define TRANSPORT_P2P 0
+#define TRANSPORT_RMA 1
+#define TRANSPORT_THREADS 2
+
+static std::map<const char*, int> transport_lookup={{"p2p", TRANSPORT_P2P}, {"rma", TRANSPORT_RMA}, {"threads", TRANSPORT_THREADS}};
+
+// The runtime of a rank, normally there is one rank per process but with the threads transport each of the other logical ranks in the process has its
+// own runtime. This is located via the rank context of the calling thread, and if there is none then the thread belongs to the process' own rank
+struct EdatRuntime {
+  ThreadPool * threadPool=NULL;
+  Scheduler * scheduler=NULL;
+  Messaging * messaging=NULL;
+  ContextManager * contextManager=NULL;
+  Configuration * configuration=NULL;
+  ConcurrencyControl * concurrencyControl=NULL;
+  bool edatActive=false;
+  int rank=0;
+};
+
+static EdatRuntime processRuntime;
+static ThreadsExchange * threadsExchange=NULL;
+static std::vector<std::thread*> logicalRankThreads;
+// The function that the program runs each rank with (see edatRunRanks), which the other logical ranks of the threads transport are launched with
+static int (*rankMainFunction)(int, char**)=NULL;
+static int programArgc;
+static char ** programArgv;
 
 static void submitProvidedTask(void (*)(EDAT_Event*, int), std::string, bool, int, bool, va_list);
 static std::vector<std::pair<int, std::string>> generateDependencyVector(int, va_list);
 static void doInitialisation(Configuration*, bool, int);
+static void launchLogicalRanks(Configuration*);
+static void runLogicalRank(EdatRuntime*);
+
+/**
+* Retrieves the runtime of the rank that the calling thread belongs to
+*/
+static inline EdatRuntime & runtime() {
+  EdatRuntime * rankRuntime=(EdatRuntime*) getRankContext();
+  return rankRuntime != NULL ? *rankRuntime : processRuntime;
+}
 
 void edatInit() {
-  configuration=new Configuration();
-  doInitialisation(configuration, false, 0);
+  runtime().configuration=new Configuration();
+  doInitialisation(runtime().configuration, false, 0);
 }
 
 void edatInitWithConfiguration(int numberEntries, char ** keys, char ** values) {
-  configuration=new Configuration(numberEntries, keys, values);
-  doInitialisation(configuration, false, 0);
+  runtime().configuration=new Configuration(numberEntries, keys, values);
+  doInitialisation(runtime().configuration, false, 0);
+}
+
+/**
+* Runs the program's per rank function on the calling thread, this being rank 0 (or the rank of the process with MPI transports.) With the threads
+* transport, initialising EDAT on this rank launches the other logical ranks as threads that each run the same function with the same arguments. All
+* the ranks share the program's global and static variables, so any per rank state must be held in the function's locals. Returns the result of the
+* function on the calling thread, once any other logical ranks have completed
+*/
+int edatRunRanks(int (*rank_main)(int, char**), int argc, char ** argv) {
+  rankMainFunction=rank_main;
+  programArgc=argc;
+  programArgv=argv;
+  int result=rank_main(argc, argv);
+  rankMainFunction=NULL;
+  return result;
 }
 
 static void doInitialisation(Configuration * configuration, bool comm_present, int communicator) {
-  threadPool=new ThreadPool(*configuration);
-  concurrencyControl=new ConcurrencyControl(threadPool);
-  contextManager=new ContextManager(*configuration);
-  scheduler=new Scheduler(*threadPool, *configuration, *concurrencyControl);
+  EdatRuntime & rt=runtime();
   #if DO_METRICS
-    metrics::METRICS = new EDAT_Metrics(*configuration);
+    // Metrics are per process, so with the threads transport rank 0 creates and starts them before launching the other logical ranks (which record
+    // into them too) and finalises them once all the ranks have completed
+    if (getRankContext() == NULL) {
+      metrics::METRICS = new EDAT_Metrics(*configuration);
+      metrics::METRICS->edatTimerStart();
+    }
   #endif
-  if (comm_present) {
-    messaging=new MPI_P2P_Messaging(*scheduler, *threadPool, *contextManager, *configuration, communicator);
+  rt.threadPool=new ThreadPool(*configuration);
+  rt.concurrencyControl=new ConcurrencyControl(rt.threadPool);
+  rt.contextManager=new ContextManager(*configuration);
+  rt.scheduler=new Scheduler(*rt.threadPool, *configuration, *rt.concurrencyControl);
+  int transport=configuration->get("EDAT_TRANSPORT", transport_lookup, TRANSPORT_P2P);
+  if (transport == TRANSPORT_THREADS) {
+    if (comm_present) raiseError("A communicator can not be provided with the threads transport");
+    // The process' own rank is rank zero, which launches the other logical ranks
+    if (getRankContext() == NULL) launchLogicalRanks(configuration);
+    rt.messaging=new Threads_Messaging(*rt.scheduler, *rt.threadPool, *rt.contextManager, *configuration, *threadsExchange, rt.rank);
+  } else if (transport == TRANSPORT_RMA) {
+    if (comm_present) {
+      rt.messaging=new MPI_RMA_Messaging(*rt.scheduler, *rt.threadPool, *rt.contextManager, *configuration, communicator);
+    } else {
+      rt.messaging=new MPI_RMA_Messaging(*rt.scheduler, *rt.threadPool, *rt.contextManager, *configuration);
+    }
+  } else if (comm_present) {
+    rt.messaging=new MPI_P2P_Messaging(*rt.scheduler, *rt.threadPool, *rt.contextManager, *configuration, communicator);
   } else {
-    messaging=new MPI_P2P_Messaging(*scheduler, *threadPool, *contextManager, *configuration);
+    rt.messaging=new MPI_P2P_Messaging(*rt.scheduler, *rt.threadPool, *rt.contextManager, *configuration);
   }
-  threadPool->setMessaging(messaging);
-  edatActive=true;
-  #if DO_METRICS
-    metrics::METRICS->edatTimerStart();
-  #endif
+  rt.threadPool->setMessaging(rt.messaging);
+  rt.edatActive=true;
+}
+
+/**
+* Launches the other logical ranks of the threads transport, each of these is a thread that runs the program's per rank function with its own runtime
+*/
+static void launchLogicalRanks(Configuration * configuration) {
+  int number_ranks=configuration->get("EDAT_NUM_RANKS", 1);
+  threadsExchange=new ThreadsExchange(number_ranks);
+  if (number_ranks > 1 && rankMainFunction == NULL) {
+    raiseError("The program must be run with edatRunRanks for the threads transport to launch the other ranks");
+  }
+  for (int i=1;i<number_ranks;i++) {
+    EdatRuntime * rankRuntime=new EdatRuntime();
+    rankRuntime->rank=i;
+    logicalRankThreads.push_back(new std::thread(runLogicalRank, rankRuntime));
+  }
+}
+
+/**
+* Entry point of the thread of a logical rank, which sets the rank context so that EDAT calls on this thread (and any threads that it launches)
+* use the rank's runtime, and then runs the program
+*/
+static void runLogicalRank(EdatRuntime * rankRuntime) {
+  setRankContext(rankRuntime);
+  rankMainFunction(programArgc, programArgv);
 }
 
 void edatInitialiseWithCommunicator(int communicator) {
-  configuration=new Configuration();
-  doInitialisation(configuration, true, communicator);
+  runtime().configuration=new Configuration();
+  doInitialisation(runtime().configuration, true, communicator);
 }
 
 void edatFinalise(void) {
-  if (edatActive) {
+  if (runtime().edatActive) {
     // Puts the thread to sleep and will wake it up when there are no more events and tasks.
     std::mutex * m = new std::mutex();
     std::condition_variable * cv = new std::condition_variable();
     bool * completed = new bool();
 
-    messaging->attachMainThread(cv, m, completed);
-    threadPool->notifyMainThreadIsSleeping();
-    messaging->setEligableForTermination();
+    runtime().messaging->attachMainThread(cv, m, completed);
+    runtime().threadPool->notifyMainThreadIsSleeping();
+    runtime().messaging->setEligableForTermination();
     std::unique_lock<std::mutex> lk(*m);
     cv->wait(lk, [completed]{return *completed;});
   }
-  messaging->finalise();
-  #if DO_METRICS
-    metrics::METRICS->finalise();
-  #endif
-  edatActive=false;
+  runtime().messaging->finalise();
+  if (getRankContext() == NULL) {
+    // The process can only exit once the other logical ranks (if there are any) have completed
+    for (std::thread * rankThread : logicalRankThreads) {
+      rankThread->join();
+      delete rankThread;
+    }
+    logicalRankThreads.clear();
+    #if DO_METRICS
+      metrics::METRICS->finalise();
+    #endif
+  }
+  runtime().edatActive=false;
 }
 
 void edatPauseMainThread(void) {
@@ -123,42 +217,50 @@ void edatPauseMainThread(void) {
   std::condition_variable * cv = new std::condition_variable();
   bool * completed = new bool();
 
-  messaging->attachMainThread(cv, m, completed);
-  threadPool->notifyMainThreadIsSleeping();
-  messaging->setEligableForTermination();
+  runtime().messaging->attachMainThread(cv, m, completed);
+  runtime().threadPool->notifyMainThreadIsSleeping();
+  runtime().messaging->setEligableForTermination();
   std::unique_lock<std::mutex> lk(*m);
 #if DO_METRICS
   metrics::METRICS->timerStop("PauseMainThread", timer_key);
 #endif
   cv->wait(lk, [completed]{return *completed;});
 
-  edatActive=false;
+  runtime().edatActive=false;
 }
 
 void edatRestart() {
-  messaging->resetPolling();
-  threadPool->resetPolling();
-  edatActive=true;
+  runtime().messaging->resetPolling();
+  runtime().threadPool->resetPolling();
+  runtime().edatActive=true;
 }
 
 int edatGetRank(void) {
-  return messaging->getRank();
+  return runtime().messaging->getRank();
 }
 
 int edatGetNumRanks(void) {
-  return messaging->getNumRanks();
+  return runtime().messaging->getNumRanks();
 }
 
 int edatGetNumWorkers(void) {
-  return threadPool->getNumberOfWorkers();
+  return runtime().threadPool->getNumberOfWorkers();
 }
 
 int edatGetWorker(void) {
-  return threadPool->getCurrentWorkerId();
+  return runtime().threadPool->getCurrentWorkerId();
 }
 
 int edatGetNumActiveWorkers(void) {
-  return threadPool->getNumberActiveWorkers();
+  return runtime().threadPool->getNumberActiveWorkers();
+}
+
+int edatGetNumTaskThreads(void) {
+  return runtime().threadPool->getNumberThreads();
+}
+
+int edatGetMaxNumTaskThreads(void) {
+  return runtime().threadPool->getMaxNumberThreads();
 }
 
 void edatSubmitPersistentTask(void (*task_fn)(EDAT_Event*, int), int num_dependencies, ...) {
@@ -236,37 +338,37 @@ void edatSubmitNamedTask(void (*task_fn)(EDAT_Event*, int), const char * task_na
 void edatSubmitTask_f(void (*task_fn)(EDAT_Event*, int), const char * task_name, int num_dependencies, int ** ranks, char ** event_ids,
                         bool persistent, bool greedyConsumer) {
   std::vector<std::pair<int, std::string>> dependencies;
-  int my_rank=messaging->getRank();
+  int my_rank=runtime().messaging->getRank();
 
   for (int i=0; i<num_dependencies; i++) {
     int src=(*ranks)[i];
     if (src == EDAT_SELF) src=my_rank;
     char * event_id=event_ids[i];
     if (src == EDAT_ALL) {
-      for (int j=0;j<messaging->getNumRanks();j++) {
+      for (int j=0;j<runtime().messaging->getNumRanks();j++) {
         dependencies.push_back(std::pair<int, std::string>(j, std::string(event_id)));
       }
     } else {
       dependencies.push_back(std::pair<int, std::string>(src, std::string(event_id)));
     }
   }
-  scheduler->registerTask(task_fn, task_name == NULL ? "" : task_name, dependencies, persistent, greedyConsumer);
+  runtime().scheduler->registerTask(task_fn, task_name == NULL ? "" : task_name, dependencies, persistent, greedyConsumer);
 }
 
 int edatRemoveTask(const char * task_name) {
-  return scheduler->removeTask(std::string(task_name)) ? 1 : 0;
+  return runtime().scheduler->removeTask(std::string(task_name)) ? 1 : 0;
 }
 
 int edatIsTaskSubmitted(const char * task_name) {
-  return scheduler->edatIsTaskSubmitted(std::string(task_name)) ? 1 : 0;
+  return runtime().scheduler->edatIsTaskSubmitted(std::string(task_name)) ? 1 : 0;
 }
 
 void edatFireEvent(void* data, int data_type, int data_count, int target, const char * event_id) {
   #if DO_METRICS
     unsigned long int timer_key = metrics::METRICS->timerStart("FireEvent");
   #endif
-  if (target == EDAT_SELF) target=messaging->getRank();
-  messaging->fireEvent(data, data_count, data_type, target, false, event_id);
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEvent(data, data_count, data_type, target, false, event_id);
   #if DO_METRICS
     metrics::METRICS->timerStop("FireEvent", timer_key);
   #endif
@@ -276,19 +378,111 @@ void edatFirePersistentEvent(void* data, int data_type, int data_count, int targ
   #if DO_METRICS
     unsigned long int timer_key = metrics::METRICS->timerStart("FirePersistentEvent");
   #endif
-  if (target == EDAT_SELF) target=messaging->getRank();
-  messaging->fireEvent(data, data_count, data_type, target, true, event_id);
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEvent(data, data_count, data_type, target, true, event_id);
   #if DO_METRICS
     metrics::METRICS->timerStop("FirePersistentEvent", timer_key);
   #endif
 }
 
+void edatFireEventOwned(void* data, int data_type, int data_count, int target, const char * event_id, void (*release_fn)(void*)) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventOwned");
+  #endif
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEventOwned(data, data_count, data_type, target, event_id, release_fn);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventOwned", timer_key);
+  #endif
+}
+
+void edatFireEventCompressed(void* data, int data_type, int data_count, int target, const char * event_id) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventCompressed");
+  #endif
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEventCompressed(data, data_count, data_type, target, event_id);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventCompressed", timer_key);
+  #endif
+}
+
+void edatFireUrgentEvent(void* data, int data_type, int data_count, int target, const char * event_id) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireUrgentEvent");
+  #endif
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEventUrgent(data, data_count, data_type, target, event_id);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireUrgentEvent", timer_key);
+  #endif
+}
+
+void edatFireEventStrided(void* data, int data_type, int count, int blocklength, int stride, int target, const char * event_id) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventStrided");
+  #endif
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEventStrided(data, data_type, count, blocklength, stride, target, event_id);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventStrided", timer_key);
+  #endif
+}
+
+void edatFireEventSubarray(void* data, int data_type, int ndims, int* sizes, int* subsizes, int* starts, int target, const char * event_id) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventSubarray");
+  #endif
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  runtime().messaging->fireEventSubarray(data, data_type, ndims, sizes, subsizes, starts, target, event_id);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventSubarray", timer_key);
+  #endif
+}
+
+/**
+* Opens a channel to a target for repeatedly firing events with the given identifier, type and number of elements. The target opens a matching channel
+* to this process, and the handle returned is used to fire events on the channel
+*/
+int edatOpenChannel(int target, const char * event_id, int data_type, int data_count) {
+  if (target == EDAT_SELF) target=runtime().messaging->getRank();
+  return runtime().messaging->openChannel(target, event_id, data_type, data_count);
+}
+
+void edatFireEventOnChannel(void* data, int channel) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventOnChannel");
+  #endif
+  runtime().messaging->fireEventOnChannel(channel, data);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventOnChannel", timer_key);
+  #endif
+}
+
+/**
+* Registers a further MPI communicator (given as a Fortran handle) that events are received from and can be fired on, such as one shared with the other
+* components of a coupled code. The weight is the number of messages received from the communicator each time that it is probed
+*/
+int edatRegisterCommunicator(int communicator, int weight) {
+  return runtime().messaging->registerCommunicator(communicator, weight);
+}
+
+void edatFireEventOnCommunicator(void* data, int data_type, int data_count, int communicator, int rank, const char * event_id) {
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("FireEventOnCommunicator");
+  #endif
+  runtime().messaging->fireEventOnCommunicator(data, data_count, data_type, communicator, rank, event_id);
+  #if DO_METRICS
+    metrics::METRICS->timerStop("FireEventOnCommunicator", timer_key);
+  #endif
+}
+
 /**
 * Given an array of events, the number of events, the source rank and a specifc event identifier will return the appropriate index in the event array where that
 * can be found or -1 if none is present
 */
 int edatFindEvent(EDAT_Event * events, int number_events, int source, const char * event_id) {
-  if (source == EDAT_SELF) source=messaging->getRank();
+  if (source == EDAT_SELF) source=runtime().messaging->getRank();
   for (int i=0;i<number_events;i++) {
     if (strcmp(events[i].metadata.event_id, event_id) == 0 &&
         (source == EDAT_ANY || events[i].metadata.source == source)) return i;
@@ -298,11 +492,23 @@ int edatFindEvent(EDAT_Event * events, int number_events, int source, const char
 
 int edatDefineContext(size_t contextSize) {
   ContextDefinition * definition = new ContextDefinition(contextSize);
-  return contextManager->addDefinition(definition);
+  return runtime().contextManager->addDefinition(definition);
 }
 
 void* edatCreateContext(int contextType) {
-  return contextManager->createContext(contextType);
+  return runtime().contextManager->createContext(contextType);
+}
+
+void edatReleaseContext(void * context) {
+  runtime().contextManager->releaseContext(context);
+}
+
+/**
+* Sets the functions that pack and unpack contexts of a type when these are fired to other processes, for contexts that refer to other memory. The pack
+* function returns the number of bytes packed, or needed if it is given a null buffer, and the unpack function is given this number of bytes
+*/
+void edatSetContextSerialiser(int contextType, size_t (*pack_fn)(void*, void*), void (*unpack_fn)(void*, void*, size_t)) {
+  runtime().contextManager->setContextSerialiser(contextType, pack_fn, unpack_fn);
 }
 
 /**
@@ -313,7 +519,7 @@ EDAT_Event* edatWait(int num_dependencies, ...) {
   va_start(valist, num_dependencies);
   std::vector<std::pair<int, std::string>> dependencies = generateDependencyVector(num_dependencies, valist);
   va_end(valist);
-  return scheduler->pauseTask(dependencies);
+  return runtime().scheduler->pauseTask(dependencies);
 }
 
 EDAT_Event* edatRetrieveAny(int* retrievedNumber, int num_dependencies, ...) {
@@ -321,30 +527,30 @@ EDAT_Event* edatRetrieveAny(int* retrievedNumber, int num_dependencies, ...) {
   va_start(valist, num_dependencies);
   std::vector<std::pair<int, std::string>> dependencies = generateDependencyVector(num_dependencies, valist);
   va_end(valist);
-  std::pair<int, EDAT_Event*> foundEvents = scheduler->retrieveAnyMatchingEvents(dependencies);
+  std::pair<int, EDAT_Event*> foundEvents = runtime().scheduler->retrieveAnyMatchingEvents(dependencies);
   *retrievedNumber=foundEvents.first;
   return foundEvents.second;
 }
 
 void edatLock(char* lockName) {
-  concurrencyControl->lock(std::string(lockName));
+  runtime().concurrencyControl->lock(std::string(lockName));
 }
 
 void edatUnlock(char* lockName) {
-  concurrencyControl->unlock(std::string(lockName));
+  runtime().concurrencyControl->unlock(std::string(lockName));
 }
 
 int edatTestLock(char* lockName) {
-  if (concurrencyControl->test_lock(std::string(lockName))) return 1;
+  if (runtime().concurrencyControl->test_lock(std::string(lockName))) return 1;
   return 0;
 }
 
 void edatLockComms(void) {
-  messaging->lockComms();
+  runtime().messaging->lockComms();
 }
 
 void edatUnlockComms(void) {
-   messaging->unlockComms();
+   runtime().messaging->unlockComms();
 }
 
 /**
@@ -352,7 +558,7 @@ void edatUnlockComms(void) {
 * and package these up before calling into the scheduler
 */
 static void submitProvidedTask(void (*task_fn)(EDAT_Event*, int), std::string task_name, bool persistent, int num_dependencies, bool greedyConsumer, va_list valist) {
-  scheduler->registerTask(task_fn, task_name, generateDependencyVector(num_dependencies, valist), persistent, greedyConsumer);
+  runtime().scheduler->registerTask(task_fn, task_name, generateDependencyVector(num_dependencies, valist), persistent, greedyConsumer);
 }
 
 /**
@@ -361,14 +567,14 @@ static void submitProvidedTask(void (*task_fn)(EDAT_Event*, int), std::string ta
 */
 static std::vector<std::pair<int, std::string>> generateDependencyVector(int num_dependencies, va_list valist) {
   std::vector<std::pair<int, std::string>> dependencies;
-  int my_rank=messaging->getRank();
+  int my_rank=runtime().messaging->getRank();
 
   for (int i=0; i<num_dependencies; i++) {
     int src=va_arg(valist, int);
     if (src == EDAT_SELF) src=my_rank;
     char * event_id=va_arg(valist, char*);
     if (src == EDAT_ALL) {
-      for (int j=0;j<messaging->getNumRanks();j++) {
+      for (int j=0;j<runtime().messaging->getNumRanks();j++) {
         dependencies.push_back(std::pair<int, std::string>(j, std::string(event_id)));
       }
     } else {
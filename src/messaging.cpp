@@ -32,7 +32,30 @@
 #include <vector>
 #include <thread>
 #include <string.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <chrono>
+#include <algorithm>
 #include "misc.h"
+#include "metrics.h"
+
+#ifndef DO_METRICS
+#define DO_METRICS false
+#endif
+
+// A context sent by value has its type ahead of the packed context, padded so that the context is aligned
+#define CONTEXT_EVENT_HEADER_SIZE 8
+
+static std::map<const char*, int> progress_mode_lookup={{"busy", PROGRESS_MODE_BUSY}, {"backoff", PROGRESS_MODE_BACKOFF},
+  {"hybrid", PROGRESS_MODE_HYBRID}};
+
+/**
+* Returns the current (monotonic) time in seconds, used for tracking the rate of messages seen by the progress thread
+*/
+static double getProgressClockTime() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 /**
 * Constructor which will initialise this aspect of the messaging
@@ -41,27 +64,165 @@ Messaging::Messaging(Scheduler & a_scheduler, ThreadPool & a_threadPool, Context
                       threadPool(a_threadPool), contextManager(a_contextManager), configuration(aconfig) {
   continue_polling=true;
   progress_thread=configuration.get("EDAT_PROGRESS_THREAD", true);
+  progress_mode=configuration.get("EDAT_PROGRESS_MODE", progress_mode_lookup, PROGRESS_MODE_BUSY);
+  progress_thread_core=configuration.get("EDAT_PROGRESS_THREAD_CORE", -1);
+  backoff_min_sleep=configuration.get("EDAT_PROGRESS_BACKOFF_MIN", 1);
+  backoff_max_sleep=configuration.get("EDAT_PROGRESS_BACKOFF_MAX", 250);
+  if (backoff_min_sleep < 1) backoff_min_sleep=1;
+  if (backoff_max_sleep < backoff_min_sleep) backoff_max_sleep=backoff_min_sleep;
+  double poll_frequency=configuration.get("EDAT_PROGRESS_POLL_FREQUENCY", 10000.0);
+  hybrid_poll_interval=poll_frequency > 0 ? 1.0 / poll_frequency : 0.0001;
+  current_backoff_sleep=0;
+  recent_message_rate=0.0;
+  last_activity_time=getProgressClockTime();
+  progressWakeupPending=false;
   it_count=0;
+  rank_context=getRankContext();
+  batchLocalEvents=configuration.get("EDAT_BATCH_LOCAL_EVENTS", false);
+  number_local_event_buffers=threadPool.getNumberOfWorkers() + 1;
+  localEventBuffers=batchLocalEvents ? new LocalEventBuffer[number_local_event_buffers] : NULL;
+  local_event_sequence=0;
+  local_events_pending=0;
 }
 
 /**
-* If an event is local (to myself) then fire it locally rather than hitting the messaging system, does just one at a time to avoid starvation
+* Registers an event that has been fired to this rank. By default this is registered with the scheduler straight away by the firing thread, but if
+* local events are batched then it is instead appended to the firing worker's buffer and registered (along with the others) by the progress engine.
+* Urgent events are never buffered
 */
-bool Messaging::fireASingleLocalEvent() {
-  if (outstandingEvents.size() > 0) {
-    scheduler.registerEvent(outstandingEvents.front());
-    outstandingEvents.erase(outstandingEvents.begin());
-    return true;
+void Messaging::registerLocalEvent(SpecificEvent * event) {
+  #if DO_METRICS
+    const char * timer_name=batchLocalEvents ? "RegisterLocalEventBuffered" : "RegisterLocalEventSynchronous";
+    unsigned long int timer_key = metrics::METRICS->timerStart(timer_name);
+  #endif
+  if (batchLocalEvents && !event->isUrgent()) {
+    int worker_id=threadPool.getCurrentWorkerId();
+    LocalEventBuffer & buffer=localEventBuffers[worker_id < 0 ? 0 : (worker_id + 1) % number_local_event_buffers];
+    // Counted as pending before it is visible in the buffer, so that termination can not be determined whilst it is held there
+    local_events_pending++;
+    std::lock_guard<std::mutex> buffer_lock(buffer.mutex);
+    buffer.events.push_back(std::pair<unsigned long long, SpecificEvent*>(local_event_sequence++, event));
   } else {
-    return false;
+    scheduler.registerEvent(event);
   }
+  #if DO_METRICS
+    metrics::METRICS->timerStop(timer_name, timer_key);
+  #endif
+}
+
+/**
+* Registers the local events that have been buffered by the workers with the scheduler as a single batch. Sequence numbers are allocated whilst holding
+* the buffer's lock, so every event numbered before the bound read at the start is in its buffer by the time that is locked here. Taking just those
+* events and merging them by sequence number means that the batch is exactly the events fired before the bound, in the order they were fired. Hence
+* events with the same identifier are always registered in the order that they were fired. Returns whether any events were registered
+*/
+bool Messaging::registerBufferedLocalEvents() {
+  if (local_events_pending == 0) return false;
+  unsigned long long sequence_bound=local_event_sequence;
+  std::vector<std::pair<unsigned long long, SpecificEvent*>> bufferedEvents;
+  for (int i=0;i<number_local_event_buffers;i++) {
+    std::lock_guard<std::mutex> buffer_lock(localEventBuffers[i].mutex);
+    std::vector<std::pair<unsigned long long, SpecificEvent*>> & events=localEventBuffers[i].events;
+    std::vector<std::pair<unsigned long long, SpecificEvent*>>::iterator end=events.begin();
+    while (end != events.end() && end->first < sequence_bound) end++;
+    bufferedEvents.insert(bufferedEvents.end(), events.begin(), end);
+    events.erase(events.begin(), end);
+  }
+  if (bufferedEvents.empty()) return false;
+  #if DO_METRICS
+    unsigned long int timer_key = metrics::METRICS->timerStart("RegisterLocalEventBatch");
+    metrics::METRICS->recordValue("LocalEventBatchSize", bufferedEvents.size());
+  #endif
+  std::sort(bufferedEvents.begin(), bufferedEvents.end());
+  std::vector<SpecificEvent*> events;
+  events.reserve(bufferedEvents.size());
+  for (std::pair<unsigned long long, SpecificEvent*> & bufferedEvent : bufferedEvents) events.push_back(bufferedEvent.second);
+  scheduler.registerEvents(events);
+  // Only decremented once registered, as until then the scheduler does not know about these events for termination
+  local_events_pending-=events.size();
+  #if DO_METRICS
+    metrics::METRICS->timerStop("RegisterLocalEventBatch", timer_key);
+  #endif
+  return true;
 }
 
 /**
 * Starts the progress thread if there is to be one running
 */
 void Messaging::startProgressThread() {
-  if (progress_thread) pollingThread=new std::thread(&Messaging::entryThreadPollForEvents, this);
+  if (progress_thread) {
+    pollingThread=new std::thread(&Messaging::entryThreadPollForEvents, this);
+    if (progress_thread_core != -1) pinProgressThread();
+  }
+}
+
+/**
+* Pins the progress thread to the core provided by configuration, this is useful to keep it away from the cores that the workers are mapped to
+*/
+void Messaging::pinProgressThread() {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(progress_thread_core, &cpuset);
+  int rc = pthread_setaffinity_np(pollingThread->native_handle(), sizeof(cpu_set_t), &cpuset);
+  if (rc != 0) raiseError("Error setting pthread affinity in mapping the progress thread to a core");
+}
+
+/**
+* Called by the progress thread after each poll with the number of messages (or local events) handled in that poll. In busy mode this
+* returns immediately, in backoff mode it will sleep for an exponentially increasing time whilst there is no activity (capped by the recent
+* message rate so we don't oversleep when messages are arriving regularly) and in hybrid mode will sleep until either the local wakeup is
+* signalled or the next MPI poll is due.
+*/
+void Messaging::throttleProgressThread(int messages_handled) {
+  if (progress_mode == PROGRESS_MODE_BUSY) return;
+  double current_time=getProgressClockTime();
+  if (messages_handled > 0) {
+    double elapsed=current_time - last_activity_time;
+    if (elapsed > 0) recent_message_rate=(0.75 * recent_message_rate) + (0.25 * (messages_handled / elapsed));
+    last_activity_time=current_time;
+    current_backoff_sleep=0;
+    return;
+  }
+  if (progress_mode == PROGRESS_MODE_BACKOFF) {
+    current_backoff_sleep=current_backoff_sleep == 0 ? backoff_min_sleep : current_backoff_sleep * 2;
+    if (current_backoff_sleep > backoff_max_sleep) current_backoff_sleep=backoff_max_sleep;
+    int sleep_time=current_backoff_sleep;
+    if (recent_message_rate > 0) {
+      // Don't sleep for more than half the expected time between messages
+      int expected_gap=(int) (500000.0 / recent_message_rate);
+      if (expected_gap < backoff_min_sleep) expected_gap=backoff_min_sleep;
+      if (sleep_time > expected_gap) sleep_time=expected_gap;
+    }
+    // Decay the message rate so that a period of quiet allows the back off to increase to its maximum
+    recent_message_rate*=0.9;
+    if (waitForMoreProgressWork(sleep_time / 1000000.0)) current_backoff_sleep=0;
+  } else if (progress_mode == PROGRESS_MODE_HYBRID) {
+    waitForMoreProgressWork(hybrid_poll_interval);
+  }
+}
+
+/**
+* Sleeps the progress thread for at most the provided number of seconds, returning early if the local wakeup is signalled (i.e. an event
+* has been fired or the main thread is waiting for termination.) Returns whether the sleep was ended by the wakeup or not
+*/
+bool Messaging::waitForMoreProgressWork(double max_time) {
+  std::unique_lock<std::mutex> lock(progressWakeupMtx);
+  if (!progressWakeupPending) {
+    progressWakeupCv.wait_for(lock, std::chrono::duration<double>(max_time), [this]{return this->progressWakeupPending;});
+  }
+  bool woken=progressWakeupPending;
+  progressWakeupPending=false;
+  return woken;
+}
+
+/**
+* Signals the local wakeup of the progress thread, this is a no-op unless the progress thread might be sleeping
+*/
+void Messaging::wakeProgressThread() {
+  if (!progress_thread || progress_mode == PROGRESS_MODE_BUSY) return;
+  std::lock_guard<std::mutex> lock(progressWakeupMtx);
+  progressWakeupPending=true;
+  progressWakeupCv.notify_one();
 }
 
 void Messaging::resetPolling() {
@@ -98,9 +259,10 @@ void Messaging::reactivateMainThread() {
 
 /**
 * Entry method for polling for events in a thread, after this has completed it will wake up the main thread (waiting in finalisation) as everything is
-* ready to be shutdown
+* ready to be shutdown. The progress thread belongs to the same rank as the thread that created the messaging
 */
 void Messaging::entryThreadPollForEvents() {
+  setRankContext(rank_context);
   runPollForEvents();
   // Wake up condition variable now
   reactivateMainThread();
@@ -125,7 +287,7 @@ bool Messaging::checkForLocalTermination() {
     lockMutexForFinalisationTest();
     scheduler.lockMutexForFinalisationTest();
     threadPool.lockMutexForFinalisationTest();
-    bool finished=isFinished() && scheduler.isFinished() && threadPool.isThreadPoolFinished();
+    bool finished=local_events_pending == 0 && isFinished() && scheduler.isFinished() && threadPool.isThreadPoolFinished();
     threadPool.unlockMutexForFinalisationTest();
     scheduler.unlockMutexForFinalisationTest();
     unlockMutexForFinalisationTest();
@@ -143,6 +305,218 @@ void Messaging::attachMainThread(std::condition_variable * cdt, std::mutex * cdt
   this->mainThreadConditionVariable = cdt;
   this->mainThreadConditionVarMutex = cdt_mutex;
   this->mainThreadConditionVarPred = cdt_pred;
+  wakeProgressThread();
+}
+
+/**
+* Fires an event with the payload compressed when it is sent to another process. Transports that do not compress payloads fire it as a normal event
+*/
+void Messaging::fireEventCompressed(void * data, int data_count, int data_type, int target, const char * event_id) {
+  fireEvent(data, data_count, data_type, target, false, event_id);
+}
+
+/**
+* Fires an event that is delivered ahead of normal events. Transports that do not have a separate path for urgent events fire it as a normal event
+*/
+void Messaging::fireEventUrgent(void * data, int data_count, int data_type, int target, const char * event_id) {
+  fireEvent(data, data_count, data_type, target, false, event_id);
+}
+
+/**
+* Fires an event whose payload is a strided layout in the caller's memory, count blocks of blocklength elements with the start of each block stride
+* elements after the previous one. This is a two dimensional sub-array, of count rows of stride elements where the first blocklength of each row are
+* included, and is fired as such. The event is delivered contiguously
+*/
+void Messaging::fireEventStrided(void * data, int data_type, int count, int blocklength, int stride, int target, const char * event_id) {
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not fire a context as a strided event");
+  if (count < 0 || blocklength < 0 || (count > 1 && stride < blocklength)) raiseError("Invalid layout of a strided event");
+  int sizes[2]={count, count > 1 ? stride : blocklength}, subsizes[2]={count, blocklength}, starts[2]={0, 0};
+  fireEventFromLayout(data, data_type, 2, sizes, subsizes, starts, count * blocklength, target, event_id);
+}
+
+/**
+* Fires an event whose payload is a sub-array of an array of ndims dimensions in the caller's memory, which is in row major order (the last dimension
+* varies fastest.) The event is delivered contiguously, in row major order
+*/
+void Messaging::fireEventSubarray(void * data, int data_type, int ndims, int * sizes, int * subsizes, int * starts, int target,
+                                  const char * event_id) {
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not fire a context as a sub-array event");
+  if (ndims < 1) raiseError("A sub-array event must have at least one dimension");
+  int data_count=1;
+  for (int i=0;i<ndims;i++) {
+    if (subsizes[i] < 0 || starts[i] < 0 || starts[i] + subsizes[i] > sizes[i]) raiseError("Invalid layout of a sub-array event");
+    data_count*=subsizes[i];
+  }
+  fireEventFromLayout(data, data_type, ndims, sizes, subsizes, starts, data_count, target, event_id);
+}
+
+/**
+* Fires an event whose payload is a (validated) sub-array of the caller's memory. Transports that can not send from the layout directly gather the
+* sub-array into a buffer that is fired as an owned event, hence the data is copied once (rather than packed by the caller and then copied by EDAT)
+*/
+void Messaging::fireEventFromLayout(void * data, int data_type, int ndims, int * sizes, int * subsizes, int * starts, int data_count, int target,
+                                    const char * event_id) {
+  int type_size=getTypeSize(data_type);
+  char * buffer=data_count > 0 ? (char*) malloc((size_t) type_size * data_count) : NULL;
+  if (buffer != NULL) gatherSubarray(buffer, (char*) data, type_size, ndims, sizes, subsizes, starts);
+  fireEventOwned(buffer, data_count, data_type, target, event_id, NULL);
+}
+
+/**
+* Gathers a sub-array of an array of ndims dimensions in row major order, with elements of the given size in bytes, into a contiguous destination
+*/
+void Messaging::gatherSubarray(char * destination, char * source, int type_size, int ndims, int * sizes, int * subsizes, int * starts) {
+  // Trailing dimensions that are entirely included are merged into the contiguous run of the innermost dimension that is not
+  int inner=ndims - 1;
+  size_t run_elements=subsizes[inner];
+  while (inner > 0 && subsizes[inner] == sizes[inner]) {
+    inner--;
+    run_elements*=subsizes[inner];
+  }
+  std::vector<size_t> dimension_strides(ndims);
+  size_t offset=0;
+  dimension_strides[ndims - 1]=type_size;
+  for (int i=ndims - 2;i>=0;i--) dimension_strides[i]=dimension_strides[i + 1] * sizes[i + 1];
+  for (int i=0;i<ndims;i++) offset+=starts[i] * dimension_strides[i];
+  // Step through the outer dimensions (those beyond the runs) like an odometer, the innermost of these are gathered as strided blocks
+  std::vector<int> outer_indicies(ndims, 0);
+  int number_blocks=inner > 0 ? subsizes[inner - 1] : 1;
+  size_t block_stride=inner > 0 ? dimension_strides[inner - 1] : 0;
+  bool more=true;
+  while (more) {
+    size_t source_offset=offset;
+    for (int i=0;i<inner - 1;i++) source_offset+=outer_indicies[i] * dimension_strides[i];
+    gatherBlocks(destination, &source[source_offset], number_blocks, run_elements * type_size, block_stride);
+    destination+=number_blocks * run_elements * type_size;
+    more=false;
+    for (int i=inner - 2;i>=0 && !more;i--) {
+      if (++outer_indicies[i] < subsizes[i]) {
+        more=true;
+      } else {
+        outer_indicies[i]=0;
+      }
+    }
+  }
+}
+
+/**
+* Gathers a number of blocks, each of the given size in bytes and the given stride in bytes apart, into a contiguous destination. Blocks of a single
+* four or eight byte element (such as a column of a row major array) are copied with a fixed size, which the compiler turns into a single move
+*/
+void Messaging::gatherBlocks(char * destination, char * source, int number_blocks, size_t block_bytes, size_t stride_bytes) {
+  if (block_bytes == 8) {
+    for (int i=0;i<number_blocks;i++) memcpy(&destination[i * 8], &source[i * stride_bytes], 8);
+  } else if (block_bytes == 4) {
+    for (int i=0;i<number_blocks;i++) memcpy(&destination[i * 4], &source[i * stride_bytes], 4);
+  } else {
+    for (int i=0;i<number_blocks;i++) memcpy(&destination[i * block_bytes], &source[i * stride_bytes], block_bytes);
+  }
+}
+
+/**
+* Opens a channel to a target for events with a fixed identifier, type and number of elements and returns its handle. Transports that do not have
+* persistent communication fire events on the channel as normal events, so here the channel is just recorded
+*/
+int Messaging::openChannel(int target, const char * event_id, int data_type, int data_count) {
+  return registerChannel(target, event_id, data_type, data_count, NULL);
+}
+
+/**
+* Fires an event on a channel, the data is the channel's number of elements of its type. This is the fallback that fires it as a normal event
+*/
+void Messaging::fireEventOnChannel(int channel, void * data) {
+  ChannelDescriptor descriptor=getChannelDescriptor(channel);
+  fireEvent(data, descriptor.data_count, descriptor.data_type, descriptor.target, false, descriptor.event_id.c_str());
+}
+
+/**
+* Registers a further MPI communicator that events are received from and can be fired on, this is only supported by the point to point transport
+*/
+int Messaging::registerCommunicator(int, int) {
+  raiseError("Registering communicators is only supported by the point to point transport");
+  return -1;
+}
+
+/**
+* Fires an event to a rank of a registered communicator, this is only supported by the point to point transport
+*/
+void Messaging::fireEventOnCommunicator(void *, int, int, int, int, const char *) {
+  raiseError("Registering communicators is only supported by the point to point transport");
+}
+
+/**
+* Records a channel, returning its handle. There is at most one channel per target and event identifier so if this is already open then the existing
+* handle is returned (its type and number of elements must match.) Whether the channel was newly recorded is returned via the last argument if given
+*/
+int Messaging::registerChannel(int target, const char * event_id, int data_type, int data_count, bool * created) {
+  if (target < 0 || target >= getNumRanks()) raiseError("A channel must be opened to a single target process");
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not open a channel for a context");
+  if (data_count < 0) raiseError("The number of elements of a channel can not be negative");
+  std::lock_guard<std::mutex> lock(channelDescriptors_mutex);
+  for (size_t i=0;i<channelDescriptors.size();i++) {
+    if (channelDescriptors[i].target == target && channelDescriptors[i].event_id == event_id) {
+      if (channelDescriptors[i].data_type != data_type || channelDescriptors[i].data_count != data_count) {
+        raiseError("A channel is already open to this target for the event identifier with a different type or number of elements");
+      }
+      if (created != NULL) *created=false;
+      return i;
+    }
+  }
+  ChannelDescriptor descriptor;
+  descriptor.target=target;
+  descriptor.data_type=data_type;
+  descriptor.data_count=data_count;
+  descriptor.event_id=std::string(event_id);
+  channelDescriptors.push_back(descriptor);
+  if (created != NULL) *created=true;
+  return channelDescriptors.size() - 1;
+}
+
+/**
+* Retrieves a copy of the descriptor of a channel from its handle
+*/
+ChannelDescriptor Messaging::getChannelDescriptor(int channel) {
+  std::lock_guard<std::mutex> lock(channelDescriptors_mutex);
+  if (channel < 0 || channel >= (int) channelDescriptors.size()) raiseError("Unknown channel");
+  return channelDescriptors[channel];
+}
+
+/**
+* Packs a context for sending to another process by value, as a pointer to it is meaningless there. The packed event is bytes, the context type
+* (padded out to eight bytes) followed by the packed context. The size in bytes is returned via the last argument
+*/
+char * Messaging::packContextEvent(int context_type, void * context, int * packed_size) {
+  size_t context_size=contextManager.getPackedContextSize(context_type, context);
+  *packed_size=CONTEXT_EVENT_HEADER_SIZE + context_size;
+  char * packed=(char*) malloc(*packed_size);
+  memset(packed, 0, CONTEXT_EVENT_HEADER_SIZE);
+  memcpy(packed, &context_type, sizeof(int));
+  if (context_size > 0) contextManager.packContext(context_type, context, &packed[CONTEXT_EVENT_HEADER_SIZE]);
+  return packed;
+}
+
+/**
+* Re-materialises a context that has arrived from another process, the packed event is replaced by one that refers to a context from the pool of this
+* process (as with a context fired locally) and which the consumer is responsible for releasing
+*/
+SpecificEvent * Messaging::unpackContextEvent(SpecificEvent * packed) {
+  char * data=packed->getData();
+  int context_type;
+  memcpy(&context_type, data, sizeof(int));
+  void * context=contextManager.unpackContext(context_type, &data[CONTEXT_EVENT_HEADER_SIZE],
+                                              packed->getRawDataLength() - CONTEXT_EVENT_HEADER_SIZE);
+  char * context_pointer=(char*) malloc(sizeof(char*));
+  memcpy(context_pointer, &context, sizeof(context));
+  SpecificEvent * event=new SpecificEvent(packed->getSourcePid(), 1, sizeof(char*), context_type, packed->isPersistent(), true,
+                                          packed->getEventId(), context_pointer);
+  event->setUrgent(packed->isUrgent());
+  if (packed->getPayload() != NULL) {
+    packed->getPayload()->release();
+  } else {
+    free(data);
+  }
+  delete packed;
+  return event;
 }
 
 /**
@@ -37,15 +37,51 @@
 #include "configuration.h"
 #include <vector>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <utility>
+#include <string>
+
+#define PROGRESS_MODE_BUSY 0
+#define PROGRESS_MODE_BACKOFF 1
+#define PROGRESS_MODE_HYBRID 2
+
+// Local events fired by a worker (or by a thread that is not a worker for the first buffer), each is tagged with a sequence number so that the events
+// from all the buffers can be registered in the order that they were fired
+struct LocalEventBuffer {
+  std::mutex mutex;
+  std::vector<std::pair<unsigned long long, SpecificEvent*>> events;
+};
+
+// A channel opened to a target for events with a fixed identifier, type and number of elements, identified by its index in the list of channels
+struct ChannelDescriptor {
+  int target, data_type, data_count;
+  std::string event_id;
+};
 
 class Messaging {
-  std::vector<SpecificEvent*> outstandingEvents;
+  LocalEventBuffer * localEventBuffers;
+  int number_local_event_buffers;
+  bool batchLocalEvents;
+  std::atomic<unsigned long long> local_event_sequence;
+  std::atomic<int> local_events_pending;
   std::thread * pollingThread=NULL;
   std::condition_variable * mainThreadConditionVariable= NULL;
   std::mutex * mainThreadConditionVarMutex, cdtAccessMtx, singleProgressMtx;
   bool * mainThreadConditionVarPred;
+  int progress_mode, progress_thread_core, backoff_min_sleep, backoff_max_sleep, current_backoff_sleep;
+  double hybrid_poll_interval, recent_message_rate, last_activity_time;
+  std::mutex progressWakeupMtx;
+  std::condition_variable progressWakeupCv;
+  bool progressWakeupPending;
+  void * rank_context;
+  std::vector<ChannelDescriptor> channelDescriptors;
+  std::mutex channelDescriptors_mutex;
   virtual void entryThreadPollForEvents();
   virtual void reactivateMainThread();
+  void pinProgressThread();
+  bool waitForMoreProgressWork(double);
 protected:
   Scheduler & scheduler;
   ThreadPool & threadPool;
@@ -54,12 +90,22 @@ protected:
   bool continue_polling;
   bool progress_thread;
   int it_count;
-  virtual bool fireASingleLocalEvent();
+  void registerLocalEvent(SpecificEvent*);
+  virtual bool registerBufferedLocalEvents();
   virtual bool checkForLocalTermination();
   Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&);
   virtual bool performSinglePoll(int*) = 0;
   virtual int getTypeSize(int);
+  virtual void fireEventFromLayout(void *, int, int, int *, int *, int *, int, int, const char *);
+  static void gatherSubarray(char*, char*, int, int, int*, int*, int*);
+  static void gatherBlocks(char*, char*, int, size_t, size_t);
+  char * packContextEvent(int, void *, int *);
+  SpecificEvent * unpackContextEvent(SpecificEvent*);
   virtual void startProgressThread();
+  void throttleProgressThread(int);
+  void wakeProgressThread();
+  int registerChannel(int, const char *, int, int, bool*);
+  ChannelDescriptor getChannelDescriptor(int);
 public:
   virtual void lockMutexForFinalisationTest() = 0;
   virtual void unlockMutexForFinalisationTest() = 0;
@@ -69,6 +115,15 @@ public:
   virtual bool pollForEvents();
   virtual void finalise();
   virtual void fireEvent(void *, int, int, int, bool, const char *) = 0;
+  virtual void fireEventOwned(void *, int, int, int, const char *, void (*)(void*)) = 0;
+  virtual void fireEventCompressed(void *, int, int, int, const char *);
+  virtual void fireEventUrgent(void *, int, int, int, const char *);
+  void fireEventStrided(void *, int, int, int, int, int, const char *);
+  void fireEventSubarray(void *, int, int, int *, int *, int *, int, const char *);
+  virtual int openChannel(int, const char *, int, int);
+  virtual void fireEventOnChannel(int, void *);
+  virtual int registerCommunicator(int, int);
+  virtual void fireEventOnCommunicator(void *, int, int, int, int, const char *);
   virtual int getRank()=0;
   virtual int getNumRanks()=0;
   virtual bool isFinished()=0;
@@ -105,6 +105,19 @@ void EDAT_Metrics::threadReport(int myThreadId, ns active_time) {
   return;
 }
 
+void EDAT_Metrics::recordValue(std::string value_name, double value) {
+  // records a sample of some named quantity (e.g. the number of threads) and
+  // tracks the min, max and mean of the samples
+  std::lock_guard<std::mutex> lock(values_mutex);
+  Values & values = recorded_values[value_name];
+  if (values.num_samples == 0 || value < values.min) values.min = value;
+  if (values.num_samples == 0 || value > values.max) values.max = value;
+  values.sum += value;
+  values.num_samples++;
+
+  return;
+}
+
 unsigned long int EDAT_Metrics::getTimerKey(void) {
   // statically initialises a ulong int and increments on every call
   // thread-safe
@@ -157,6 +170,15 @@ void EDAT_Metrics::writeOut(void) {
       << "\t" << sum.count() << "\n";
   }
 
+  if (!recorded_values.empty()) {
+    buffer << "Values\nNAME\tSAMPLES\tMEAN\tMIN\tMAX\n";
+    for (std::map<std::string,Values>::iterator value=recorded_values.begin(); value!=recorded_values.end(); ++value) {
+      buffer << value->first << "\t" << value->second.num_samples << "\t"
+        << value->second.sum / value->second.num_samples << "\t" << value->second.min
+        << "\t" << value->second.max << "\n";
+    }
+  }
+
   buffer << "Task Timing [log10(seconds)]: \nMagnitude:  <=-7";
   for (int mag=-6; mag<2; mag++) buffer << " " << std::setw(5) << mag;
   buffer << "   >=2\n    Count:";
@@ -50,6 +50,13 @@ struct Timings {
   std::map<unsigned long int,std::chrono::steady_clock::time_point> start_times;
 };
 
+struct Values {
+  int num_samples = 0;
+  double min = 0.0;
+  double max = 0.0;
+  double sum = 0.0;
+};
+
 class EDAT_Metrics {
 private:
   Configuration & configuration;
@@ -57,6 +64,8 @@ private:
   unsigned long int edat_timer_key;
   std::mutex event_times_mutex;
   std::map<std::string,Timings> event_times;
+  std::mutex values_mutex;
+  std::map<std::string,Values> recorded_values;
   std::vector<ns> thread_active;
   std::vector<double> thread_active_pc;
   int task_time_bins[10] = {0};
@@ -70,6 +79,7 @@ public:
   unsigned long int timerStart(std::string);
   void timerStop(std::string, unsigned long int);
   void threadReport(int myThreadId, ns active_time);
+  void recordValue(std::string, double);
   void finalise(void);
 };
 
@@ -35,6 +35,9 @@
 #include "misc.h"
 #include "edat.h"
 
+// The runtime of the logical rank that the calling thread belongs to, this is only set when several ranks run within the one process
+static thread_local void * rank_context=NULL;
+
 /**
 * Displays an error message to stderror and aborts
 */
@@ -58,3 +61,17 @@ int getBaseTypeSize(int type) {
   return -1;
 }
 
+
+/**
+* Sets the rank context of the calling thread, threads launched by the runtime inherit the rank context of the thread that launched them
+*/
+void setRankContext(void * context) {
+  rank_context=context;
+}
+
+/**
+* Retrieves the rank context of the calling thread, this is NULL unless logical ranks are being run as threads within the one process
+*/
+void * getRankContext() {
+  return rank_context;
+}
@@ -36,5 +36,7 @@
 
 void raiseError(const char*);
 int getBaseTypeSize(int);
+void setRankContext(void*);
+void * getRankContext();
 
 #endif /* SRC_MISC_H_ */
@@ -32,23 +32,67 @@
 #include "misc.h"
 #include "scheduler.h"
 #include "metrics.h"
+#include "compression.h"
 #include <string.h>
 #include <stdlib.h>
 #include <string.h>
 #include <mpi.h>
 #include <mutex>
 #include <cstdlib>
-#include <ctime>
+#include <algorithm>
 
 #ifndef DO_METRICS
 #define DO_METRICS false
 #endif
 
 #define MPI_TAG 16384
-#define MPI_TERMINATION_TAG 16385
-#define MPI_TERMINATION_CONFIRM_TAG 16386
+#define MPI_LARGE_TAG 16387
+#define MPI_CHUNK_TAG 16389
 #define SEND_PROGRESS_PERIOD 10
-#define MAX_TERMINATION_COUNT 100
+#define DEFAULT_SEND_SLAB_SIZE 1024
+#define DEFAULT_EAGER_THRESHOLD 8192
+#define DEFAULT_CHUNK_THRESHOLD 4194304
+#define DEFAULT_CHUNK_SIZE 1048576
+#define DEFAULT_CHUNKS_IN_FLIGHT 4
+#define DEFAULT_POLL_MESSAGE_BUDGET 256
+#define DEFAULT_CHANNEL_DEPTH 4
+#define DEFAULT_CHANNEL_SEND_BUFFERS 16
+#define DEFAULT_MAX_PROBE_INTERVAL 64
+// Tags of persistent channels (on their own communicator) are derived from the event identifier, within the range that MPI guarantees
+#define CHANNEL_TAG_RANGE 32768
+// Every message starts with the wire format version and flags, a single event packet then has variable length integers for the data type, number
+// of elements, source rank and event identifier handle, followed by the event identifier string (with its length) on first use of the handle
+#define WIRE_FORMAT_VERSION 4
+#define PACKET_FLAG_PERSISTENT 0x1
+#define PACKET_FLAG_COALESCED 0x2
+#define PACKET_FLAG_LARGE 0x4
+#define PACKET_FLAG_NEW_EVENT_ID 0x8
+// A chunked event packet has the header alone, followed by an integer chunk size (at the payload offset) and the payload follows in chunks
+#define PACKET_FLAG_CHUNKED 0x10
+// The payload of the event is compressed, its compressed size follows the header and then the compressed bytes
+#define PACKET_FLAG_COMPRESSED 0x20
+// The event was fired as urgent (and sent on the urgent lane), the target delivers it ahead of normal events
+#define PACKET_FLAG_URGENT 0x40
+// The payload is a context sent by value (its type and then the packed context), the target re-materialises it from its own pool of contexts
+#define PACKET_FLAG_CONTEXT 0x80
+#define MAX_VARINT_SIZE 5
+// Payload data is padded to this alignment within a packet (and packets within a coalesced message), so that events can point directly into the buffer
+#define PAYLOAD_ALIGNMENT 8
+#define ALIGN_TO_PAYLOAD(x) (((x) + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1))
+// Coalesced messages and announcements of large messages have a fixed header of the version, flags, two padding bytes and an integer (the number of
+// events or the size of the large message respectively)
+#define FIXED_HEADER_SIZE 8
+#define COALESCED_HEADER_SIZE FIXED_HEADER_SIZE
+#define MIN_RECV_BUFFER_SIZE 64
+#define MIN_LANE_RECV_RING_SIZE 4
+#define DEFAULT_SHARED_RING_SIZE 65536
+#define DEFAULT_SHARED_SLAB_SIZE 262144
+#define RECV_BUFFER_ALIGNMENT 64
+
+static int getVarintSize(unsigned int);
+static int writeVarint(char*, unsigned int);
+static int readVarint(char*, unsigned int*);
+static int getChannelTag(const char*);
 
 /**
 * Initialises MPI if it has not already been initialised at serialised mode. If it has been initialised then checks which mode it is in to
@@ -66,10 +110,12 @@ MPI_P2P_Messaging::MPI_P2P_Messaging(Scheduler & a_scheduler, ThreadPool & a_thr
 
 /**
 * Initialises the MPI transport layer with a specific communicator that all EDAT processes belong to. If MPI is already initialised this is fine,
-* we just go with that if it is in serialised or thread multiple mode, otherwise we initialise MPI here too.
+* we just go with that if it is in serialised or thread multiple mode, otherwise we initialise MPI here too (in thread multiple mode if that
+* has been requested via the configuration, otherwise serialised.)
 */
 void MPI_P2P_Messaging::initialise(MPI_Comm comm) {
   int is_mpi_init, provided;
+  threadMultiple=configuration.get("EDAT_MPI_THREAD_MULTIPLE", false);
   MPI_Initialized(&is_mpi_init);
   if (is_mpi_init) {
     mpiInitHere = false;
@@ -80,34 +126,322 @@ void MPI_P2P_Messaging::initialise(MPI_Comm comm) {
     protectMPI = provided == MPI_THREAD_SERIALIZED;
   } else {
     mpiInitHere = true;
-    MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
-    protectMPI = true;
+    MPI_Init_thread(NULL, NULL, threadMultiple ? MPI_THREAD_MULTIPLE : MPI_THREAD_SERIALIZED, &provided);
+    protectMPI = provided != MPI_THREAD_MULTIPLE;
+  }
+  if (threadMultiple && provided != MPI_THREAD_MULTIPLE) {
+    raiseError("EDAT_MPI_THREAD_MULTIPLE requires MPI to be initialised in thread multiple mode, which this MPI library does not provide");
   }
   communicator=comm;
   if (protectMPI) mpi_mutex.lock();
   MPI_Comm_rank(communicator, &my_rank);
   MPI_Comm_size(communicator, &total_ranks);
-  std::srand(std::time(nullptr));
   if (protectMPI) mpi_mutex.unlock();
-  if (my_rank == 0) {
-    termination_codes=new int[total_ranks];
-    pingback_termination_codes=new int[total_ranks];
-    for (int i=0;i<total_ranks;i++) termination_codes[i]=-1;
-  }
+  // Termination waves are on their own communicator, so these collectives are independent of the event messages
+  MPI_Comm_dup(communicator, &termination_communicator);
+  // Persistent channels are also on their own communicator, so their tags can not clash with those of the lanes
+  MPI_Comm_dup(communicator, &channel_communicator);
+  previous_wave_completed=false;
+  messages_received.resize(total_ranks, 0);
   terminated=false;
   eligable_for_termination=false;
   batchEvents=configuration.get("EDAT_BATCH_EVENTS", false);
   max_batched_events=configuration.get("EDAT_MAX_BATCHED_EVENTS", 1000);
   batch_timeout=configuration.get("EDAT_BATCHING_EVENTS_TIMEOUT", 0.1);
-  enableBridge=configuration.get("EDAT_ENABLE_BRIDGE", false);
+  eager_threshold=configuration.get("EDAT_EAGER_THRESHOLD", DEFAULT_EAGER_THRESHOLD);
+  coalesceEvents=configuration.get("EDAT_COALESCE_EVENTS", false);
+  coalesce_max_bytes=configuration.get("EDAT_COALESCE_MAX_BYTES", 65536);
+  coalesce_max_events=configuration.get("EDAT_COALESCE_MAX_EVENTS", 256);
+  coalesce_timeout=configuration.get("EDAT_COALESCE_TIMEOUT", 0.0001);
+  coalesced_events_pending=0;
+  recv_buffer_size=configuration.get("EDAT_RECV_BUFFER_SIZE", 8192);
+  if (recv_buffer_size < MIN_RECV_BUFFER_SIZE) recv_buffer_size=MIN_RECV_BUFFER_SIZE;
+  recv_ring_size=configuration.get("EDAT_RECV_RING_SIZE", 32);
+  if (recv_ring_size < 1) raiseError("The receive ring size must be at least one");
+  recv_copy_threshold=configuration.get("EDAT_RECV_COPY_THRESHOLD", 256);
+  chunk_threshold=configuration.get("EDAT_CHUNK_THRESHOLD", DEFAULT_CHUNK_THRESHOLD);
+  chunk_size=configuration.get("EDAT_CHUNK_SIZE", DEFAULT_CHUNK_SIZE);
+  if (chunk_size < 1) raiseError("The chunk size must be at least one byte");
+  chunks_in_flight=configuration.get("EDAT_CHUNKS_IN_FLIGHT", DEFAULT_CHUNKS_IN_FLIGHT);
+  if (chunks_in_flight < 1) raiseError("The number of chunks in flight must be at least one");
+  chunkStreaming=configuration.get("EDAT_CHUNK_STREAMING", false);
+  chunked_sends_pending=0;
+  compression_threshold=configuration.get("EDAT_COMPRESSION_THRESHOLD", 0);
+  poll_message_budget=configuration.get("EDAT_POLL_MESSAGE_BUDGET", DEFAULT_POLL_MESSAGE_BUDGET);
+  if (poll_message_budget < 1) raiseError("The poll message budget must be at least one");
+  poll_time_budget=configuration.get("EDAT_POLL_TIME_BUDGET", 0.0);
+  channel_depth=configuration.get("EDAT_CHANNEL_DEPTH", DEFAULT_CHANNEL_DEPTH);
+  if (channel_depth < 1) raiseError("The channel depth must be at least one");
+  channel_send_buffers=configuration.get("EDAT_CHANNEL_SEND_BUFFERS", DEFAULT_CHANNEL_SEND_BUFFERS);
+  if (channel_send_buffers < 1) raiseError("The number of channel send buffers must be at least one");
+  max_probe_interval=configuration.get("EDAT_MAX_PROBE_INTERVAL", DEFAULT_MAX_PROBE_INTERVAL);
+  if (max_probe_interval < 1) raiseError("The maximum probe interval must be at least one");
+  initialiseLanes();
+  // The bridge is MPI_COMM_WORLD in the routing table, for receiving events from an EDAT program that runs over the whole of MPI_COMM_WORLD
+  if (configuration.get("EDAT_ENABLE_BRIDGE", false)) addRoutedCommunicator(MPI_COMM_WORLD, 1);
+  if (configuration.get("EDAT_SHARED_MEMORY", false)) {
+    if (protectMPI) mpi_mutex.lock();
+    sharedMemory=new SharedMemoryTransport(communicator, configuration.get("EDAT_SHARED_RING_SIZE", DEFAULT_SHARED_RING_SIZE),
+                                           configuration.get("EDAT_SHARED_SLAB_SIZE", DEFAULT_SHARED_SLAB_SIZE), recv_buffer_size);
+    if (protectMPI) mpi_mutex.unlock();
+  } else {
+    sharedMemory=NULL;
+  }
   if (doesProgressThreadExist()) startProgressThread();
 }
 
+/**
+* Initialises the lanes of communication. In MPI thread multiple mode there is a lane per worker (the maximum number of workers across the processes,
+* as the lanes must match up) and each of these beyond the first is on a duplicate of the EDAT communicator. Otherwise there is a single lane on
+* the EDAT communicator. After these is the urgent lane, which is also on a duplicate of the communicator so that urgent events are matched
+* separately from (and hence never queue behind) normal ones. Events on the urgent lane are not coalesced. The configured receive ring size is shared
+* between the sending lanes, so the memory pinned by pre-posted receives (and the number of receives tested on each poll) does not grow with the
+* number of lanes, although each lane (including the urgent lane) has a minimum number of receives
+*/
+void MPI_P2P_Messaging::initialiseLanes() {
+  number_sending_lanes=1;
+  if (threadMultiple) {
+    int number_workers=threadPool.getNumberOfWorkers();
+    MPI_Allreduce(&number_workers, &number_sending_lanes, 1, MPI_INT, MPI_MAX, communicator);
+  }
+  number_lanes=number_sending_lanes + 1;
+  recv_ring_size=std::max(MIN_LANE_RECV_RING_SIZE, (recv_ring_size + number_sending_lanes - 1) / number_sending_lanes);
+  int send_slab_size=configuration.get("EDAT_SEND_SLAB_SIZE", DEFAULT_SEND_SLAB_SIZE);
+  lanes=new MessagingLane[number_lanes];
+  urgentLane=&lanes[number_lanes - 1];
+  for (int i=0;i<number_lanes;i++) {
+    if (i == 0) {
+      lanes[i].communicator=communicator;
+    } else {
+      MPI_Comm_dup(communicator, &lanes[i].communicator);
+    }
+    lanes[i].messages_sent.resize(total_ranks, 0);
+    lanes[i].sentEventIds.resize(total_ranks);
+    lanes[i].receivedEventIds.resize(total_ranks);
+    lanes[i].coalesceBuffers=coalesceEvents && &lanes[i] != urgentLane ? new CoalesceBuffer[total_ranks] : NULL;
+    initialiseReceiveRing(lanes[i]);
+    allocateSendSlab(lanes[i], send_slab_size);
+  }
+}
+
+/**
+* Retrieves the lane that the calling thread sends on, which is that of the worker in MPI thread multiple mode. Threads that are not workers (the
+* main and progress threads) send on the first lane
+*/
+MessagingLane & MPI_P2P_Messaging::getSendingLane() {
+  if (number_sending_lanes == 1) return lanes[0];
+  int worker_id=threadPool.getCurrentWorkerId();
+  return lanes[worker_id < 0 ? 0 : worker_id % number_sending_lanes];
+}
+
 /**
 * Fires an event, either remote or local event. Also handles when we are sending to all targets rather than just
 * one specific process
 */
 void MPI_P2P_Messaging::fireEvent(void * data, int data_count, int data_type, int target, bool persistent, const char * event_id) {
+  fireEvent(data, data_count, data_type, target, persistent, event_id, false, false);
+}
+
+/**
+* Fires an event where the payload is compressed when it is sent to other processes, the local target (if any) is given the data uncompressed
+*/
+void MPI_P2P_Messaging::fireEventCompressed(void * data, int data_count, int data_type, int target, const char * event_id) {
+  fireEvent(data, data_count, data_type, target, false, event_id, true, false);
+}
+
+/**
+* Fires an urgent event, this is sent to remote targets on the urgent lane and every target delivers it ahead of normal events
+*/
+void MPI_P2P_Messaging::fireEventUrgent(void * data, int data_count, int data_type, int target, const char * event_id) {
+  fireEvent(data, data_count, data_type, target, false, event_id, false, true);
+}
+
+/**
+* Opens a channel with a target, which is also opened by the target with this process (with the same event identifier, type and number of elements.)
+* Events are then fired in both directions without a header, using persistent requests and buffers. A channel to this process is just recorded, as
+* events on it are fired as normal local events
+*/
+int MPI_P2P_Messaging::openChannel(int target, const char * event_id, int data_type, int data_count) {
+  bool created;
+  std::lock_guard<std::mutex> lock(persistentChannels_mutex);
+  int channel=registerChannel(target, event_id, data_type, data_count, &created);
+  if (created) {
+    persistentChannels.resize(channel + 1, NULL);
+    if (target != my_rank) persistentChannels[channel]=createPersistentChannel(target, event_id, data_type, data_count);
+  }
+  return channel;
+}
+
+/**
+* Creates a persistent channel with a peer and starts its receives. The tag is a hash of the event identifier, so both ends agree on it regardless of
+* the order that channels are opened in, and two channels with the same peer whose tags clash are an error. Must be called with the persistent channels
+* mutex held
+*/
+PersistentChannel * MPI_P2P_Messaging::createPersistentChannel(int peer, const char * event_id, int data_type, int data_count) {
+  int tag=getChannelTag(event_id);
+  for (PersistentChannel * existing : persistentChannels) {
+    if (existing != NULL && existing->peer == peer && existing->tag == tag) {
+      raiseError("The event identifier of a channel clashes with that of another channel to the same process, use a different identifier");
+    }
+  }
+  PersistentChannel * channel=new PersistentChannel();
+  channel->peer=peer;
+  channel->tag=tag;
+  channel->data_type=data_type;
+  channel->data_count=data_count;
+  channel->payload_size=getTypeSize(data_type) * data_count;
+  channel->event_id=std::string(event_id);
+  channel->receiveBuffers=new char*[channel_depth];
+  channel->receiveRequests=new MPI_Request[channel_depth];
+  if (protectMPI) mpi_mutex.lock();
+  for (int i=0;i<channel_depth;i++) {
+    void * memory;
+    if (posix_memalign(&memory, RECV_BUFFER_ALIGNMENT, std::max(channel->payload_size, 1)) != 0) {
+      raiseError("Unable to allocate memory for a channel receive buffer");
+    }
+    channel->receiveBuffers[i]=(char*) memory;
+    MPI_Recv_init(channel->receiveBuffers[i], channel->payload_size, MPI_BYTE, peer, tag, channel_communicator, &channel->receiveRequests[i]);
+    MPI_Start(&channel->receiveRequests[i]);
+    channel->startedReceives.push_back(i);
+  }
+  if (protectMPI) mpi_mutex.unlock();
+  return channel;
+}
+
+/**
+* Fires an event on a channel. The data is copied into a send buffer of the channel whose persistent request has completed and the request is started.
+* A new send buffer is created if all are in flight, up to the channel send buffers limit, after which this waits for a send to complete (which needs
+* the target to have consumed earlier events on the channel.) Channels to this process are fired as normal local events
+*/
+void MPI_P2P_Messaging::fireEventOnChannel(int channel_handle, void * data) {
+  PersistentChannel * channel=NULL;
+  {
+    std::lock_guard<std::mutex> lock(persistentChannels_mutex);
+    if (channel_handle >= 0 && channel_handle < (int) persistentChannels.size()) channel=persistentChannels[channel_handle];
+  }
+  if (channel == NULL) {
+    Messaging::fireEventOnChannel(channel_handle, data);
+    return;
+  }
+  std::lock_guard<std::mutex> send_lock(channel->send_mutex);
+  int slot=-1, completed;
+  while (slot < 0) {
+    if (protectMPI) mpi_mutex.lock();
+    for (int i=0;i<(int) channel->sendRequests.size() && slot < 0;i++) {
+      // Testing a persistent request that has completed (or was never started) returns straight away and leaves it inactive
+      MPI_Test(&channel->sendRequests[i], &completed, MPI_STATUS_IGNORE);
+      if (completed) slot=i;
+    }
+    if (slot < 0 && (int) channel->sendRequests.size() < channel_send_buffers) {
+      char * buffer=(char*) malloc(std::max(channel->payload_size, 1));
+      MPI_Request request;
+      MPI_Send_init(buffer, channel->payload_size, MPI_BYTE, channel->peer, channel->tag, channel_communicator, &request);
+      channel->sendBuffers.push_back(buffer);
+      channel->sendRequests.push_back(request);
+      slot=channel->sendRequests.size() - 1;
+    }
+    if (protectMPI) mpi_mutex.unlock();
+    // The MPI mutex is released whilst waiting so that the progress thread can restart the target's receives as its events are consumed
+    if (slot < 0) std::this_thread::yield();
+  }
+  if (channel->payload_size > 0) memcpy(channel->sendBuffers[slot], data, channel->payload_size);
+  MessagingLane & lane=getSendingLane();
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  // Counted before the send so that a terminating process never reports fewer messages sent than have been received from it
+  lane.messages_sent[channel->peer]++;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Start(&channel->sendRequests[slot]);
+  if (protectMPI) mpi_mutex.unlock();
+}
+
+/**
+* Registers a communicator in the routing table, this is given as a Fortran handle (as with initialising EDAT with a communicator.) Returns the handle
+* of the communicator for firing events on it
+*/
+int MPI_P2P_Messaging::registerCommunicator(int communicator_handle, int weight) {
+  return addRoutedCommunicator(MPI_Comm_f2c(communicator_handle), weight);
+}
+
+/**
+* Adds a communicator to the routing table, translating each of its ranks to the rank in the EDAT communicator. The communicator belongs to the caller
+* and is not duplicated, as messages from other programs are sent on it. It starts off being probed on every poll
+*/
+int MPI_P2P_Messaging::addRoutedCommunicator(MPI_Comm routed_communicator, int weight) {
+  if (weight < 1) raiseError("The weight of a registered communicator must be at least one");
+  RoutedCommunicator * routed=new RoutedCommunicator();
+  routed->communicator=routed_communicator;
+  routed->weight=weight;
+  routed->probe_interval=1;
+  routed->polls_until_probe=1;
+  int size;
+  MPI_Group routed_group, edat_group;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Comm_size(routed_communicator, &size);
+  std::vector<int> ranks(size);
+  for (int i=0;i<size;i++) ranks[i]=i;
+  routed->edatRanks.resize(size);
+  MPI_Comm_group(routed_communicator, &routed_group);
+  MPI_Comm_group(communicator, &edat_group);
+  MPI_Group_translate_ranks(routed_group, size, ranks.data(), edat_group, routed->edatRanks.data());
+  MPI_Group_free(&routed_group);
+  MPI_Group_free(&edat_group);
+  if (protectMPI) mpi_mutex.unlock();
+  std::lock_guard<std::mutex> routing_lock(routingTable_mutex);
+  routingTable.push_back(routed);
+  return routingTable.size() - 1;
+}
+
+/**
+* Fires an event to a rank of a registered communicator. If that rank is also an EDAT process then the event is fired to it as normal, so it is ordered
+* with (and counted for termination alongside) other events. Otherwise the packet is sent on the routed communicator, this includes the event identifier
+* every time as identifier handles are only kept for the lanes. The send is tracked on the first lane, so the buffer is freed once it has completed,
+* but it is not counted as the target is outside of the termination protocol
+*/
+void MPI_P2P_Messaging::fireEventOnCommunicator(void * data, int data_count, int data_type, int communicator_handle, int rank, const char * event_id) {
+  MPI_Comm target_communicator;
+  int edat_rank;
+  {
+    std::lock_guard<std::mutex> routing_lock(routingTable_mutex);
+    if (communicator_handle < 0 || communicator_handle >= (int) routingTable.size()) raiseError("Unknown registered communicator");
+    RoutedCommunicator * routed=routingTable[communicator_handle];
+    if (rank < 0 || rank >= (int) routed->edatRanks.size()) raiseError("The rank is not part of the registered communicator");
+    target_communicator=routed->communicator;
+    edat_rank=routed->edatRanks[rank];
+  }
+  if (edat_rank != MPI_UNDEFINED) {
+    fireEvent(data, data_count, data_type, edat_rank, false, event_id);
+    return;
+  }
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not fire a context to a process outside of EDAT");
+  EventHeader header;
+  header.data_type=data_type;
+  header.data_count=data_count;
+  header.persistent=false;
+  header.urgent=false;
+  header.context=false;
+  header.event_id=event_id;
+  header.event_id_length=strlen(event_id);
+  header.event_id_handle=0;
+  header.include_event_id=true;
+  header.header_size=ALIGN_TO_PAYLOAD(2 + getVarintSize(data_type) + getVarintSize(data_count) + getVarintSize(my_rank) + getVarintSize(0) +
+                                      getVarintSize(header.event_id_length) + header.event_id_length);
+  int packet_size=getPacketSize(header);
+  char * buffer=(char*) malloc(packet_size);
+  packEvent(buffer, data, header);
+  MPI_Request request;
+  std::lock_guard<std::mutex> out_sendReq_lock(lanes[0].outstandingSendRequests_mutex);
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Isend(buffer, packet_size, MPI_BYTE, rank, MPI_TAG, target_communicator, &request);
+  if (protectMPI) mpi_mutex.unlock();
+  trackOutstandingSend(lanes[0], request, buffer, NULL);
+}
+
+/**
+* Fires an event to the local and remote targets, if compression is requested then the payload sent to remote targets is compressed (otherwise it is
+* only compressed if it is above the compression threshold.) Urgent events are sent on the urgent lane rather than that of the calling thread
+*/
+void MPI_P2P_Messaging::fireEvent(void * data, int data_count, int data_type, int target, bool persistent, const char * event_id, bool compress,
+                                  bool urgent) {
   if (target == my_rank || target == EDAT_ALL) {
     int data_size=getTypeSize(data_type) * data_count;
     char * buffer_data=(char*) malloc(data_size);
@@ -119,62 +453,876 @@ void MPI_P2P_Messaging::fireEvent(void * data, int data_count, int data_type, in
     }
     SpecificEvent* event=new SpecificEvent(my_rank, data_count, data_count * getTypeSize(data_type), data_type, persistent,
                                            contextManager.isTypeAContext(data_type), std::string(event_id), (char*) buffer_data);
-    scheduler.registerEvent(event);
+    event->setUrgent(urgent);
+    registerLocalEvent(event);
   }
   if (target != my_rank) {
+    MessagingLane & lane=urgent ? *urgentLane : getSendingLane();
+    bool context=contextManager.isTypeAContext(data_type);
+    if (context) {
+      // A context is sent by value to other processes, it is packed once for all of the remote targets
+      data=packContextEvent(data_type, data, &data_count);
+      data_type=EDAT_BYTE;
+    }
     if (target != EDAT_ALL) {
-      sendSingleEvent(data, data_count, data_type, target, persistent, event_id);
+      sendSingleEvent(lane, data, data_count, data_type, target, persistent, event_id, compress, context);
     } else {
       for (int i=0;i<total_ranks;i++) {
         if (i != my_rank) {
-          sendSingleEvent(data, data_count, data_type, i, persistent, event_id);
+          sendSingleEvent(lane, data, data_count, data_type, i, persistent, event_id, compress, context);
         }
       }
     }
+    if (context) free(data);
+  }
+  wakeProgressThread();
+}
+
+/**
+* Fires an event where the ownership of the data buffer is handed over to EDAT, hence no copy is made. A local consumer is given the same
+* buffer and remote sends are directly from the buffer, which is released (via the release function or freed if this is NULL) once the local
+* consumer and all remote sends have finished with it.
+*/
+void MPI_P2P_Messaging::fireEventOwned(void * data, int data_count, int data_type, int target, const char * event_id, void (*release_fn)(void*)) {
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not transfer ownership of a context when firing an event");
+  if (data == NULL || data_count == 0) {
+    // Nothing to hand over so fire as a normal event, releasing any buffer straight away
+    fireEvent(NULL, 0, data_type, target, false, event_id);
+    if (data != NULL) (new PayloadBuffer(data, release_fn, 1))->release();
+    return;
+  }
+  bool local_target=target == my_rank || target == EDAT_ALL;
+  int number_remote_targets=target == EDAT_ALL ? total_ranks - 1 : (target == my_rank ? 0 : 1);
+  PayloadBuffer * payload=new PayloadBuffer(data, release_fn, number_remote_targets + (local_target ? 1 : 0));
+  if (local_target) {
+    SpecificEvent* event=new SpecificEvent(my_rank, data_count, data_count * getTypeSize(data_type), data_type, false, false,
+                                           std::string(event_id), (char*) data);
+    event->setPayload(payload);
+    registerLocalEvent(event);
+  }
+  if (target != my_rank) {
+    MessagingLane & lane=getSendingLane();
+    if (target != EDAT_ALL) {
+      sendOwnedEvent(lane, payload, data_count, data_type, target, event_id);
+    } else {
+      for (int i=0;i<total_ranks;i++) {
+        if (i != my_rank) sendOwnedEvent(lane, payload, data_count, data_type, i, event_id);
+      }
+    }
+  }
+  wakeProgressThread();
+}
+
+/**
+* Fires an event whose payload is a sub-array of the caller's memory. An event to a single remote target is sent straight from the caller's memory,
+* with a derived datatype combining the header and the sub-array, and the call waits for the send to complete so that the caller can then modify the
+* array. Waiting relies on the target's progress thread receiving the message, so this is only done when there is a progress thread. Otherwise, and
+* where the event is instead copied by EDAT (for the local consumer, shared memory, coalescing, compression or chunking), it is gathered into a buffer
+* and fired as an owned event
+*/
+void MPI_P2P_Messaging::fireEventFromLayout(void * data, int data_type, int ndims, int * sizes, int * subsizes, int * starts, int data_count,
+                                            int target, const char * event_id) {
+  if (data_count == 0 || !progress_thread || target == my_rank || target == EDAT_ALL ||
+      (sharedMemory != NULL && sharedMemory->isNodeLocal(target))) {
+    Messaging::fireEventFromLayout(data, data_type, ndims, sizes, subsizes, starts, data_count, target, event_id);
+    return;
+  }
+  MessagingLane & lane=getSendingLane();
+  EventHeader event_header=getEventHeader(lane, data_count, data_type, target, false, event_id);
+  int type_size=getTypeSize(data_type);
+  int data_size=type_size * data_count;
+  int packet_size=getPacketSize(event_header);
+  if ((coalesceEvents && COALESCED_HEADER_SIZE + ALIGN_TO_PAYLOAD(packet_size) <= coalesce_max_bytes) || shouldCompressEvent(event_header, false) ||
+      (chunk_threshold > 0 && data_size > chunk_threshold)) {
+    Messaging::fireEventFromLayout(data, data_type, ndims, sizes, subsizes, starts, data_count, target, event_id);
+    return;
+  }
+  if (coalesceEvents) {
+    // Flush out any events already waiting for this target to preserve ordering
+    std::lock_guard<std::mutex> coalesce_lock(lane.coalesce_mutex);
+    flushCoalesceBuffer(lane, target);
+  }
+  int header_size=event_header.header_size;
+  char * header=(char*) malloc(header_size);
+  packEvent(header, NULL, event_header);
+  int block_lengths[2]={header_size, 1};
+  MPI_Aint displacements[2];
+  MPI_Datatype element_type, layout_type, packet_type;
+  MPI_Request request;
+  {
+    std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+    lane.messages_sent[target]++;
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Type_contiguous(type_size, MPI_BYTE, &element_type);
+    MPI_Type_create_subarray(ndims, sizes, subsizes, starts, MPI_ORDER_C, element_type, &layout_type);
+    MPI_Datatype types[2]={MPI_BYTE, layout_type};
+    MPI_Get_address(header, &displacements[0]);
+    MPI_Get_address(data, &displacements[1]);
+    MPI_Type_create_struct(2, block_lengths, displacements, types, &packet_type);
+    MPI_Type_commit(&packet_type);
+    request=startSend(lane, MPI_BOTTOM, 1, packet_type, packet_size, target);
+    MPI_Type_free(&packet_type);
+    MPI_Type_free(&layout_type);
+    MPI_Type_free(&element_type);
+    if (protectMPI) mpi_mutex.unlock();
+  }
+  markEventIdDefined(lane, target, event_header);
+  wakeProgressThread();
+  // The send is not tracked by the lane as the caller's memory must not be modified until it has completed, hence wait for it here
+  int completed=0;
+  while (!completed) {
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Test(&request, &completed, MPI_STATUS_IGNORE);
+    if (protectMPI) mpi_mutex.unlock();
+    if (!completed) std::this_thread::yield();
   }
+  free(header);
 }
 
 void MPI_P2P_Messaging::resetPolling() {
-  mode=0;
-  terminated_id=0;
   terminated=false;
   eligable_for_termination=false;
-  if (my_rank == 0) {
+  previous_wave_completed=false;
+  Messaging::resetPolling();
+}
+
+
+
+/**
+* Sends a single event to a specific target on a lane by packaging the data into a buffer and sending it over. If coalescing is enabled (apart from on
+* the urgent lane, which also bypasses shared memory) then the event is instead aggregated with others to the same target, and these are sent as a
+* single message when the buffer is flushed. Events that are not
+* coalesced are compressed by the calling thread if requested (or if they are at least the compression threshold.)
+*/
+void MPI_P2P_Messaging::sendSingleEvent(MessagingLane & lane, void * data, int data_count, int data_type, int target, bool persistent,
+                                        const char * event_id, bool compress, bool context) {
+  EventHeader header=getEventHeader(lane, data_count, data_type, target, persistent, event_id);
+  header.context=context;
+  if (sharedMemory != NULL && sharedMemory->isNodeLocal(target) && &lane != urgentLane) {
+    sendSharedMemoryEvent(lane, data, target, header);
+    markEventIdDefined(lane, target, header);
+    return;
+  }
+  int packet_size=getPacketSize(header);
+  if (lane.coalesceBuffers != NULL) {
+    if (COALESCED_HEADER_SIZE + ALIGN_TO_PAYLOAD(packet_size) <= coalesce_max_bytes) {
+      coalesceEvent(lane, data, target, header);
+      return;
+    }
+    // Too large to coalesce, but flush out any events already waiting for this target to preserve ordering
+    std::lock_guard<std::mutex> coalesce_lock(lane.coalesce_mutex);
+    flushCoalesceBuffer(lane, target);
+  }
+  if (shouldCompressEvent(header, compress) && sendCompressedEvent(lane, data, target, header)) return;
+  int data_size=packet_size - header.header_size;
+  if (chunk_threshold > 0 && data_size > chunk_threshold) {
+    // The caller can reuse its buffer once this returns so the payload is copied, but the header is sent separately rather than in front of it
+    char * payload_copy=(char*) malloc(data_size);
+    memcpy(payload_copy, data, data_size);
+    sendChunkedEvent(lane, new PayloadBuffer(payload_copy, NULL, 1), target, header);
+    return;
+  }
+  char * buffer = (char*) malloc(packet_size);
+  packEvent(buffer, data, header);
+  sendPacket(lane, buffer, packet_size, target);
+  markEventIdDefined(lane, target, header);
+}
+
+/**
+* Sends a single event where the payload is owned by EDAT, the header is packed separately and then a derived datatype combines the header and payload
+* so that these are sent as a single message directly from the payload buffer. The reference to the payload is released once the send completes. Small
+* events that are coalesced are instead copied into the coalescing buffer and the reference released immediately.
+*/
+void MPI_P2P_Messaging::sendOwnedEvent(MessagingLane & lane, PayloadBuffer * payload, int data_count, int data_type, int target,
+                                       const char * event_id) {
+  EventHeader event_header=getEventHeader(lane, data_count, data_type, target, false, event_id);
+  if (sharedMemory != NULL && sharedMemory->isNodeLocal(target)) {
+    // The payload is copied into shared memory, so the reference can be released straight away
+    sendSharedMemoryEvent(lane, payload->getData(), target, event_header);
+    markEventIdDefined(lane, target, event_header);
+    payload->release();
+    return;
+  }
+  int packet_size=getPacketSize(event_header);
+  if (coalesceEvents) {
+    if (COALESCED_HEADER_SIZE + ALIGN_TO_PAYLOAD(packet_size) <= coalesce_max_bytes) {
+      coalesceEvent(lane, payload->getData(), target, event_header);
+      payload->release();
+      return;
+    }
+    std::lock_guard<std::mutex> coalesce_lock(lane.coalesce_mutex);
+    flushCoalesceBuffer(lane, target);
+  }
+  if (shouldCompressEvent(event_header, false) && sendCompressedEvent(lane, payload->getData(), target, event_header)) {
+    payload->release();
+    return;
+  }
+  if (chunk_threshold > 0 && packet_size - event_header.header_size > chunk_threshold) {
+    sendChunkedEvent(lane, payload, target, event_header);
+    return;
+  }
+  int header_size=event_header.header_size;
+  char * header=(char*) malloc(header_size);
+  packEvent(header, NULL, event_header);
+  int block_lengths[2]={header_size, packet_size - header_size};
+  MPI_Aint displacements[2];
+  MPI_Datatype packet_type;
+  MPI_Request request;
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  lane.messages_sent[target]++;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Get_address(header, &displacements[0]);
+  MPI_Get_address(payload->getData(), &displacements[1]);
+  MPI_Type_create_hindexed(2, block_lengths, displacements, MPI_BYTE, &packet_type);
+  MPI_Type_commit(&packet_type);
+  request=startSend(lane, MPI_BOTTOM, 1, packet_type, packet_size, target);
+  // Freeing the datatype is fine here, it is only deallocated by MPI once the send has completed
+  MPI_Type_free(&packet_type);
+  if (protectMPI) mpi_mutex.unlock();
+  trackOutstandingSend(lane, request, header, payload);
+  markEventIdDefined(lane, target, event_header);
+}
+
+/**
+* Sends a single event to a target on the same node through shared memory, the event is packed directly into the ring (or slab if it is larger.)
+* Events are not coalesced, as the ring already aggregates them. If there is no space in shared memory then small events are held until there is,
+* and larger ones are announced through the ring and sent over MPI, which the target receives once it reaches the announcement. Hence events from
+* the lane are still delivered in the order that they were fired
+*/
+void MPI_P2P_Messaging::sendSharedMemoryEvent(MessagingLane & lane, void * data, int target, EventHeader & header) {
+  int packet_size=getPacketSize(header);
+  int lane_index=&lane - lanes;
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  // Counted as sent once the event has been handed to the transport, it is counted as received once it has been read from the ring
+  lane.messages_sent[target]++;
+  char * destination=sharedMemory->reserveMessage(target, lane_index, packet_size);
+  if (destination != NULL) {
+    packEvent(destination, data, header);
+    sharedMemory->commitMessage(target);
+    return;
+  }
+  char * buffer=(char*) malloc(packet_size);
+  packEvent(buffer, data, header);
+  if (packet_size <= sharedMemory->getMaxInlineSize()) {
+    sharedMemory->sendMessage(target, lane_index, buffer, packet_size);
+  } else {
+    // The send is started before the announcement is visible, as the target blocks receiving the message once it reaches the announcement
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Request request=startMessageSend(lane, buffer, packet_size, MPI_BYTE, packet_size, target, MPI_LARGE_TAG);
+    if (protectMPI) mpi_mutex.unlock();
+    trackOutstandingSend(lane, request, buffer, NULL);
+    sharedMemory->sendMessage(target, lane_index, packLargeAnnouncement(packet_size), FIXED_HEADER_SIZE);
+  }
+}
+
+/**
+* Determines whether the payload of an event should be compressed, this is when requested or if it is at least the compression threshold. Contexts
+* are never compressed and nor are persistent events, as these are copied for each consumer and so would be decompressed again and again. Nor are
+* payloads of no more than the payload alignment, as the compressed size prefix means that these can never be made smaller
+*/
+bool MPI_P2P_Messaging::shouldCompressEvent(EventHeader & header, bool compress) {
+  if (header.persistent || header.context) return false;
+  int data_size=getTypeSize(header.data_type) * header.data_count;
+  if (data_size <= PAYLOAD_ALIGNMENT) return false;
+  return compress || (compression_threshold > 0 && data_size >= compression_threshold);
+}
+
+/**
+* Sends an event with its payload compressed, the packet holds the header then the compressed size and the compressed payload. The payload is only
+* sent compressed if this makes the packet smaller, returns false if it does not (in which case nothing is sent)
+*/
+bool MPI_P2P_Messaging::sendCompressedEvent(MessagingLane & lane, void * data, int target, EventHeader & header) {
+  int type_size=getTypeSize(header.data_type);
+  int data_size=type_size * header.data_count;
+  if (data_size <= PAYLOAD_ALIGNMENT) return false;
+  int prefix_size=header.header_size + PAYLOAD_ALIGNMENT;
+  char * buffer=(char*) malloc(prefix_size + data_size);
+  int compressed_size=compressPayload((char*) data, data_size, type_size, &buffer[prefix_size], data_size - PAYLOAD_ALIGNMENT);
+  if (compressed_size == 0) {
+    free(buffer);
+    return false;
+  }
+  packEvent(buffer, NULL, header);
+  buffer[1]|=PACKET_FLAG_COMPRESSED;
+  memset(&buffer[header.header_size], 0, PAYLOAD_ALIGNMENT);
+  memcpy(&buffer[header.header_size], &compressed_size, sizeof(int));
+  sendPacket(lane, buffer, prefix_size + compressed_size, target);
+  markEventIdDefined(lane, target, header);
+  return true;
+}
+
+/**
+* Sends a large event to a target in chunks. The header is sent as a chunked event packet, in order with the other messages to the target, which tells
+* the target the chunk size so it can allocate the destination buffer and receive the chunks directly into it. The chunks are then sent straight from
+* the payload by the progress engine, with a bounded number in flight, and the reference to the payload is released once they have all been sent
+*/
+void MPI_P2P_Messaging::sendChunkedEvent(MessagingLane & lane, PayloadBuffer * payload, int target, EventHeader & header) {
+  OutgoingChunkedTransfer * transfer=new OutgoingChunkedTransfer();
+  int type_size=getTypeSize(header.data_type);
+  transfer->payload=payload;
+  transfer->target=target;
+  transfer->size=type_size * header.data_count;
+  transfer->offset=0;
+  transfer->chunks_in_flight=0;
+  // Chunks hold whole elements, so that each can be consumed as an event in its own right when streaming
+  transfer->chunk_size=std::max(type_size, chunk_size - (chunk_size % type_size));
+  int announcement_size=header.header_size + PAYLOAD_ALIGNMENT;
+  char * announcement=(char*) malloc(announcement_size);
+  packEvent(announcement, NULL, header);
+  announcement[1]|=PACKET_FLAG_CHUNKED;
+  memset(&announcement[header.header_size], 0, PAYLOAD_ALIGNMENT);
+  memcpy(&announcement[header.header_size], &transfer->chunk_size, sizeof(int));
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  lane.messages_sent[target]++;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Request request=startSend(lane, announcement, announcement_size, MPI_BYTE, announcement_size, target);
+  if (protectMPI) mpi_mutex.unlock();
+  trackOutstandingSend(lane, request, announcement, NULL);
+  lane.outgoingChunkedTransfers.push_back(transfer);
+  chunked_sends_pending++;
+  startChunkSends(lane);
+  markEventIdDefined(lane, target, header);
+}
+
+/**
+* Starts the sends of further chunks of the chunked transfers of a lane, up to the bound of chunks in flight for each transfer. The target receives
+* chunks in the order that it processes the transfers, hence the chunks of a transfer are only started once all those of earlier transfers to the same
+* target have been. Must be called with the lane's outstanding send requests mutex held
+*/
+void MPI_P2P_Messaging::startChunkSends(MessagingLane & lane) {
+  std::vector<int> blockedTargets;
+  if (protectMPI) mpi_mutex.lock();
+  for (OutgoingChunkedTransfer * transfer : lane.outgoingChunkedTransfers) {
+    if (std::find(blockedTargets.begin(), blockedTargets.end(), transfer->target) != blockedTargets.end()) continue;
+    while (transfer->chunks_in_flight < chunks_in_flight && transfer->offset < transfer->size) {
+      int bytes=std::min(transfer->chunk_size, transfer->size - transfer->offset);
+      MPI_Request request;
+      MPI_Isend((char*) transfer->payload->getData() + transfer->offset, bytes, MPI_BYTE, transfer->target, MPI_CHUNK_TAG, lane.communicator,
+                &request);
+      trackOutstandingSend(lane, request, OutstandingSend(transfer));
+      transfer->offset+=bytes;
+      transfer->chunks_in_flight++;
+    }
+    if (transfer->offset < transfer->size) blockedTargets.push_back(transfer->target);
+  }
+  if (protectMPI) mpi_mutex.unlock();
+}
+
+/**
+* Handles the completion of the send of a chunk, once all chunks of the transfer have been sent then the transfer is removed and its payload added to
+* the list to release. Must be called with the lane's outstanding send requests mutex held
+*/
+void MPI_P2P_Messaging::completeChunkSend(MessagingLane & lane, OutgoingChunkedTransfer * transfer, std::vector<PayloadBuffer*> & payloadsToRelease) {
+  transfer->chunks_in_flight--;
+  if (transfer->offset == transfer->size && transfer->chunks_in_flight == 0) {
+    lane.outgoingChunkedTransfers.erase(std::find(lane.outgoingChunkedTransfers.begin(), lane.outgoingChunkedTransfers.end(), transfer));
+    payloadsToRelease.push_back(transfer->payload);
+    delete transfer;
+    chunked_sends_pending--;
+  }
+}
+
+/**
+* Builds the header of an event packet to a specific target on a lane. This looks up (or allocates) the handle of the event identifier on the link to
+* that target, and if a packet defining this handle has not yet been sent then the identifier string is included in the header
+*/
+EventHeader MPI_P2P_Messaging::getEventHeader(MessagingLane & lane, int data_count, int data_type, int target, bool persistent, const char * event_id) {
+  EventHeader header;
+  header.data_type=data_type;
+  header.data_count=data_count;
+  header.persistent=persistent;
+  header.urgent=&lane == urgentLane;
+  header.context=false;
+  header.event_id=event_id;
+  header.event_id_length=strlen(event_id);
+  {
+    std::lock_guard<std::mutex> eventIds_lock(lane.eventIds_mutex);
+    std::unordered_map<std::string, EventIdHandle> * targetEventIds=&lane.sentEventIds[target];
+    std::unordered_map<std::string, EventIdHandle>::iterator it=targetEventIds->find(std::string(event_id, header.event_id_length));
+    if (it == targetEventIds->end()) {
+      EventIdHandle new_handle;
+      new_handle.handle=targetEventIds->size();
+      new_handle.defined=false;
+      it=targetEventIds->emplace(std::string(event_id, header.event_id_length), new_handle).first;
+    }
+    header.event_id_handle=it->second.handle;
+    header.include_event_id=!it->second.defined;
+  }
+  int size=2 + getVarintSize(data_type) + getVarintSize(data_count) + getVarintSize(my_rank) + getVarintSize(header.event_id_handle);
+  if (header.include_event_id) size+=getVarintSize(header.event_id_length) + header.event_id_length;
+  header.header_size=ALIGN_TO_PAYLOAD(size);
+  #if DO_METRICS
+    metrics::METRICS->recordValue("Event header bytes", header.header_size);
+  #endif
+  return header;
+}
+
+/**
+* Marks that a packet including the event identifier string of a header has been sent (or appended to the coalescing buffer) to the target, so
+* subsequent packets on the lane can refer to the identifier by its handle alone. As messages between a pair of processes on a communicator are not
+* overtaken, these are guaranteed to be processed after the definition. Until this point other packets for the same identifier will also include the
+* string, which is harmless
+*/
+void MPI_P2P_Messaging::markEventIdDefined(MessagingLane & lane, int target, EventHeader & header) {
+  if (!header.include_event_id) return;
+  std::lock_guard<std::mutex> eventIds_lock(lane.eventIds_mutex);
+  lane.sentEventIds[target].find(std::string(header.event_id, header.event_id_length))->second.defined=true;
+}
+
+/**
+* Determines the size of the packet for a single event
+*/
+int MPI_P2P_Messaging::getPacketSize(EventHeader & header) {
+  return (getTypeSize(header.data_type) * header.data_count) + header.header_size;
+}
+
+/**
+* Packs a single event into the provided buffer, which must be at least the packet size. The packet is the wire format version and flags, then
+* variable length integers of the data type, number of elements, source rank and event identifier handle. If the identifier is new on this link then
+* its length and string follow. The header is padded to the payload alignment and then the payload data follows
+*/
+void MPI_P2P_Messaging::packEvent(char * buffer, void * data, EventHeader & header) {
+  buffer[0]=WIRE_FORMAT_VERSION;
+  buffer[1]=(header.persistent ? PACKET_FLAG_PERSISTENT : 0) | (header.include_event_id ? PACKET_FLAG_NEW_EVENT_ID : 0) |
+            (header.urgent ? PACKET_FLAG_URGENT : 0) | (header.context ? PACKET_FLAG_CONTEXT : 0);
+  int offset=2;
+  offset+=writeVarint(&buffer[offset], header.data_type);
+  offset+=writeVarint(&buffer[offset], header.data_count);
+  offset+=writeVarint(&buffer[offset], my_rank);
+  offset+=writeVarint(&buffer[offset], header.event_id_handle);
+  if (header.include_event_id) {
+    offset+=writeVarint(&buffer[offset], header.event_id_length);
+    memcpy(&buffer[offset], header.event_id, header.event_id_length);
+    offset+=header.event_id_length;
+  }
+  memset(&buffer[offset], 0, header.header_size - offset);
+  if (data != NULL) memcpy(&buffer[header.header_size], data, getTypeSize(header.data_type) * header.data_count);
+}
+
+/**
+* Reads the header of an event packet, using (and updating on definition) the event identifiers of the link from the source. The event identifier
+* of the header refers to the string held in these identifiers. Returns the offset of the payload data in the packet
+*/
+int MPI_P2P_Messaging::readEventHeader(char * packet, std::vector<std::string> & eventIds, EventHeader & header, unsigned int * source_pid) {
+  unsigned int data_type, data_count, event_id_handle, event_id_length;
+  int offset=2;
+  offset+=readVarint(&packet[offset], &data_type);
+  offset+=readVarint(&packet[offset], &data_count);
+  offset+=readVarint(&packet[offset], source_pid);
+  offset+=readVarint(&packet[offset], &event_id_handle);
+  header.include_event_id=packet[1] & PACKET_FLAG_NEW_EVENT_ID;
+  if (header.include_event_id) {
+    offset+=readVarint(&packet[offset], &event_id_length);
+    if (event_id_handle >= eventIds.size()) eventIds.resize(event_id_handle + 1);
+    eventIds[event_id_handle].assign(&packet[offset], event_id_length);
+    offset+=event_id_length;
+  } else if (event_id_handle >= eventIds.size()) {
+    raiseError("Received an event with an unknown event identifier handle");
+  }
+  header.data_type=data_type;
+  header.data_count=data_count;
+  header.persistent=packet[1] & PACKET_FLAG_PERSISTENT;
+  header.urgent=packet[1] & PACKET_FLAG_URGENT;
+  header.context=packet[1] & PACKET_FLAG_CONTEXT;
+  header.event_id_handle=event_id_handle;
+  header.event_id=eventIds[event_id_handle].c_str();
+  header.event_id_length=eventIds[event_id_handle].size();
+  header.header_size=ALIGN_TO_PAYLOAD(offset);
+  return header.header_size;
+}
+
+/**
+* Unpacks a single event from a packet into a specific event. The event's data points directly into the packet, and it holds a reference to the buffer
+* that the packet was received into. Persistent events are long lived and so are given their own copy, as are events whose payload (compressed or
+* otherwise) is no larger than the receive copy threshold, as otherwise a small event would hold on to an entire receive buffer. A context is
+* re-materialised from the packet. The size of the packet is returned via the last argument
+*/
+SpecificEvent* MPI_P2P_Messaging::unpackEvent(char * packet, PayloadBuffer * receiveBuffer, std::vector<std::string> & eventIds, int * packet_size) {
+  EventHeader header;
+  unsigned int source_pid;
+  char * data_buffer;
+  int data_offset=readEventHeader(packet, eventIds, header, &source_pid);
+  bool persistent=header.persistent;
+  int data_size = getTypeSize(header.data_type) * header.data_count;
+  if (packet[1] & PACKET_FLAG_COMPRESSED) {
+    // The data is left compressed in the packet, it is decompressed by the worker that runs the consuming task
+    int compressed_size;
+    memcpy(&compressed_size, &packet[data_offset], sizeof(int));
+    *packet_size=data_offset + PAYLOAD_ALIGNMENT + compressed_size;
+    char * compressed_data=&packet[data_offset + PAYLOAD_ALIGNMENT];
+    bool compressed_in_place=compressed_size > recv_copy_threshold;
+    if (!compressed_in_place) {
+      compressed_data=(char*) malloc(compressed_size);
+      memcpy(compressed_data, &packet[data_offset + PAYLOAD_ALIGNMENT], compressed_size);
+    }
+    SpecificEvent * event=new SpecificEvent(source_pid, header.data_count, data_size, header.data_type, false, false,
+                                            std::string(header.event_id, header.event_id_length), compressed_data);
+    event->setCompressedLength(compressed_size);
+    event->setUrgent(header.urgent);
+    if (compressed_in_place) {
+      receiveBuffer->retain();
+      event->setPayload(receiveBuffer);
+    }
+    return event;
+  }
+  *packet_size=data_offset + data_size;
+  bool in_place = data_size > recv_copy_threshold && data_size > 0 && !persistent;
+  if (in_place) {
+    data_buffer = &packet[data_offset];
+  } else if (data_size > 0) {
+    data_buffer = (char*)malloc(data_size);
+    memcpy(data_buffer, &packet[data_offset], data_size);
+  } else {
+    data_buffer = NULL;
+  }
+  SpecificEvent * event=new SpecificEvent(source_pid, data_size > 0 ? header.data_count : 0, data_size, header.data_type, persistent,
+                           contextManager.isTypeAContext(header.data_type), std::string(header.event_id, header.event_id_length), data_buffer);
+  event->setUrgent(header.urgent);
+  if (in_place) {
+    receiveBuffer->retain();
+    event->setPayload(receiveBuffer);
+  }
+  return header.context ? unpackContextEvent(event) : event;
+}
+
+/**
+* Appends an event to the coalescing buffer of the target on a lane, the buffer is flushed beforehand if the event will not fit and afterwards if this
+* has reached the maximum number of events. A coalesced message has a fixed header with the coalesced flag set and the number of events, followed
+* by each event packet padded to the payload alignment (the size of each packet is determined from its header.)
+*/
+void MPI_P2P_Messaging::coalesceEvent(MessagingLane & lane, void * data, int target, EventHeader & header) {
+  std::lock_guard<std::mutex> coalesce_lock(lane.coalesce_mutex);
+  CoalesceBuffer * coalesceBuffer=&lane.coalesceBuffers[target];
+  int packet_size=getPacketSize(header);
+  int entry_size=ALIGN_TO_PAYLOAD(packet_size);
+  if (coalesceBuffer->size + entry_size > coalesce_max_bytes) flushCoalesceBuffer(lane, target);
+  if (coalesceBuffer->number_events == 0) {
+    coalesceBuffer->buffer=(char*) malloc(coalesce_max_bytes);
+    memset(coalesceBuffer->buffer, 0, COALESCED_HEADER_SIZE);
+    coalesceBuffer->buffer[0]=WIRE_FORMAT_VERSION;
+    coalesceBuffer->buffer[1]=PACKET_FLAG_COALESCED;
+    coalesceBuffer->size=COALESCED_HEADER_SIZE;
+    coalesceBuffer->first_event_time=MPI_Wtime();
+  }
+  packEvent(&coalesceBuffer->buffer[coalesceBuffer->size], data, header);
+  memset(&coalesceBuffer->buffer[coalesceBuffer->size + packet_size], 0, entry_size - packet_size);
+  coalesceBuffer->size+=entry_size;
+  coalesceBuffer->number_events++;
+  coalesced_events_pending++;
+  // Later events appended to this buffer, or sent directly after it has been flushed, can now refer to the identifier by handle alone
+  markEventIdDefined(lane, target, header);
+  if (coalesceBuffer->number_events >= coalesce_max_events) flushCoalesceBuffer(lane, target);
+}
+
+/**
+* Flushes the coalescing buffer of a specific target on a lane, sending the aggregated events as a single message. The lane's coalesce mutex must be held
+*/
+void MPI_P2P_Messaging::flushCoalesceBuffer(MessagingLane & lane, int target) {
+  CoalesceBuffer * coalesceBuffer=&lane.coalesceBuffers[target];
+  if (coalesceBuffer->number_events == 0) return;
+  memcpy(&coalesceBuffer->buffer[4], &coalesceBuffer->number_events, sizeof(int));
+  #if DO_METRICS
+    metrics::METRICS->recordValue("Coalesced events per message", coalesceBuffer->number_events);
+    metrics::METRICS->recordValue("Coalesced time to flush (s)", MPI_Wtime() - coalesceBuffer->first_event_time);
+  #endif
+  sendPacket(lane, coalesceBuffer->buffer, coalesceBuffer->size, target);
+  coalesced_events_pending-=coalesceBuffer->number_events;
+  coalesceBuffer->buffer=NULL;
+  coalesceBuffer->size=0;
+  coalesceBuffer->number_events=0;
+}
+
+/**
+* Flushes the coalescing buffers of every lane, either all of them or only those where the first event has been waiting longer than the timeout
+*/
+void MPI_P2P_Messaging::flushCoalescedEvents(bool flush_all) {
+  double current_time=flush_all ? 0.0 : MPI_Wtime();
+  for (int j=0;j<number_sending_lanes;j++) {
+    std::lock_guard<std::mutex> coalesce_lock(lanes[j].coalesce_mutex);
+    CoalesceBuffer * coalesceBuffers=lanes[j].coalesceBuffers;
     for (int i=0;i<total_ranks;i++) {
-      termination_codes[i]=-1;
-      pingback_termination_codes[i]=-1;
+      if (coalesceBuffers[i].number_events > 0 && (flush_all || current_time - coalesceBuffers[i].first_event_time >= coalesce_timeout)) {
+        flushCoalesceBuffer(lanes[j], i);
+      }
     }
   }
-  Messaging::resetPolling();
 }
 
+/**
+* Sends a packed buffer to the target on a lane, the buffer is freed once the send has completed. Messages up to the eager threshold are sent with a standard
+* non-blocking send, so MPI can complete these eagerly without a rendezvous with the target, and larger ones with a non-blocking synchronous send. Termination
+* correctness does not rely on the send mode, instead every message is counted and the termination protocol checks that all sent messages have been received.
+*/
+void MPI_P2P_Messaging::sendPacket(MessagingLane & lane, char * buffer, int packet_size, int target) {
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  // Counted before the send so that a terminating process never reports fewer messages sent than have been received from it
+  lane.messages_sent[target]++;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Request request=startSend(lane, buffer, packet_size, MPI_BYTE, packet_size, target);
+  if (protectMPI) mpi_mutex.unlock();
+  trackOutstandingSend(lane, request, buffer, NULL);
+}
 
+/**
+* Starts the send of a message on a lane, which must be called with the lane's outstanding send requests mutex and the MPI mutex (if protecting MPI) held. Messages that
+* fit into the target's pre-posted receive buffers are sent directly, whereas larger ones are announced by a small message that the target will process in
+* order with the others and then it receives the message itself, which is sent on a separate tag. Returns the request of the message send.
+*/
+MPI_Request MPI_P2P_Messaging::startSend(MessagingLane & lane, void * buffer, int count, MPI_Datatype datatype, int message_size, int target) {
+  MPI_Request request;
+  int tag=MPI_TAG;
+  if (message_size > recv_buffer_size) {
+    char * announcement=packLargeAnnouncement(message_size);
+    MPI_Isend(announcement, FIXED_HEADER_SIZE, MPI_BYTE, target, MPI_TAG, lane.communicator, &request);
+    trackOutstandingSend(lane, request, announcement, NULL);
+    tag=MPI_LARGE_TAG;
+  }
+  return startMessageSend(lane, buffer, count, datatype, message_size, target, tag);
+}
 
 /**
-* Sends a single event to a specific target by packaging the data into a buffer and sending it over. We use a non-blocking synchronous send as we want acknowledgement
-* from the target that the message has started to be received (for termination correctness.)
+* Packs the announcement of a large message, which tells the target to receive the message of this size on the large message tag
 */
-void MPI_P2P_Messaging::sendSingleEvent(void * data, int data_count, int data_type, int target, bool persistent,
-                                        const char * event_id) {
-  int event_id_len=strlen(event_id);
-  int type_element_size=getTypeSize(data_type);
-  int packet_size=(type_element_size * data_count) + (sizeof(int) * 3) + event_id_len + 1 + sizeof(char);
-  char * buffer = (char*) malloc(packet_size);
-  memcpy(buffer, &data_type, sizeof(int));
-  memcpy(&buffer[4], &my_rank, sizeof(int));
-  memcpy(&buffer[8], &event_id_len, sizeof(int));
-  char pVal=persistent ? 1 : 0;
-  memcpy(&buffer[12], &pVal, sizeof(char));
-  memcpy(&buffer[13], event_id, sizeof(char) * (event_id_len + 1));
-  if (data != NULL) memcpy(&buffer[(13 + event_id_len + 1)], data, type_element_size * data_count);
+char * MPI_P2P_Messaging::packLargeAnnouncement(int message_size) {
+  char * announcement=(char*) malloc(FIXED_HEADER_SIZE);
+  memset(announcement, 0, FIXED_HEADER_SIZE);
+  announcement[0]=WIRE_FORMAT_VERSION;
+  announcement[1]=PACKET_FLAG_LARGE;
+  memcpy(&announcement[4], &message_size, sizeof(int));
+  return announcement;
+}
+
+/**
+* Starts the send of a message on a specific tag, in standard mode up to the eager threshold and synchronous mode beyond that. Must be called with
+* the same mutexes held as starting a send
+*/
+MPI_Request MPI_P2P_Messaging::startMessageSend(MessagingLane & lane, void * buffer, int count, MPI_Datatype datatype, int message_size, int target,
+                                                int tag) {
   MPI_Request request;
+  if (message_size <= eager_threshold) {
+    MPI_Isend(buffer, count, datatype, target, tag, lane.communicator, &request);
+  } else {
+    MPI_Issend(buffer, count, datatype, target, tag, lane.communicator, &request);
+  }
+  return request;
+}
+
+/**
+* Allocates the pooled receive buffers of a lane and posts a receive into each of these
+*/
+void MPI_P2P_Messaging::initialiseReceiveRing(MessagingLane & lane) {
+  lane.recv_ring_buffers=new char*[recv_ring_size];
+  for (int i=0;i<recv_ring_size;i++) lane.recv_ring_buffers[i]=getReceiveBuffer();
+  lane.recv_ring_requests=new MPI_Request[recv_ring_size];
+  lane.recv_ring_message_sizes=new int[recv_ring_size];
+  lane.recv_ring_sources=new int[recv_ring_size];
+  lane.recv_ring_indicies=new int[recv_ring_size];
+  lane.recv_ring_statuses.resize(recv_ring_size);
+  lane.recv_ring_completed=new bool[recv_ring_size];
+  lane.recv_ring_head=0;
+  if (protectMPI) mpi_mutex.lock();
+  for (int i=0;i<recv_ring_size;i++) postRingReceive(lane, i);
+  if (protectMPI) mpi_mutex.unlock();
+}
+
+/**
+* Posts the receive for a specific slot in the ring of a lane, must be called with the MPI mutex held (if protecting MPI)
+*/
+void MPI_P2P_Messaging::postRingReceive(MessagingLane & lane, int slot) {
+  lane.recv_ring_completed[slot]=false;
+  MPI_Irecv(lane.recv_ring_buffers[slot], recv_buffer_size, MPI_BYTE, MPI_ANY_SOURCE, MPI_TAG, lane.communicator,
+            &lane.recv_ring_requests[slot]);
+}
+
+/**
+* Tests the ring of receives of a lane for completion and then processes those that have completed, in the order that they were posted (which is the
+* order that MPI matches them to messages.) Processing stops at the first receive that has not yet completed, even if later ones have, to preserve the
+* ordering of messages. The buffer of each completed receive is handed over to the events unpacked from it, and the receive reposted into a fresh
+* buffer from the pool, becoming the newest in the ring. At most the given number of messages are processed, any further completed receives are left
+* for the next call. Returns the number of messages processed.
+*/
+int MPI_P2P_Messaging::drainReceiveRing(MessagingLane & lane, int max_messages) {
+  int out_count, number_processed=0;
   if (protectMPI) mpi_mutex.lock();
-  MPI_Issend(buffer, packet_size, MPI_BYTE, target, MPI_TAG, communicator, &request);
+  MPI_Testsome(recv_ring_size, lane.recv_ring_requests, &out_count, lane.recv_ring_indicies, lane.recv_ring_statuses.data());
+  for (int i=0;i<out_count && out_count != MPI_UNDEFINED;i++) {
+    int slot=lane.recv_ring_indicies[i];
+    MPI_Get_count(&lane.recv_ring_statuses[i], MPI_BYTE, &lane.recv_ring_message_sizes[slot]);
+    lane.recv_ring_sources[slot]=lane.recv_ring_statuses[i].MPI_SOURCE;
+    lane.recv_ring_completed[slot]=true;
+  }
   if (protectMPI) mpi_mutex.unlock();
+  while (number_processed < max_messages && lane.recv_ring_completed[lane.recv_ring_head]) {
+    int head=lane.recv_ring_head;
+    PayloadBuffer * receiveBuffer=new PayloadBuffer(lane.recv_ring_buffers[head], [this](void * buffer) { returnReceiveBuffer(buffer); }, 1);
+    lane.recv_ring_buffers[head]=getReceiveBuffer();
+    processArrivedMessage(receiveBuffer, lane.recv_ring_message_sizes[head], lane.recv_ring_sources[head], &lane);
+    // Drops the reference held whilst unpacking, if no events point into the buffer then it goes straight back into the pool
+    receiveBuffer->release();
+    if (protectMPI) mpi_mutex.lock();
+    postRingReceive(lane, head);
+    if (protectMPI) mpi_mutex.unlock();
+    lane.recv_ring_head=(head + 1) % recv_ring_size;
+    number_processed++;
+  }
+  return number_processed;
+}
+
+/**
+* Reads and processes messages that have arrived through shared memory from the other processes on the node, a bounded number from each so that a
+* busy sender can not hold up the poll, and no more than the given number in total. Small messages are copied out of the ring into a buffer from the
+* pool and events from larger ones point directly into the slab, which is released once they have all been consumed. Returns the number of messages
+* processed
+*/
+int MPI_P2P_Messaging::drainSharedMemory(int max_messages) {
+  int number_processed=0;
+  SharedMessage message;
+  for (int peer=0;peer<sharedMemory->getNumberPeers();peer++) {
+    for (int i=0;i<recv_ring_size && number_processed < max_messages && sharedMemory->readMessage(peer, &message);i++) {
+      PayloadBuffer * receiveBuffer;
+      if (message.in_slab) {
+        receiveBuffer=new PayloadBuffer(message.data, [this, peer](void *) { sharedMemory->releaseSlab(peer); }, 1);
+      } else {
+        char * buffer=getReceiveBuffer();
+        memcpy(buffer, message.data, message.size);
+        receiveBuffer=new PayloadBuffer(buffer, [this](void * buffer) { returnReceiveBuffer(buffer); }, 1);
+      }
+      // The space in the ring can be reused straight away, as the message has either been copied out or is in the slab
+      sharedMemory->consumeMessage(peer, &message);
+      processArrivedMessage(receiveBuffer, message.size, sharedMemory->getCommunicatorRank(peer), &lanes[message.lane]);
+      receiveBuffer->release();
+      number_processed++;
+    }
+  }
+  return number_processed;
+}
+
+/**
+* Tests the receives of the persistent channels for completion, processing those of each channel in the order that they were started and stopping at
+* the first that has not completed. Events point directly into the channel's receive buffer, and the receive is restarted once the event has been
+* consumed. At most the given number of messages are processed, returns the number that were
+*/
+int MPI_P2P_Messaging::drainPersistentChannels(int max_messages) {
+  std::vector<SpecificEvent*> arrivedEvents;
   {
-    std::lock_guard<std::mutex> out_sendReq_lock(outstandingSendRequests_mutex);
-    outstandingSendRequests.insert(std::pair<MPI_Request, char*>(request, buffer));
+    std::lock_guard<std::mutex> lock(persistentChannels_mutex);
+    for (int i=0;i<(int) persistentChannels.size() && (int) arrivedEvents.size() < max_messages;i++) {
+      PersistentChannel * channel=persistentChannels[i];
+      if (channel == NULL) continue;
+      std::lock_guard<std::mutex> receive_lock(channel->receive_mutex);
+      while ((int) arrivedEvents.size() < max_messages && !channel->startedReceives.empty()) {
+        int slot=channel->startedReceives.front(), completed;
+        if (protectMPI) mpi_mutex.lock();
+        MPI_Test(&channel->receiveRequests[slot], &completed, MPI_STATUS_IGNORE);
+        if (protectMPI) mpi_mutex.unlock();
+        if (!completed) break;
+        channel->startedReceives.pop_front();
+        SpecificEvent * event=new SpecificEvent(channel->peer, channel->data_count, channel->payload_size, channel->data_type, false, false,
+                                                channel->event_id, channel->payload_size > 0 ? channel->receiveBuffers[slot] : NULL);
+        event->setPayload(new PayloadBuffer(channel->receiveBuffers[slot], [this, channel, slot](void *) {
+          restartChannelReceive(channel, slot);
+        }, 1));
+        messages_received[channel->peer]++;
+        arrivedEvents.push_back(event);
+      }
+    }
   }
+  if (!arrivedEvents.empty()) terminated=false;
+  for (SpecificEvent * event : arrivedEvents) registerArrivedEvent(event);
+  return arrivedEvents.size();
+}
+
+/**
+* Restarts the receive of a persistent channel once the event that was received into its buffer has been consumed, this becomes the last of the
+* channel's started receives. This can be called from any thread
+*/
+void MPI_P2P_Messaging::restartChannelReceive(PersistentChannel * channel, int slot) {
+  std::lock_guard<std::mutex> receive_lock(channel->receive_mutex);
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Start(&channel->receiveRequests[slot]);
+  if (protectMPI) mpi_mutex.unlock();
+  channel->startedReceives.push_back(slot);
+}
+
+/**
+* Retrieves a buffer for receiving into from the pool, allocating a new one if the pool is empty
+*/
+char * MPI_P2P_Messaging::getReceiveBuffer() {
+  std::unique_lock<std::mutex> pool_lock(receiveBufferPool_mutex);
+  if (!freeReceiveBuffers.empty()) {
+    char * buffer=freeReceiveBuffers.back();
+    freeReceiveBuffers.pop_back();
+    return buffer;
+  }
+  pool_lock.unlock();
+  void * memory;
+  if (posix_memalign(&memory, RECV_BUFFER_ALIGNMENT, recv_buffer_size) != 0) raiseError("Unable to allocate memory for a receive buffer");
+  return (char*) memory;
+}
+
+/**
+* Returns a receive buffer to the pool once no events point into it, the pool is capped at the size of the rings and any surplus buffers freed
+*/
+void MPI_P2P_Messaging::returnReceiveBuffer(void * buffer) {
+  std::unique_lock<std::mutex> pool_lock(receiveBufferPool_mutex);
+  if ((int) freeReceiveBuffers.size() < recv_ring_size * number_lanes) {
+    freeReceiveBuffers.push_back((char*) buffer);
+  } else {
+    pool_lock.unlock();
+    free(buffer);
+  }
+}
+
+/**
+* Cancels the outstanding receives of the ring of a lane and frees its memory, this is done at finalisation
+*/
+void MPI_P2P_Messaging::cancelReceiveRing(MessagingLane & lane) {
+  if (protectMPI) mpi_mutex.lock();
+  for (int i=0;i<recv_ring_size;i++) {
+    if (lane.recv_ring_requests[i] != MPI_REQUEST_NULL) {
+      MPI_Cancel(&lane.recv_ring_requests[i]);
+      MPI_Wait(&lane.recv_ring_requests[i], MPI_STATUS_IGNORE);
+    }
+  }
+  if (protectMPI) mpi_mutex.unlock();
+  for (int i=0;i<recv_ring_size;i++) free(lane.recv_ring_buffers[i]);
+  delete[] lane.recv_ring_buffers;
+  delete[] lane.recv_ring_requests;
+  delete[] lane.recv_ring_message_sizes;
+  delete[] lane.recv_ring_sources;
+  delete[] lane.recv_ring_indicies;
+  delete[] lane.recv_ring_completed;
+}
+
+/**
+* Closes the persistent channels at finalisation. Sends have all been received by this point (as termination requires that the counts of messages
+* match) so these are waited on, whereas started receives are cancelled. By then every event received on a channel has been consumed, so all of the
+* receives have been restarted and the requests can be freed along with the buffers
+*/
+void MPI_P2P_Messaging::freePersistentChannels() {
+  std::lock_guard<std::mutex> lock(persistentChannels_mutex);
+  for (PersistentChannel * channel : persistentChannels) {
+    if (channel == NULL) continue;
+    if (protectMPI) mpi_mutex.lock();
+    for (size_t i=0;i<channel->sendRequests.size();i++) {
+      MPI_Wait(&channel->sendRequests[i], MPI_STATUS_IGNORE);
+      MPI_Request_free(&channel->sendRequests[i]);
+      free(channel->sendBuffers[i]);
+    }
+    for (int slot : channel->startedReceives) {
+      MPI_Cancel(&channel->receiveRequests[slot]);
+      MPI_Wait(&channel->receiveRequests[slot], MPI_STATUS_IGNORE);
+    }
+    for (int i=0;i<channel_depth;i++) {
+      MPI_Request_free(&channel->receiveRequests[i]);
+      free(channel->receiveBuffers[i]);
+    }
+    if (protectMPI) mpi_mutex.unlock();
+    delete[] channel->receiveBuffers;
+    delete[] channel->receiveRequests;
+    delete channel;
+  }
+  persistentChannels.clear();
 }
 
 /**
@@ -182,7 +1330,7 @@ void MPI_P2P_Messaging::sendSingleEvent(void * data, int data_count, int data_ty
 */
 void MPI_P2P_Messaging::lockMutexForFinalisationTest() {
   dataArrival_mutex.lock();
-  outstandingSendRequests_mutex.lock();
+  for (int i=0;i<number_lanes;i++) lanes[i].outstandingSendRequests_mutex.lock();
 }
 
 /**
@@ -190,24 +1338,24 @@ void MPI_P2P_Messaging::lockMutexForFinalisationTest() {
 */
 void MPI_P2P_Messaging::unlockMutexForFinalisationTest() {
   dataArrival_mutex.unlock();
-  outstandingSendRequests_mutex.unlock();
+  for (int i=0;i<number_lanes;i++) lanes[i].outstandingSendRequests_mutex.unlock();
 }
 
 /**
 * Determines whether the messaging is finished or not locally
 */
 bool MPI_P2P_Messaging::isFinished() {
-  int pending_message, global_pending_message;
-  if (protectMPI) mpi_mutex.lock();
-  MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, communicator, &pending_message, MPI_STATUS_IGNORE);
-  if (enableBridge) {
-    MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, MPI_COMM_WORLD, &global_pending_message, MPI_STATUS_IGNORE);
-  } else {
-    global_pending_message=0;
+  int pending_message=0;
+  for (int j=0;j<number_lanes;j++) {
+    for (int i=0;i<recv_ring_size;i++) {
+      if (lanes[j].recv_ring_completed[i]) pending_message=1;
+    }
+    if (lanes[j].send_slab_count > 0 || !lanes[j].incomingChunkedTransfers.empty()) return false;
   }
-  if (protectMPI) mpi_mutex.unlock();
-  if (pending_message || global_pending_message) return false;
-  return outstandingSendRequests.empty() && eventShortTermStore.empty();
+  if (sharedMemory != NULL && (sharedMemory->hasPendingOutgoing() || sharedMemory->hasPendingIncoming())) return false;
+  if (pending_message || !eventShortTermStore.empty() || coalesced_events_pending > 0) return false;
+  // Probing the routed communicators is left until last, so that this is only done when the messaging is otherwise finished
+  return !hasPendingRoutedMessages();
 }
 
 /**
@@ -217,6 +1365,25 @@ bool MPI_P2P_Messaging::isFinished() {
 void MPI_P2P_Messaging::finalise() {
   continue_polling=false;
   Messaging::finalise();
+  for (int i=0;i<number_lanes;i++) {
+    cancelReceiveRing(lanes[i]);
+    if (i > 0) MPI_Comm_free(&lanes[i].communicator);
+  }
+  MPI_Comm_free(&termination_communicator);
+  freePersistentChannels();
+  MPI_Comm_free(&channel_communicator);
+  {
+    // The routed communicators belong to the caller, so only the entries are freed
+    std::lock_guard<std::mutex> routing_lock(routingTable_mutex);
+    for (RoutedCommunicator * routed : routingTable) delete routed;
+    routingTable.clear();
+  }
+  if (sharedMemory != NULL) sharedMemory->finalise();
+  {
+    std::lock_guard<std::mutex> pool_lock(receiveBufferPool_mutex);
+    for (char * buffer : freeReceiveBuffers) free(buffer);
+    freeReceiveBuffers.clear();
+  }
   if (mpiInitHere) MPI_Finalize();
 }
 
@@ -235,35 +1402,105 @@ int MPI_P2P_Messaging::getNumRanks() {
 }
 
 /**
-* Checks the outstanding send requests for progress and will free the buffers of any that have been sent, this is just a clean up routine
+* Checks the outstanding send requests of every lane for progress and will free the buffers of any that have been sent, this is just a clean up routine.
+* User owned payloads are released once no lock is held, as their release function might call back into EDAT
 */
 void MPI_P2P_Messaging::checkSendRequestsForProgress() {
-  std::vector<MPI_Request> allreqHandles, storedReqHandles;
-  std::lock_guard<std::mutex> out_sendReq_lock(outstandingSendRequests_mutex);
-  for(auto imap : outstandingSendRequests) {
-    allreqHandles.push_back(imap.first);
-    // Needed as the MPI call resets the request back to null, hence we rely on the index and grab the origonal request based on this
-    storedReqHandles.push_back(imap.first);
-  }
-
-  if (!allreqHandles.empty()) {
-    MPI_Request * req_handles=(MPI_Request *) allreqHandles.data();
-    int * returnIndicies=new int[allreqHandles.size()];
-    int out_count;
-    if (protectMPI) mpi_mutex.lock();
-    MPI_Testsome(allreqHandles.size(), req_handles, &out_count, returnIndicies, MPI_STATUSES_IGNORE);
-    if (protectMPI) mpi_mutex.unlock();
-    if (out_count > 0) {
-      for (int i=0;i<out_count;i++) {
-        auto it = outstandingSendRequests.find(storedReqHandles[returnIndicies[i]]);
-        if (it != outstandingSendRequests.end()) {
-          free(it->second);
-          outstandingSendRequests.erase(it);
-        }
-      }
-    }
-    delete[] returnIndicies;
+  std::vector<PayloadBuffer*> payloadsToRelease;
+  for (int i=0;i<number_lanes;i++) checkSendRequestsForProgress(lanes[i], payloadsToRelease);
+  for (PayloadBuffer * payload : payloadsToRelease) payload->release();
+}
+
+/**
+* Checks the outstanding send requests of a lane for progress. The slab of requests is tested in place, MPI sets completed requests to null and their
+* slots are then reused. The user owned payloads of completed sends are added to the list to release
+*/
+void MPI_P2P_Messaging::checkSendRequestsForProgress(MessagingLane & lane, std::vector<PayloadBuffer*> & payloadsToRelease) {
+  std::lock_guard<std::mutex> out_sendReq_lock(lane.outstandingSendRequests_mutex);
+  if (lane.send_slab_count == 0) return;
+  int out_count;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Testsome(lane.send_slab_extent, lane.sendSlabRequests, &out_count, lane.sendSlabCompletedIndicies, MPI_STATUSES_IGNORE);
+  if (protectMPI) mpi_mutex.unlock();
+  for (int i=0;i<out_count && out_count != MPI_UNDEFINED;i++) {
+    int slot=lane.sendSlabCompletedIndicies[i];
+    free(lane.sendSlabEntries[slot].buffer);
+    if (lane.sendSlabEntries[slot].payload != NULL) payloadsToRelease.push_back(lane.sendSlabEntries[slot].payload);
+    if (lane.sendSlabEntries[slot].transfer != NULL) completeChunkSend(lane, lane.sendSlabEntries[slot].transfer, payloadsToRelease);
+    lane.sendSlabEntries[slot]=OutstandingSend();
+    lane.sendSlabFreeSlots[lane.send_slab_free_count++]=slot;
+    lane.send_slab_count--;
+  }
+  // Once all sends have completed the slab is empty again, so it can be reused from the start which keeps the range that is tested small
+  if (lane.send_slab_count == 0) lane.send_slab_extent=lane.send_slab_free_count=0;
+  // Completed chunks make way for the next ones in flight
+  if (!lane.outgoingChunkedTransfers.empty()) startChunkSends(lane);
+}
+
+/**
+* Determines the number of polls between checks for the completion of sends, this adapts to how full the slabs of outstanding sends are so that as
+* they fill up the sends are checked (and the slots and buffers freed) more often. When any is half full or more (or there are chunked transfers in
+* progress) then they are checked on every poll
+*/
+int MPI_P2P_Messaging::getSendProgressPeriod() {
+  // Chunked transfers only move on once chunks in flight have completed, so these are checked on every poll
+  if (chunked_sends_pending > 0) return 0;
+  int period=SEND_PROGRESS_PERIOD;
+  for (int i=0;i<number_lanes;i++) {
+    int occupancy=lanes[i].send_slab_count, capacity=lanes[i].send_slab_capacity;
+    if (occupancy * 2 >= capacity) return 0;
+    period=std::min(period, (SEND_PROGRESS_PERIOD * (capacity - (occupancy * 2))) / capacity);
+  }
+  return period;
+}
+
+/**
+* Tracks a send that has been started on a lane, placing it in a free slot of the slab (the slab is grown if it is full.) Must be called with the lane's
+* outstanding send requests mutex held
+*/
+void MPI_P2P_Messaging::trackOutstandingSend(MessagingLane & lane, MPI_Request request, char * buffer, PayloadBuffer * payload) {
+  trackOutstandingSend(lane, request, OutstandingSend(buffer, payload));
+}
+
+/**
+* Tracks a send that has been started on a lane, this is the general form where the outstanding send might instead be a chunk of a chunked transfer
+*/
+void MPI_P2P_Messaging::trackOutstandingSend(MessagingLane & lane, MPI_Request request, OutstandingSend send) {
+  int slot;
+  if (lane.send_slab_free_count > 0) {
+    slot=lane.sendSlabFreeSlots[--lane.send_slab_free_count];
+  } else {
+    // Growing rather than waiting for sends to complete, as blocking here whilst holding the locks could deadlock with a peer doing the same
+    if (lane.send_slab_extent == lane.send_slab_capacity) allocateSendSlab(lane, lane.send_slab_capacity * 2);
+    slot=lane.send_slab_extent++;
+  }
+  lane.sendSlabRequests[slot]=request;
+  lane.sendSlabEntries[slot]=send;
+  lane.send_slab_count++;
+}
+
+/**
+* Allocates the slab of outstanding sends of a lane with a specific capacity, copying over the existing contents if it is being grown. The slab is only
+* grown when there are no free slots, so the list of these does not need to be carried over
+*/
+void MPI_P2P_Messaging::allocateSendSlab(MessagingLane & lane, int capacity) {
+  if (capacity < 1) raiseError("The send slab size must be at least one");
+  MPI_Request * newRequests=new MPI_Request[capacity];
+  OutstandingSend * newEntries=new OutstandingSend[capacity];
+  for (int i=0;i<capacity;i++) newRequests[i]=MPI_REQUEST_NULL;
+  if (lane.send_slab_capacity > 0) {
+    std::copy(lane.sendSlabRequests, lane.sendSlabRequests + lane.send_slab_capacity, newRequests);
+    std::copy(lane.sendSlabEntries, lane.sendSlabEntries + lane.send_slab_capacity, newEntries);
+    delete[] lane.sendSlabRequests;
+    delete[] lane.sendSlabEntries;
+    delete[] lane.sendSlabFreeSlots;
+    delete[] lane.sendSlabCompletedIndicies;
   }
+  lane.sendSlabRequests=newRequests;
+  lane.sendSlabEntries=newEntries;
+  lane.sendSlabFreeSlots=new int[capacity];
+  lane.sendSlabCompletedIndicies=new int[capacity];
+  lane.send_slab_capacity=capacity;
 }
 
 /**
@@ -282,35 +1519,286 @@ void MPI_P2P_Messaging::unlockComms() {
 }
 
 /**
-* Handles the arrival of some message (driven by the MPI status which we likely got from a probe and the appropriate
-* communicator)
+* Receives and handles a message that has been probed on a routed communicator. These messages are not counted for termination, as they come from
+* processes outside of the protocol, and chunked events can not be received this way
 */
-void MPI_P2P_Messaging::handleRemoteMessageArrival(MPI_Status message_status, MPI_Comm comm_to_use) {
-  char* buffer, *data_buffer;
-  int message_size;
+void MPI_P2P_Messaging::handleRoutedMessageArrival(MPI_Status message_status, RoutedCommunicator & routed) {
+  char* buffer;
+  int message_size, source=message_status.MPI_SOURCE;
   #if DO_METRICS
     unsigned long int timer_key_pm = metrics::METRICS->timerStart("pending_message");
   #endif
-  terminated=false;
   if (protectMPI) mpi_mutex.lock();
   MPI_Get_count(&message_status, MPI_BYTE, &message_size);
   buffer = (char*)malloc(message_size);
-  MPI_Recv(buffer, message_size, MPI_BYTE, message_status.MPI_SOURCE, MPI_TAG, comm_to_use, MPI_STATUS_IGNORE);
+  MPI_Recv(buffer, message_size, MPI_BYTE, source, MPI_TAG, routed.communicator, MPI_STATUS_IGNORE);
   if (protectMPI) mpi_mutex.unlock();
-  int data_type = *((int*)buffer);
-  int source_pid = *((int*)&buffer[4]);
-  char persistent=*((char*)&buffer[12]);
-  int event_id_length = strlen(&buffer[13]);
-  int data_size = message_size - (13 + event_id_length + 1);
-  if (data_size > 0) {
-    data_buffer = (char*)malloc(data_size);
-    memcpy(data_buffer, &buffer[13 + event_id_length + 1], data_size);
+  terminated=false;
+  checkWireVersion(buffer);
+  PayloadBuffer * receiveBuffer=new PayloadBuffer(buffer, NULL, 1);
+  std::vector<std::string> & eventIds=routed.receivedEventIds[source];
+  if (buffer[1] & PACKET_FLAG_CHUNKED) {
+    raiseError("Chunked events can not be received on a routed communicator");
+  } else if (buffer[1] & PACKET_FLAG_LARGE) {
+    int large_message_size;
+    memcpy(&large_message_size, &buffer[4], sizeof(int));
+    char * large_buffer=(char*) malloc(large_message_size);
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Recv(large_buffer, large_message_size, MPI_BYTE, source, MPI_LARGE_TAG, routed.communicator, MPI_STATUS_IGNORE);
+    if (protectMPI) mpi_mutex.unlock();
+    checkWireVersion(large_buffer);
+    PayloadBuffer * largeReceiveBuffer=new PayloadBuffer(large_buffer, NULL, 1);
+    unpackMessage(largeReceiveBuffer, eventIds);
+    largeReceiveBuffer->release();
   } else {
-    data_buffer = NULL;
+    unpackMessage(receiveBuffer, eventIds);
+  }
+  receiveBuffer->release();
+  #if DO_METRICS
+    metrics::METRICS->timerStop("pending_message", timer_key_pm);
+  #endif
+}
+
+/**
+* Probes the communicators of the routing table that are due, in turn, and receives up to the weight of each in messages. A communicator that had
+* messages is probed again on the next poll, otherwise the interval until it is next probed is doubled (up to the maximum.) Must be called with the
+* data arrival mutex held. Returns the number of messages received
+*/
+int MPI_P2P_Messaging::probeRoutedCommunicators() {
+  std::lock_guard<std::mutex> routing_lock(routingTable_mutex);
+  int number_processed=0;
+  for (RoutedCommunicator * routed : routingTable) {
+    if (--routed->polls_until_probe > 0) continue;
+    int received=0, pending;
+    MPI_Status status;
+    while (received < routed->weight) {
+      if (protectMPI) mpi_mutex.lock();
+      MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, routed->communicator, &pending, &status);
+      if (protectMPI) mpi_mutex.unlock();
+      if (!pending) break;
+      handleRoutedMessageArrival(status, *routed);
+      received++;
+    }
+    routed->probe_interval=received > 0 ? 1 : std::min(routed->probe_interval * 2, max_probe_interval);
+    routed->polls_until_probe=routed->probe_interval;
+    number_processed+=received;
+  }
+  return number_processed;
+}
+
+/**
+* Determines whether there are messages waiting on any of the routed communicators. Every communicator is probed, regardless of when it is next due
+* to be probed by the polling, as messages from outside of EDAT are not covered by the termination protocol
+*/
+bool MPI_P2P_Messaging::hasPendingRoutedMessages() {
+  std::lock_guard<std::mutex> routing_lock(routingTable_mutex);
+  int pending=0;
+  if (protectMPI) mpi_mutex.lock();
+  for (size_t i=0;i<routingTable.size() && !pending;i++) {
+    MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, routingTable[i]->communicator, &pending, MPI_STATUS_IGNORE);
   }
-  SpecificEvent* event=new SpecificEvent(source_pid, data_size > 0 ? data_size / getTypeSize(data_type) : 0, data_size, data_type,
-                                          persistent == 1 ? true : false, contextManager.isTypeAContext(data_type), std::string(&buffer[13]), data_buffer);
-  if (batchEvents) {
+  if (protectMPI) mpi_mutex.unlock();
+  return pending;
+}
+
+/**
+* Processes a message that has been received on a lane. If a chunked event is being received from the source on the lane then the message is deferred
+* until that has completed. The caller holds a reference to the receive buffer throughout
+*/
+void MPI_P2P_Messaging::processArrivedMessage(PayloadBuffer * receiveBuffer, int, int source, MessagingLane * lane) {
+  char * buffer=(char*) receiveBuffer->getData();
+  terminated=false;
+  checkWireVersion(buffer);
+  messages_received[source]++;
+  std::map<int, IncomingChunkedTransfer*>::iterator it=lane->incomingChunkedTransfers.find(source);
+  if (it != lane->incomingChunkedTransfers.end()) {
+    receiveBuffer->retain();
+    it->second->deferredMessages.push_back(receiveBuffer);
+    return;
+  }
+  handleArrivedMessage(receiveBuffer, source, lane);
+}
+
+/**
+* Handles a message in the order that it was sent, if this is an announcement of a large message then that is received here from the source and if it
+* is a chunked event then the transfer of the chunks is started
+*/
+void MPI_P2P_Messaging::handleArrivedMessage(PayloadBuffer * receiveBuffer, int source, MessagingLane * lane) {
+  char * buffer=(char*) receiveBuffer->getData();
+  std::vector<std::string> & eventIds=lane->receivedEventIds[source];
+  if (buffer[1] & PACKET_FLAG_CHUNKED) {
+    startIncomingChunkedTransfer(receiveBuffer, source, *lane);
+  } else if (buffer[1] & PACKET_FLAG_LARGE) {
+    int large_message_size;
+    memcpy(&large_message_size, &buffer[4], sizeof(int));
+    char * large_buffer=(char*) malloc(large_message_size);
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Recv(large_buffer, large_message_size, MPI_BYTE, source, MPI_LARGE_TAG, lane->communicator, MPI_STATUS_IGNORE);
+    if (protectMPI) mpi_mutex.unlock();
+    checkWireVersion(large_buffer);
+    PayloadBuffer * largeReceiveBuffer=new PayloadBuffer(large_buffer, NULL, 1);
+    unpackMessage(largeReceiveBuffer, eventIds);
+    largeReceiveBuffer->release();
+  } else {
+    unpackMessage(receiveBuffer, eventIds);
+  }
+}
+
+/**
+* Starts receiving a chunked event, the destination buffer for the whole payload is allocated up front and receives for the first chunks are posted
+* directly into it. Unless streaming, the event is registered once all chunks have arrived. When streaming, each chunk is registered as an event of
+* its own as it arrives (in order), which holds a reference to the destination buffer. Persistent events and contexts are never streamed
+*/
+void MPI_P2P_Messaging::startIncomingChunkedTransfer(PayloadBuffer * receiveBuffer, int source, MessagingLane & lane) {
+  char * packet=(char*) receiveBuffer->getData();
+  EventHeader header;
+  unsigned int source_pid;
+  readEventHeader(packet, lane.receivedEventIds[source], header, &source_pid);
+  IncomingChunkedTransfer * transfer=new IncomingChunkedTransfer();
+  transfer->source=source;
+  transfer->source_pid=source_pid;
+  transfer->data_type=header.data_type;
+  transfer->data_count=header.data_count;
+  transfer->event_id=std::string(header.event_id, header.event_id_length);
+  transfer->persistent=header.persistent;
+  transfer->urgent=header.urgent;
+  transfer->context=header.context;
+  transfer->streaming=chunkStreaming && !header.persistent && !header.context;
+  transfer->size=getTypeSize(header.data_type) * header.data_count;
+  memcpy(&transfer->chunk_size, &packet[header.header_size], sizeof(int));
+  transfer->number_chunks=(transfer->size + transfer->chunk_size - 1) / transfer->chunk_size;
+  transfer->chunks_posted=transfer->chunks_delivered=0;
+  transfer->requests=new MPI_Request[transfer->number_chunks];
+  transfer->completedIndicies.resize(transfer->number_chunks);
+  transfer->completed=new bool[transfer->number_chunks];
+  transfer->data=(char*) malloc(transfer->size);
+  // Persistent events are given their own data, otherwise the event (or each chunk when streaming) holds a reference to the destination
+  transfer->destination=header.persistent ? NULL : new PayloadBuffer(transfer->data, NULL, transfer->streaming ? transfer->number_chunks : 1);
+  lane.incomingChunkedTransfers[source]=transfer;
+  postChunkReceives(lane, transfer);
+}
+
+/**
+* Posts the receives of further chunks of a chunked transfer, up to the bound of chunks in flight
+*/
+void MPI_P2P_Messaging::postChunkReceives(MessagingLane & lane, IncomingChunkedTransfer * transfer) {
+  if (protectMPI) mpi_mutex.lock();
+  while (transfer->chunks_posted < transfer->number_chunks && transfer->chunks_posted - transfer->chunks_delivered < chunks_in_flight) {
+    int offset=transfer->chunks_posted * transfer->chunk_size;
+    MPI_Irecv(&transfer->data[offset], std::min(transfer->chunk_size, transfer->size - offset), MPI_BYTE, transfer->source, MPI_CHUNK_TAG,
+              lane.communicator, &transfer->requests[transfer->chunks_posted]);
+    transfer->completed[transfer->chunks_posted]=false;
+    transfer->chunks_posted++;
+  }
+  if (protectMPI) mpi_mutex.unlock();
+}
+
+/**
+* Tests the chunks in flight of the chunked transfers of a lane. Chunks are delivered in order (when streaming then each is registered as an event),
+* and then the receives of further chunks posted. Transfers where every chunk has been delivered are completed. Returns the number of chunks that have
+* arrived
+*/
+int MPI_P2P_Messaging::progressIncomingChunkedTransfers(MessagingLane & lane) {
+  int number_arrived=0, out_count;
+  std::vector<IncomingChunkedTransfer*> completedTransfers;
+  for (std::pair<const int, IncomingChunkedTransfer*> & entry : lane.incomingChunkedTransfers) {
+    IncomingChunkedTransfer * transfer=entry.second;
+    int chunks_in_progress=transfer->chunks_posted - transfer->chunks_delivered;
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Testsome(chunks_in_progress, &transfer->requests[transfer->chunks_delivered], &out_count, transfer->completedIndicies.data(),
+                 MPI_STATUSES_IGNORE);
+    if (protectMPI) mpi_mutex.unlock();
+    for (int i=0;i<out_count && out_count != MPI_UNDEFINED;i++) {
+      transfer->completed[transfer->chunks_delivered + transfer->completedIndicies[i]]=true;
+      number_arrived++;
+    }
+    while (transfer->chunks_delivered < transfer->chunks_posted && transfer->completed[transfer->chunks_delivered]) {
+      if (transfer->streaming) {
+        int offset=transfer->chunks_delivered * transfer->chunk_size;
+        int chunk_bytes=std::min(transfer->chunk_size, transfer->size - offset);
+        SpecificEvent * event=new SpecificEvent(transfer->source_pid, chunk_bytes / getTypeSize(transfer->data_type), chunk_bytes, transfer->data_type,
+                                                false, contextManager.isTypeAContext(transfer->data_type), transfer->event_id,
+                                                &transfer->data[offset]);
+        event->setPayload(transfer->destination);
+        event->setUrgent(transfer->urgent);
+        registerArrivedEvent(event);
+      }
+      transfer->chunks_delivered++;
+    }
+    if (transfer->chunks_delivered == transfer->number_chunks) {
+      completedTransfers.push_back(transfer);
+    } else {
+      postChunkReceives(lane, transfer);
+    }
+  }
+  for (IncomingChunkedTransfer * transfer : completedTransfers) completeIncomingChunkedTransfer(lane, transfer);
+  return number_arrived;
+}
+
+/**
+* Completes a chunked transfer once all chunks have been delivered, registering the event (unless it was streamed) and then handling the messages
+* from the source that were deferred meanwhile. If one of these starts another chunked transfer then the remainder are deferred to that
+*/
+void MPI_P2P_Messaging::completeIncomingChunkedTransfer(MessagingLane & lane, IncomingChunkedTransfer * transfer) {
+  int source=transfer->source;
+  lane.incomingChunkedTransfers.erase(source);
+  if (!transfer->streaming) {
+    SpecificEvent * event=new SpecificEvent(transfer->source_pid, transfer->data_count, transfer->size, transfer->data_type, transfer->persistent,
+                                            contextManager.isTypeAContext(transfer->data_type), transfer->event_id, transfer->data);
+    if (transfer->destination != NULL) event->setPayload(transfer->destination);
+    event->setUrgent(transfer->urgent);
+    registerArrivedEvent(transfer->context ? unpackContextEvent(event) : event);
+  }
+  std::deque<PayloadBuffer*> deferredMessages;
+  deferredMessages.swap(transfer->deferredMessages);
+  delete[] transfer->requests;
+  delete[] transfer->completed;
+  delete transfer;
+  while (!deferredMessages.empty()) {
+    std::map<int, IncomingChunkedTransfer*>::iterator it=lane.incomingChunkedTransfers.find(source);
+    if (it != lane.incomingChunkedTransfers.end()) {
+      it->second->deferredMessages.insert(it->second->deferredMessages.end(), deferredMessages.begin(), deferredMessages.end());
+      break;
+    }
+    PayloadBuffer * receiveBuffer=deferredMessages.front();
+    deferredMessages.pop_front();
+    handleArrivedMessage(receiveBuffer, source, &lane);
+    receiveBuffer->release();
+  }
+}
+
+/**
+* Checks that a message is in the wire format of this version of EDAT, raising an error if not
+*/
+void MPI_P2P_Messaging::checkWireVersion(char * buffer) {
+  if (buffer[0] != WIRE_FORMAT_VERSION) raiseError("Received a message in an incompatible wire format, all processes must run the same version of EDAT");
+}
+
+/**
+* Unpacks a message into its event(s) and registers these, the event identifiers are those of the link from the source of the message
+*/
+void MPI_P2P_Messaging::unpackMessage(PayloadBuffer * receiveBuffer, std::vector<std::string> & eventIds) {
+  char * buffer=(char*) receiveBuffer->getData();
+  int packet_size;
+  if (buffer[1] & PACKET_FLAG_COALESCED) {
+    // Split a coalesced message back into the individual events
+    int number_events, offset=COALESCED_HEADER_SIZE;
+    memcpy(&number_events, &buffer[4], sizeof(int));
+    for (int i=0;i<number_events;i++) {
+      registerArrivedEvent(unpackEvent(&buffer[offset], receiveBuffer, eventIds, &packet_size));
+      offset+=ALIGN_TO_PAYLOAD(packet_size);
+    }
+  } else {
+    registerArrivedEvent(unpackEvent(buffer, receiveBuffer, eventIds, &packet_size));
+  }
+}
+
+/**
+* Registers an event that has arrived from a remote process with the scheduler, or stores it for registering as part of a batch (urgent events are
+* never batched)
+*/
+void MPI_P2P_Messaging::registerArrivedEvent(SpecificEvent * event) {
+  if (batchEvents && !event->isUrgent()) {
     last_event_arrival=MPI_Wtime();
     eventShortTermStore.push_back(event);
     if (eventShortTermStore.size() >= max_batched_events) {
@@ -320,14 +1808,45 @@ void MPI_P2P_Messaging::handleRemoteMessageArrival(MPI_Status message_status, MP
   } else {
     scheduler.registerEvent(event);
   }
-  free(buffer);
+}
+
+/**
+* Receives and processes the messages that are pending on the lanes (and through shared memory.) Rather than a single pass, this keeps on draining
+* whilst messages are arriving, until the message budget (or time budget if there is one) of the poll has been used up, so that a burst of messages
+* is received without the housekeeping of the poll between each. Each pass starts with the urgent lane, so urgent events are received ahead of any
+* normal messages that are waiting. Must be called with the data arrival mutex held. Returns the number of messages processed
+*/
+int MPI_P2P_Messaging::receivePendingMessages() {
+  int number_processed=0, processed_this_pass;
+  double start_time=poll_time_budget > 0 || DO_METRICS ? MPI_Wtime() : 0.0;
+  do {
+    processed_this_pass=0;
+    for (int i=0;i<number_lanes && number_processed + processed_this_pass < poll_message_budget;i++) {
+      // The urgent lane is the last, so drain it first and then the others in order
+      MessagingLane & lane=lanes[(i + number_lanes - 1) % number_lanes];
+      processed_this_pass+=drainReceiveRing(lane, poll_message_budget - number_processed - processed_this_pass);
+      if (!lane.incomingChunkedTransfers.empty()) processed_this_pass+=progressIncomingChunkedTransfers(lane);
+    }
+    if (sharedMemory != NULL && number_processed + processed_this_pass < poll_message_budget) {
+      processed_this_pass+=drainSharedMemory(poll_message_budget - number_processed - processed_this_pass);
+    }
+    if (number_processed + processed_this_pass < poll_message_budget) {
+      processed_this_pass+=drainPersistentChannels(poll_message_budget - number_processed - processed_this_pass);
+    }
+    number_processed+=processed_this_pass;
+  } while (processed_this_pass > 0 && number_processed < poll_message_budget &&
+           (poll_time_budget <= 0 || MPI_Wtime() - start_time < poll_time_budget));
   #if DO_METRICS
-    metrics::METRICS->timerStop("pending_message", timer_key_pm);
+    if (number_processed > 0) {
+      metrics::METRICS->recordValue("MessagesPerPoll", number_processed);
+      metrics::METRICS->recordValue("TimePerMessage", (MPI_Wtime() - start_time) / number_processed);
+    }
   #endif
+  return number_processed;
 }
 
 /**
-* The main polling functionality, this will go through and fire a local event, then every so often will check for sending of event progress (request handles.) It then
+* The main polling functionality, this will register any buffered local events, then every so often will check for sending of event progress (request handles.) It then
 * will check for any messages pending, if there is one then this is received and marshalled/decoded into an event before being registered with the scheduler.
 * If there are no outstanding messages, then we might be in a local termination criteria - check if so and handle. Regardless progress termination protocol.
 * This only performs one "tick" through, so is called repeatedly by a progress thread of an idle thread if there is none
@@ -336,51 +1855,30 @@ bool MPI_P2P_Messaging::performSinglePoll(int * iteration_counter) {
   #if DO_METRICS
     unsigned long int timer_key_psp = metrics::METRICS->timerStart("performSinglePoll");
   #endif
-  int pending_message, global_pending_message;
-  MPI_Status message_status, message_status_global;
+  int pending_message, routed_messages;
 
-  fireASingleLocalEvent();
-  if (*iteration_counter == SEND_PROGRESS_PERIOD) {
+  poll_messages_handled=registerBufferedLocalEvents() ? 1 : 0;
+  if (coalesceEvents && coalesced_events_pending > 0) flushCoalescedEvents(false);
+  if (sharedMemory != NULL && sharedMemory->hasPendingOutgoing()) sharedMemory->flushOverflowMessages();
+  if (*iteration_counter >= getSendProgressPeriod()) {
     checkSendRequestsForProgress();
     *iteration_counter=0;
   } else {
     (*iteration_counter)++;
   }
   std::unique_lock<std::mutex> dataArrivalLock(dataArrival_mutex);
-  if (protectMPI) mpi_mutex.lock();
-  MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, communicator, &pending_message, &message_status);
-  if (enableBridge) {
-    MPI_Iprobe(MPI_ANY_SOURCE, MPI_TAG, MPI_COMM_WORLD, &global_pending_message, &message_status_global);
-  } else {
-    global_pending_message=0;
-  }
-  if (protectMPI) mpi_mutex.unlock();
-  if (pending_message) handleRemoteMessageArrival(message_status, communicator);
-  if (global_pending_message) handleRemoteMessageArrival(message_status_global, MPI_COMM_WORLD);
+  pending_message=receivePendingMessages();
+  routed_messages=probeRoutedCommunicators();
   dataArrivalLock.unlock();
+  poll_messages_handled+=pending_message + routed_messages;
 
-  if (!pending_message && !global_pending_message) {
+  if (!pending_message && !routed_messages) {
     if (batchEvents && !eventShortTermStore.empty() && MPI_Wtime() - last_event_arrival > batch_timeout) {
       scheduler.registerEvents(eventShortTermStore);
       eventShortTermStore.clear();
     }
-    bool current_terminated=checkForLocalTermination();
-    if (current_terminated && !terminated) {
-      terminated_id=std::rand();
-      if (my_rank != 0) {
-        if (protectMPI) mpi_mutex.lock();
-        int sendTerminationIdFlag=(terminate_send_req == MPI_REQUEST_NULL);
-        if (!sendTerminationIdFlag) MPI_Test(&terminate_send_req, &sendTerminationIdFlag, MPI_STATUS_IGNORE);
-        if (sendTerminationIdFlag) MPI_Isend(&terminated_id, 1, MPI_INT, 0, MPI_TERMINATION_TAG, communicator, &terminate_send_req);
-        if (termination_pingback_request == MPI_REQUEST_NULL) {
-          MPI_Irecv(NULL, 0, MPI_INT, 0, MPI_TERMINATION_TAG, communicator, &termination_pingback_request);
-        }
-        if (protectMPI) mpi_mutex.unlock();
-      }
-    }
-    terminated=current_terminated;
+    terminated=checkForLocalTermination();
   }
-  if (my_rank == 0) termination_codes[0]=terminated ? terminated_id : -1;
   #if DO_METRICS
     metrics::METRICS->timerStop("performSinglePoll", timer_key_psp);
   #endif
@@ -389,188 +1887,128 @@ bool MPI_P2P_Messaging::performSinglePoll(int * iteration_counter) {
 
 /**
 * Runs the poll for events from within a progress thread (the thread calls this procedure.) It will loop round and call the polling function
-* whilst there is progress to be made.
+* whilst there is progress to be made, between polls the progress thread is throttled depending upon the configured progress mode.
 */
 void MPI_P2P_Messaging::runPollForEvents() {
   int iteration_counter=0;
   while (continue_polling) {
     continue_polling=performSinglePoll(&iteration_counter);
+    if (continue_polling) throttleProgressThread(poll_messages_handled);
   }
 }
 
 /**
-* Handles the termination protocol, we have a process (0) as the master and others as workers. This is needed as we can tell if I am
-* idle myself (terminated), but that doesn't mean that I won't reactivate with another event. Hence we need to only terminate when all
-* ranks are completed. To check this, when ranks individually terminate they generate a random ID (which changes each time they reactivate
-* and re-terminate.) These are then sent to the master, which stores them and when ids have been received from each rank then it sends a command
-* to ping-back the latest termination ID (or -1 if it is currently active again.) If all these latest IDs match the previous IDs for each worker
-* then we assume the system is in a steady state and hence should terminate. If the ids are different then you go back to the first stage of gathering
-* termination IDs and pinging back.
+* Handles the termination protocol, which is a four counter method driven by waves of non-blocking reductions across all processes. A process only joins
+* a wave when it is locally terminated (idle), contributing its totals of event messages sent and received, and the wave completes once every process
+* has joined. Being idle doesn't mean that a process won't reactivate with another event, but it can only do so by receiving a message (which changes
+* its received total) and any messages it then sends change its sent total. Hence if two consecutive waves both have the total sent equal to the total
+* received, and these are unchanged between the waves, then there were no messages in flight and no process reactivated in between so the system is in
+* a steady state. Otherwise another wave is started once this process is idle again. Each wave is O(log P) and no process blocks on it, and as every
+* process sees the same totals they all decide to terminate on the same wave. Returns false once termination has been determined
 */
 bool MPI_P2P_Messaging::handleTerminationProtocol() {
   #if DO_METRICS
     unsigned long int timer_key = metrics::METRICS->timerStart("handleTerminationProtocol");
   #endif
-  if (my_rank == 0) {
-    bool rt=true;
-    if (mode == 0) trackTentativeTerminationCodes();
-    if (mode == 1) rt=confirmTerminationCodes();
-    #if DO_METRICS
-      metrics::METRICS->timerStop("handleTerminationProtocol", timer_key);
-    #endif
-    return rt;
-  } else {
-    #if DO_METRICS
-      metrics::METRICS->timerStop("handleTerminationProtocol", timer_key);
-    #endif
-    return handleTerminationProtocolMessagesAsWorker();
-  }
-}
-
-/**
-* Will handle the termination protocol as a worker (non-rank 0.) This involves two aspects, the first is waiting a ping back from
-* the master to send the current termination id (or -1 if I am now active.) This ping back will only be requested when the master
-* has been told from each rank that it is terminated, although obviously those ranks might now have progressed and be active again!
-* The second is checking for a termination command from the master, this is after the ping back and the master will determine if
-* all ranks are indeed completed or if it needs to crack on again
-*/
-bool MPI_P2P_Messaging::handleTerminationProtocolMessagesAsWorker() {
-  if (termination_pingback_request != MPI_REQUEST_NULL) {
-    int completed;
-    if (protectMPI) mpi_mutex.lock();
-    MPI_Test(&termination_pingback_request, &completed, MPI_STATUS_IGNORE);
-    if (completed) {
-      int not_completed=-1;
-      if (terminate_send_pingback != MPI_REQUEST_NULL) {
-        MPI_Cancel(&terminate_send_pingback);
-        MPI_Wait(&terminate_send_pingback, MPI_STATUS_IGNORE);
-      }
-      // Send the master either my termination id or that I am active
-      MPI_Isend(terminated ? &terminated_id : &not_completed, 1, MPI_INT, 0, MPI_TERMINATION_CONFIRM_TAG, communicator, &terminate_send_pingback);
-      // Irrespective register the reply recieve which tells the worker whether it should terminate or not
-      MPI_Irecv(&reply_from_master, 1, MPI_INT, 0, MPI_TERMINATION_CONFIRM_TAG, communicator, &termination_completed_request);
+  bool continue_protocol=true;
+  if (termination_wave_request == MPI_REQUEST_NULL) {
+    if (terminated) {
+      termination_wave_counts[0]=getTotalMessagesSent();
+      termination_wave_counts[1]=getTotalMessageCount(messages_received);
+      if (protectMPI) mpi_mutex.lock();
+      MPI_Iallreduce(termination_wave_counts, termination_wave_totals, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, termination_communicator,
+                     &termination_wave_request);
+      if (protectMPI) mpi_mutex.unlock();
     }
-    if (protectMPI) mpi_mutex.unlock();
-  }
-  if (termination_completed_request != MPI_REQUEST_NULL) {
+  } else {
     int completed;
     if (protectMPI) mpi_mutex.lock();
-    MPI_Test(&termination_completed_request, &completed, MPI_STATUS_IGNORE);
+    MPI_Test(&termination_wave_request, &completed, MPI_STATUS_IGNORE);
     if (protectMPI) mpi_mutex.unlock();
     if (completed) {
-      if (reply_from_master == 1) {
-        // All finished
-        return false;
-      } else {
-        // Not finished, need to restart
-        if (termination_pingback_request == MPI_REQUEST_NULL) {
-          // Reregister the ping-back recv if required
-          if (protectMPI) mpi_mutex.lock();
-          MPI_Irecv(NULL, 0, MPI_INT, 0, MPI_TERMINATION_TAG, communicator, &termination_pingback_request);
-          if (protectMPI) mpi_mutex.unlock();
-        }
+      bool steady_state=termination_wave_totals[0] == termination_wave_totals[1];
+      if (previous_wave_completed) {
+        continue_protocol=!(steady_state && previous_wave_totals[0] == termination_wave_totals[0] &&
+                            previous_wave_totals[1] == termination_wave_totals[1]);
       }
+      previous_wave_totals[0]=termination_wave_totals[0];
+      previous_wave_totals[1]=termination_wave_totals[1];
+      previous_wave_completed=true;
     }
   }
-  return true;
+  #if DO_METRICS
+    metrics::METRICS->timerStop("handleTerminationProtocol", timer_key);
+  #endif
+  return continue_protocol;
 }
 
 /**
-* On the master we confirm the termination codes, this is grabbing back the codes from each worker and then comparing them against the previous code
-* if they all match then the system is in a steady state & terminate. Otherwise need to restart termination. Will tell each worker whether it should
-* terminate or not depending on the values that the master receives.
+* Sums up the number of event messages sent across all lanes
 */
-bool MPI_P2P_Messaging::confirmTerminationCodes() {
-  int msg_pending, termination_command=0;
-  bool updated=false;
-  MPI_Status status;
-  if (protectMPI) mpi_mutex.lock();
-  MPI_Iprobe(MPI_ANY_SOURCE, MPI_TERMINATION_CONFIRM_TAG, communicator, &msg_pending, &status);
-  if (protectMPI) mpi_mutex.unlock();
-  while (msg_pending) {
-    updated=true;
-    if (protectMPI) mpi_mutex.lock();
-    MPI_Recv(&pingback_termination_codes[status.MPI_SOURCE], 1, MPI_INT, status.MPI_SOURCE, MPI_TERMINATION_CONFIRM_TAG, communicator, MPI_STATUS_IGNORE);
-    MPI_Iprobe(MPI_ANY_SOURCE, MPI_TERMINATION_CONFIRM_TAG, communicator, &msg_pending, &status);
-    if (protectMPI) mpi_mutex.unlock();
-  }
-  if (!checkForCodeInList(pingback_termination_codes, -2)) {
-    // All responses are in, now process
-    if (!checkForCodeInList(pingback_termination_codes, -1)) {
-      // All still termination
-      if (compareTerminationRanks()) {
-        // Terminated, all finished!
-        termination_command=1;
-      } else {
-        // Not terminated as code is different, therefore go back and re-request ping back (update termination codes too!)
-        termination_command=0;
-        mode=0;
-      }
-    } else {
-      // There is an active process
-      termination_command=0;
-      mode=0;
-    }
-    if (mode == 0) termination_codes[0]=pingback_termination_codes[0];
-    if (protectMPI) mpi_mutex.lock();
-    for (int i=1;i<total_ranks;i++) {
-      MPI_Send(&termination_command, 1, MPI_INT, i, MPI_TERMINATION_CONFIRM_TAG, communicator);
-      if (mode == 0) termination_codes[i]=pingback_termination_codes[i];
-    }
-    if (protectMPI) mpi_mutex.unlock();
+unsigned long long MPI_P2P_Messaging::getTotalMessagesSent() {
+  unsigned long long total=0;
+  for (int i=0;i<number_lanes;i++) {
+    std::lock_guard<std::mutex> out_sendReq_lock(lanes[i].outstandingSendRequests_mutex);
+    total+=getTotalMessageCount(lanes[i].messages_sent);
   }
-  return termination_command==0;
+  return total;
 }
 
 /**
-* Tracks termination codes being sent to the master from other, worker processes. It will loop through and grab all the messages it can greedily. If this has then terminated
-* it will check that all have terminated and if so will send the ping back command to all workers (to tell them to send their id or -1 if been reactivated.) We progress
-* through greedily to grab these ids (irrespective if this master process is still active) in order to avoid lots of messages backing up if workers go from active to
-* terminated continuously.
+* Sums up per peer message counts into a total
 */
-void MPI_P2P_Messaging::trackTentativeTerminationCodes() {
-  int msg_pending;
-  bool updated=false;
-  MPI_Status status;
-  if (protectMPI) mpi_mutex.lock();
-  MPI_Iprobe(MPI_ANY_SOURCE, MPI_TERMINATION_TAG, communicator, &msg_pending, &status);
-  if (protectMPI) mpi_mutex.unlock();
-  while (msg_pending) {
-    updated=true;
-    if (protectMPI) mpi_mutex.lock();
-    MPI_Recv(&termination_codes[status.MPI_SOURCE], 1, MPI_INT, status.MPI_SOURCE, MPI_TERMINATION_TAG, communicator, MPI_STATUS_IGNORE);
-    MPI_Iprobe(MPI_ANY_SOURCE, MPI_TERMINATION_TAG, communicator, &msg_pending, &status);
-    if (protectMPI) mpi_mutex.unlock();
-  }
-  if (terminated && !checkForCodeInList(termination_codes, -1)) {
-    mode=1;
-    pingback_termination_codes[0]=terminated_id;
-    for (int i=1;i<total_ranks;i++) pingback_termination_codes[i]=-2;
-    if (protectMPI) mpi_mutex.lock();
-    for (int i=1;i<total_ranks;i++) {
-      MPI_Send(NULL, 0, MPI_INT, i, MPI_TERMINATION_TAG, communicator);
-    }
-    if (protectMPI) mpi_mutex.unlock();
+unsigned long long MPI_P2P_Messaging::getTotalMessageCount(std::vector<unsigned long long> & counts) {
+  unsigned long long total=0;
+  for (unsigned long long count : counts) total+=count;
+  return total;
+}
+
+/**
+* Determines the number of bytes needed to encode a value as a variable length integer, seven bits per byte
+*/
+static int getVarintSize(unsigned int value) {
+  int size=1;
+  while (value >= 0x80) {
+    value>>=7;
+    size++;
   }
+  return size;
 }
 
 /**
-* Compares the two termination lists, the ones we get as the code runs and the other the ping-back.
+* Encodes a value as a variable length integer into the buffer, where the top bit of each byte is set if more bytes follow. Returns the number of bytes written
 */
-bool MPI_P2P_Messaging::compareTerminationRanks() {
-  for (int i=0;i<total_ranks;i++) {
-    if (termination_codes[i] != pingback_termination_codes[i]) return false;
+static int writeVarint(char * buffer, unsigned int value) {
+  int i=0;
+  while (value >= 0x80) {
+    buffer[i++]=(char) ((value & 0x7F) | 0x80);
+    value>>=7;
   }
-  return true;
+  buffer[i++]=(char) value;
+  return i;
+}
+
+/**
+* Decodes a variable length integer from the buffer, returning the number of bytes read
+*/
+static int readVarint(char * buffer, unsigned int * value) {
+  int i=0, shift=0;
+  *value=0;
+  do {
+    *value|=((unsigned int) (buffer[i] & 0x7F)) << shift;
+    shift+=7;
+  } while (buffer[i++] & 0x80 && i < MAX_VARINT_SIZE);
+  return i;
 }
 
 /**
-* Checks whether a specific code is in a list of integers or not. This is useful for checking for
-* termination sentinel or awaiting value
+* Derives the tag of a persistent channel from its event identifier, using the FNV-1a hash so that every process computes the same tag
 */
-bool MPI_P2P_Messaging::checkForCodeInList(int * codes_to_check, int failure_code) {
-  for (int i=0;i<total_ranks;i++) {
-    if (codes_to_check[i] == failure_code) return true;
+static int getChannelTag(const char * event_id) {
+  unsigned int hash=2166136261u;
+  for (const char * c=event_id;*c != '\0';c++) {
+    hash^=(unsigned char) *c;
+    hash*=16777619u;
   }
-  return false;
+  return hash % CHANNEL_TAG_RANGE;
 }
@@ -32,37 +32,217 @@
 #define SRC_MPI_P2P_MESSAGING_H_
 
 #include <map>
+#include <deque>
+#include <unordered_map>
+#include <string>
 #include <vector>
 #include <mutex>
+#include <atomic>
 #include "mpi.h"
 #include "messaging.h"
 #include "configuration.h"
+#include "shared_memory_transport.h"
 
-class MPI_P2P_Messaging : public Messaging {
-  bool protectMPI, mpiInitHere, terminated, eligable_for_termination, batchEvents, enableBridge;
-  int my_rank, total_ranks, reply_from_master, empty_itertions, max_batched_events;
-  double last_event_arrival, batch_timeout;
-  int terminated_id, mode=0;
-  int * termination_codes, *pingback_termination_codes;
-  MPI_Request termination_pingback_request=MPI_REQUEST_NULL, termination_messages, termination_completed_request=MPI_REQUEST_NULL,
-    terminate_send_req=MPI_REQUEST_NULL, terminate_send_pingback=MPI_REQUEST_NULL;
+// A large event that is being sent to a target in chunks, these are sent directly from the payload with a bounded number in flight at any one time
+// and the reference to the payload is released once all have been sent
+struct OutgoingChunkedTransfer {
+  PayloadBuffer * payload;
+  int target, size, offset, chunk_size, chunks_in_flight;
+};
+
+// A large event that is being received from a source in chunks, which are received directly into the event's destination buffer. Messages that
+// arrive from the source on the lane whilst this is in progress are deferred until it has completed, so that events are still delivered in order
+struct IncomingChunkedTransfer {
+  PayloadBuffer * destination;
+  char * data;
+  std::string event_id;
+  bool persistent, streaming, urgent, context;
+  int source, source_pid, data_type, data_count, size, chunk_size, number_chunks, chunks_posted, chunks_delivered;
+  MPI_Request * requests;
+  bool * completed;
+  std::vector<int> completedIndicies;
+  std::deque<PayloadBuffer*> deferredMessages;
+};
+
+// A send that is in progress, the packet buffer is freed and the reference to any user owned payload released once this completes. If this is the
+// send of a chunk then the chunked transfer that it belongs to is progressed instead
+struct OutstandingSend {
+  char * buffer;
+  PayloadBuffer * payload;
+  OutgoingChunkedTransfer * transfer;
+  OutstandingSend() : buffer(NULL), payload(NULL), transfer(NULL) { }
+  OutstandingSend(char * buffer, PayloadBuffer * payload) : buffer(buffer), payload(payload), transfer(NULL) { }
+  OutstandingSend(OutgoingChunkedTransfer * transfer) : buffer(NULL), payload(NULL), transfer(transfer) { }
+};
+
+// The numeric handle of an event identifier on the link to a specific target, until a packet defining the handle has been sent the string is included
+struct EventIdHandle {
+  unsigned int handle;
+  bool defined;
+};
+
+// The header of a single event packet as encoded for a specific target
+struct EventHeader {
+  int data_type, data_count, event_id_length, header_size;
+  unsigned int event_id_handle;
+  bool persistent, include_event_id, urgent, context;
+  const char * event_id;
+};
+
+// Outgoing events to a specific target that are being aggregated into a single message
+struct CoalesceBuffer {
+  char * buffer=NULL;
+  int size=0, number_events=0;
+  double first_event_time=0.0;
+};
+
+// A lane of communication, which is a communicator along with the state of sending and receiving on it. Messages are only ordered within a lane,
+// hence event identifier handles and coalescing are per lane. In MPI thread multiple mode each worker sends on its own lane (a duplicate of the EDAT
+// communicator) so that workers firing events do not contend with each other, otherwise there is a single lane on the EDAT communicator. Urgent events
+// are sent on a lane of their own, which is drained first by the progress engine
+struct MessagingLane {
+  MPI_Comm communicator;
+  std::mutex outstandingSendRequests_mutex, eventIds_mutex, coalesce_mutex;
+  // Outstanding sends are held in a slab of requests, which is passed directly to MPI_Testsome (unused slots are null requests), and the corresponding
+  // sends. Slots are indexed rather than keyed on the request, as MPI can return the same handle for different sends that complete immediately
+  MPI_Request * sendSlabRequests=NULL;
+  OutstandingSend * sendSlabEntries=NULL;
+  int * sendSlabFreeSlots=NULL, * sendSlabCompletedIndicies=NULL;
+  int send_slab_capacity=0, send_slab_count=0, send_slab_extent=0, send_slab_free_count=0;
+  // Per target counts of event messages sent, the totals across lanes are exchanged in the termination protocol
+  std::vector<unsigned long long> messages_sent;
+  // Event identifier handles per target for sending, and per source for receiving (which is only accessed whilst holding the data arrival mutex)
+  std::vector<std::unordered_map<std::string, EventIdHandle>> sentEventIds;
+  std::vector<std::vector<std::string>> receivedEventIds;
+  CoalesceBuffer * coalesceBuffers=NULL;
+  // Ring of pre-posted receives into fixed size buffers, these are processed in the order that they were posted from the head. Each slot is given
+  // a fresh buffer from the pool once its message arrives, as events point directly into the buffer that they were received into
+  int recv_ring_head=0;
+  char ** recv_ring_buffers=NULL;
+  MPI_Request * recv_ring_requests=NULL;
+  int * recv_ring_message_sizes=NULL, * recv_ring_sources=NULL, * recv_ring_indicies=NULL;
+  std::vector<MPI_Status> recv_ring_statuses;
+  bool * recv_ring_completed=NULL;
+  // Large events being sent in chunks, in the order that they were fired (accessed whilst holding the outstanding send requests mutex), and those
+  // being received in chunks keyed on their source (accessed whilst holding the data arrival mutex)
+  std::deque<OutgoingChunkedTransfer*> outgoingChunkedTransfers;
+  std::map<int, IncomingChunkedTransfer*> incomingChunkedTransfers;
+};
+
+// A persistent channel with a peer for events with a fixed identifier, type and number of elements, on a tag derived from the event identifier. Only
+// the payload is sent. Sends are copied into a buffer with a persistent send request, from a pool that grows if all are still in flight. Arrivals are
+// received into a fixed number of buffers with persistent receive requests, each of which is restarted once the event received into it has been
+// consumed, and these are processed in the order that they were started (which is the order that MPI matches them to messages)
+struct PersistentChannel {
+  int peer, tag, data_type, data_count, payload_size;
+  std::string event_id;
+  std::mutex send_mutex, receive_mutex;
+  std::vector<char*> sendBuffers;
+  std::vector<MPI_Request> sendRequests;
+  char ** receiveBuffers;
+  MPI_Request * receiveRequests;
+  std::deque<int> startedReceives;
+};
+
+// A communicator in the routing table, which is probed for event messages from processes outside of EDAT (such as the other components of a coupled
+// code) and which events can be fired on. Each rank of the communicator is translated to its rank in the EDAT communicator, or MPI_UNDEFINED if it is
+// not part of EDAT. Up to the weight of the communicator messages are received each time that it is probed, and a communicator without messages is
+// probed less often, the interval backing off up to a maximum number of polls
+struct RoutedCommunicator {
   MPI_Comm communicator;
-  std::map<MPI_Request, char*> outstandingSendRequests;
-  std::mutex outstandingSendRequests_mutex, mpi_mutex, dataArrival_mutex;
+  std::vector<int> edatRanks;
+  int weight, probe_interval, polls_until_probe;
+  // Event identifiers per source (accessed whilst holding the data arrival mutex)
+  std::map<int, std::vector<std::string>> receivedEventIds;
+};
+
+class MPI_P2P_Messaging : public Messaging {
+  bool protectMPI, mpiInitHere, terminated, eligable_for_termination, batchEvents, coalesceEvents, threadMultiple, chunkStreaming;
+  int my_rank, total_ranks, empty_itertions, max_batched_events, poll_messages_handled, eager_threshold, chunk_threshold, chunk_size, chunks_in_flight;
+  int compression_threshold, poll_message_budget, channel_depth, channel_send_buffers, max_probe_interval;
+  int coalesce_max_bytes, coalesce_max_events, recv_buffer_size, recv_ring_size, recv_copy_threshold, number_lanes, number_sending_lanes;
+  MessagingLane * lanes, * urgentLane;
+  SharedMemoryTransport * sharedMemory;
+  std::vector<char*> freeReceiveBuffers;
+  double last_event_arrival, batch_timeout, coalesce_timeout, poll_time_budget;
+  // Per source counts of event messages received, the total is exchanged in the termination protocol
+  std::vector<unsigned long long> messages_received;
+  // Termination waves are non-blocking reductions of the totals of messages sent and received, on a separate communicator. The totals of the previous
+  // completed wave are kept to compare against those of the current one
+  unsigned long long termination_wave_counts[2], termination_wave_totals[2], previous_wave_totals[2];
+  bool previous_wave_completed;
+  MPI_Request termination_wave_request=MPI_REQUEST_NULL;
+  MPI_Comm communicator, termination_communicator, channel_communicator;
+  std::mutex mpi_mutex, dataArrival_mutex, receiveBufferPool_mutex, persistentChannels_mutex, routingTable_mutex;
+  // Persistent channels indexed by their handle, this is null for channels to this process (which are fired as normal events)
+  std::vector<PersistentChannel*> persistentChannels;
+  // Registered communicators indexed by their handle
+  std::vector<RoutedCommunicator*> routingTable;
   std::vector<SpecificEvent*> eventShortTermStore;
+  std::atomic<int> coalesced_events_pending, chunked_sends_pending;
   void initMPI();
+  void initialiseLanes();
+  MessagingLane & getSendingLane();
   void checkSendRequestsForProgress();
-  void sendSingleEvent(void *, int, int, int, bool, const char *);
-  void trackTentativeTerminationCodes();
-  bool confirmTerminationCodes();
-  bool checkForCodeInList(int*, int);
-  bool compareTerminationRanks();
-  bool handleTerminationProtocolMessagesAsWorker();
+  void checkSendRequestsForProgress(MessagingLane&, std::vector<PayloadBuffer*>&);
+  int getSendProgressPeriod();
+  void trackOutstandingSend(MessagingLane&, MPI_Request, char*, PayloadBuffer*);
+  void trackOutstandingSend(MessagingLane&, MPI_Request, OutstandingSend);
+  void allocateSendSlab(MessagingLane&, int);
+  void fireEvent(void *, int, int, int, bool, const char *, bool, bool);
+  void sendSingleEvent(MessagingLane&, void *, int, int, int, bool, const char *, bool, bool);
+  bool shouldCompressEvent(EventHeader&, bool);
+  bool sendCompressedEvent(MessagingLane&, void*, int, EventHeader&);
+  void sendPacket(MessagingLane&, char*, int, int);
+  MPI_Request startSend(MessagingLane&, void*, int, MPI_Datatype, int, int);
+  void initialiseReceiveRing(MessagingLane&);
+  void postRingReceive(MessagingLane&, int);
+  int drainReceiveRing(MessagingLane&, int);
+  int receivePendingMessages();
+  void cancelReceiveRing(MessagingLane&);
+  char * getReceiveBuffer();
+  void returnReceiveBuffer(void*);
+  void processArrivedMessage(PayloadBuffer*, int, int, MessagingLane*);
+  void handleArrivedMessage(PayloadBuffer*, int, MessagingLane*);
+  void unpackMessage(PayloadBuffer*, std::vector<std::string>&);
+  void checkWireVersion(char*);
+  PersistentChannel * createPersistentChannel(int, const char *, int, int);
+  int drainPersistentChannels(int);
+  void restartChannelReceive(PersistentChannel*, int);
+  void freePersistentChannels();
+  void sendOwnedEvent(MessagingLane&, PayloadBuffer*, int, int, int, const char *);
+  void sendSharedMemoryEvent(MessagingLane&, void*, int, EventHeader&);
+  void sendChunkedEvent(MessagingLane&, PayloadBuffer*, int, EventHeader&);
+  void startChunkSends(MessagingLane&);
+  void completeChunkSend(MessagingLane&, OutgoingChunkedTransfer*, std::vector<PayloadBuffer*>&);
+  void startIncomingChunkedTransfer(PayloadBuffer*, int, MessagingLane&);
+  void postChunkReceives(MessagingLane&, IncomingChunkedTransfer*);
+  int progressIncomingChunkedTransfers(MessagingLane&);
+  void completeIncomingChunkedTransfer(MessagingLane&, IncomingChunkedTransfer*);
+  int drainSharedMemory(int);
+  char * packLargeAnnouncement(int);
+  MPI_Request startMessageSend(MessagingLane&, void*, int, MPI_Datatype, int, int, int);
+  EventHeader getEventHeader(MessagingLane&, int, int, int, bool, const char*);
+  void markEventIdDefined(MessagingLane&, int, EventHeader&);
+  int getPacketSize(EventHeader&);
+  void packEvent(char*, void*, EventHeader&);
+  int readEventHeader(char*, std::vector<std::string>&, EventHeader&, unsigned int*);
+  SpecificEvent* unpackEvent(char*, PayloadBuffer*, std::vector<std::string>&, int*);
+  void coalesceEvent(MessagingLane&, void *, int, EventHeader&);
+  void flushCoalesceBuffer(MessagingLane&, int);
+  void flushCoalescedEvents(bool);
+  void registerArrivedEvent(SpecificEvent*);
+  unsigned long long getTotalMessagesSent();
+  unsigned long long getTotalMessageCount(std::vector<unsigned long long>&);
   bool handleTerminationProtocol();
   void initialise(MPI_Comm);
-  void handleRemoteMessageArrival(MPI_Status, MPI_Comm);
+  int addRoutedCommunicator(MPI_Comm, int);
+  int probeRoutedCommunicators();
+  bool hasPendingRoutedMessages();
+  void handleRoutedMessageArrival(MPI_Status, RoutedCommunicator&);
 protected:
   bool performSinglePoll(int*);
+  void fireEventFromLayout(void *, int, int, int *, int *, int *, int, int, const char *);
 public:
   MPI_P2P_Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&);
   MPI_P2P_Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&, int);
@@ -73,6 +253,13 @@ public:
   virtual void setEligableForTermination() { eligable_for_termination=true; };
   virtual void finalise();
   virtual void fireEvent(void *, int, int, int, bool, const char *);
+  virtual void fireEventOwned(void *, int, int, int, const char *, void (*)(void*));
+  virtual void fireEventCompressed(void *, int, int, int, const char *);
+  virtual void fireEventUrgent(void *, int, int, int, const char *);
+  virtual int openChannel(int, const char *, int, int);
+  virtual void fireEventOnChannel(int, void *);
+  virtual int registerCommunicator(int, int);
+  virtual void fireEventOnCommunicator(void *, int, int, int, int, const char *);
   virtual int getRank();
   virtual int getNumRanks();
   virtual bool isFinished();
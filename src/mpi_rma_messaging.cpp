@@ -0,0 +1,491 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "mpi_rma_messaging.h"
+#include "misc.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include <string.h>
+#include <stdlib.h>
+#include <mpi.h>
+#include <mutex>
+#include <set>
+
+#ifndef DO_METRICS
+#define DO_METRICS false
+#endif
+
+#define MPI_RMA_LARGE_TAG 16388
+#define DEFAULT_MAILBOX_SLOTS 1024
+#define DEFAULT_SLOT_SIZE 1024
+#define DEFAULT_EAGER_THRESHOLD 8192
+// The mailbox control window holds the tail (the next ticket to reserve, incremented by senders) and the head (the next ticket to be read, which is
+// only written by the owner of the mailbox)
+#define CONTROL_TAIL 0
+#define CONTROL_HEAD 1
+#define MAILBOX_FLAG_LARGE 0x1
+#define PAYLOAD_ALIGNMENT 8
+#define ALIGN_TO_PAYLOAD(x) (((x) + PAYLOAD_ALIGNMENT - 1) & ~(PAYLOAD_ALIGNMENT - 1))
+
+// The header of a mailbox slot, the sequence (the ticket plus one) is put separately once the rest of the slot has been written, hence when the
+// reader sees the sequence of the ticket it is waiting for then the message is complete
+struct MailboxSlotHeader {
+  long long sequence;
+  int message_size, source, flags, padding;
+};
+
+// A message is a header of the data type, number of elements, source rank, flags and the length of the event identifier, then the identifier itself
+// followed by the payload data (padded to the payload alignment)
+#define MESSAGE_HEADER_SIZE (5 * sizeof(int))
+#define MESSAGE_FLAG_PERSISTENT 0x1
+// The payload is a context sent by value, which the target re-materialises from its own pool of contexts
+#define MESSAGE_FLAG_CONTEXT 0x2
+
+MPI_RMA_Messaging::MPI_RMA_Messaging(Scheduler & a_scheduler, ThreadPool & a_threadPool, ContextManager& a_contextManager,
+                                     Configuration & aconfig) : Messaging(a_scheduler, a_threadPool, a_contextManager, aconfig) {
+  initialise(MPI_COMM_WORLD);
+}
+
+MPI_RMA_Messaging::MPI_RMA_Messaging(Scheduler & a_scheduler, ThreadPool & a_threadPool, ContextManager& a_contextManager,
+                                     Configuration & aconfig, int mpi_communicator) : Messaging(a_scheduler, a_threadPool, a_contextManager, aconfig) {
+  initialise(MPI_Comm_f2c(mpi_communicator));
+}
+
+/**
+* Initialises the RMA transport layer with a specific communicator that all EDAT processes belong to, MPI is initialised here in serialised mode
+* if it has not been already. Each process allocates its mailbox and control windows, and these are accessed in a passive target epoch (which is
+* open for the lifetime of the messaging.) The processes synchronise once their mailboxes are initialised so that none is written to beforehand
+*/
+void MPI_RMA_Messaging::initialise(MPI_Comm comm) {
+  int is_mpi_init, provided;
+  MPI_Initialized(&is_mpi_init);
+  if (is_mpi_init) {
+    mpiInitHere = false;
+    MPI_Query_thread(&provided);
+    if (provided != MPI_THREAD_MULTIPLE && provided != MPI_THREAD_SERIALIZED) {
+      raiseError("You must initialise MPI in thread serialised or multiple, or let EDAT do this for you");
+    }
+    protectMPI = provided == MPI_THREAD_SERIALIZED;
+  } else {
+    mpiInitHere = true;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &provided);
+    protectMPI = true;
+  }
+  communicator=comm;
+  MPI_Comm_rank(communicator, &my_rank);
+  MPI_Comm_size(communicator, &total_ranks);
+  MPI_Comm_dup(communicator, &termination_communicator);
+  mailbox_slots=configuration.get("EDAT_RMA_MAILBOX_SLOTS", DEFAULT_MAILBOX_SLOTS);
+  if (mailbox_slots < 1) raiseError("The number of RMA mailbox slots must be at least one");
+  slot_size=ALIGN_TO_PAYLOAD(configuration.get("EDAT_RMA_SLOT_SIZE", DEFAULT_SLOT_SIZE));
+  if (slot_size < (int) sizeof(MailboxSlotHeader)) slot_size=sizeof(MailboxSlotHeader);
+  eager_threshold=configuration.get("EDAT_EAGER_THRESHOLD", DEFAULT_EAGER_THRESHOLD);
+  MPI_Win_allocate((MPI_Aint) mailbox_slots * slot_size, 1, MPI_INFO_NULL, communicator, &mailbox, &mailbox_window);
+  MPI_Win_allocate(2 * sizeof(long long), sizeof(long long), MPI_INFO_NULL, communicator, &mailbox_control, &control_window);
+  memset(mailbox, 0, (size_t) mailbox_slots * slot_size);
+  mailbox_control[CONTROL_TAIL]=mailbox_control[CONTROL_HEAD]=0;
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, mailbox_window);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, control_window);
+  MPI_Barrier(communicator);
+  mailbox_head=0;
+  remoteHeads=new long long[total_ranks];
+  for (int i=0;i<total_ranks;i++) remoteHeads[i]=0;
+  messages_sent=messages_received=0;
+  terminated=false;
+  eligable_for_termination=false;
+  previous_wave_completed=false;
+  if (doesProgressThreadExist()) startProgressThread();
+}
+
+/**
+* Fires an event, either remote or local event. Also handles when we are sending to all targets rather than just one specific process
+*/
+void MPI_RMA_Messaging::fireEvent(void * data, int data_count, int data_type, int target, bool persistent, const char * event_id) {
+  if (target == my_rank || target == EDAT_ALL) {
+    int data_size=getTypeSize(data_type) * data_count;
+    char * buffer_data=(char*) malloc(data_size);
+    if (contextManager.isTypeAContext(data_type)) {
+      // If its a context then pass the pointer to the context data rather than the data itself
+      memcpy(buffer_data, &data, data_size);
+    } else {
+      memcpy(buffer_data, data, data_size);
+    }
+    SpecificEvent* event=new SpecificEvent(my_rank, data_count, data_size, data_type, persistent, contextManager.isTypeAContext(data_type),
+                                           std::string(event_id), buffer_data);
+    registerLocalEvent(event);
+  }
+  if (target != my_rank) {
+    bool context=contextManager.isTypeAContext(data_type);
+    if (context) {
+      // A context is sent by value to other processes, it is packed once for all of the remote targets
+      data=packContextEvent(data_type, data, &data_count);
+      data_type=EDAT_BYTE;
+    }
+    if (target != EDAT_ALL) {
+      sendEvent(data, data_count, data_type, target, persistent, event_id, context);
+    } else {
+      for (int i=0;i<total_ranks;i++) {
+        if (i != my_rank) sendEvent(data, data_count, data_type, i, persistent, event_id, context);
+      }
+    }
+    if (context) free(data);
+  }
+  wakeProgressThread();
+}
+
+/**
+* Fires an event where the ownership of the data buffer is handed over to EDAT. A local consumer is given the buffer itself, whereas remote events
+* are copied into the target's mailbox as part of firing, hence the buffer is released straight away if there is no local consumer
+*/
+void MPI_RMA_Messaging::fireEventOwned(void * data, int data_count, int data_type, int target, const char * event_id, void (*release_fn)(void*)) {
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not transfer ownership of a context when firing an event");
+  PayloadBuffer * payload=new PayloadBuffer(data, release_fn, 1);
+  if (data == NULL || data_count == 0) {
+    fireEvent(NULL, 0, data_type, target, false, event_id);
+    payload->release();
+    return;
+  }
+  if (target != my_rank) {
+    if (target != EDAT_ALL) {
+      sendEvent(data, data_count, data_type, target, false, event_id, false);
+    } else {
+      for (int i=0;i<total_ranks;i++) {
+        if (i != my_rank) sendEvent(data, data_count, data_type, i, false, event_id, false);
+      }
+    }
+  }
+  if (target == my_rank || target == EDAT_ALL) {
+    SpecificEvent* event=new SpecificEvent(my_rank, data_count, data_count * getTypeSize(data_type), data_type, false, false,
+                                           std::string(event_id), (char*) data);
+    event->setPayload(payload);
+    registerLocalEvent(event);
+  } else {
+    payload->release();
+  }
+  wakeProgressThread();
+}
+
+/**
+* Sends an event to a remote target, this reserves the next slot in the target's mailbox and then packs the message into the slot (or if it is too
+* large then starts sending it point to point, with an announcement in the slot instead.) If the slot is still in use by an earlier message that the
+* target has not yet read, then the write is held until the target has moved on
+*/
+void MPI_RMA_Messaging::sendEvent(void * data, int data_count, int data_type, int target, bool persistent, const char * event_id, bool context) {
+  int event_id_length=strlen(event_id);
+  int data_size=getTypeSize(data_type) * data_count;
+  int data_offset=ALIGN_TO_PAYLOAD(MESSAGE_HEADER_SIZE + event_id_length);
+  int message_size=data_offset + data_size;
+  bool large=sizeof(MailboxSlotHeader) + message_size > (size_t) slot_size;
+  int slot_bytes=sizeof(MailboxSlotHeader) + (large ? 0 : message_size);
+  char * slot=(char*) malloc(slot_bytes);
+  char * message=large ? (char*) malloc(message_size) : &slot[sizeof(MailboxSlotHeader)];
+  int message_header[5]={data_type, data_count, my_rank, (persistent ? MESSAGE_FLAG_PERSISTENT : 0) | (context ? MESSAGE_FLAG_CONTEXT : 0),
+                         event_id_length};
+  memcpy(message, message_header, MESSAGE_HEADER_SIZE);
+  memcpy(&message[MESSAGE_HEADER_SIZE], event_id, event_id_length);
+  if (data_size > 0) memcpy(&message[data_offset], data, data_size);
+  MailboxSlotHeader slot_header;
+  slot_header.sequence=0;
+  slot_header.message_size=message_size;
+  slot_header.source=my_rank;
+  slot_header.flags=large ? MAILBOX_FLAG_LARGE : 0;
+  slot_header.padding=0;
+  memcpy(slot, &slot_header, sizeof(MailboxSlotHeader));
+
+  std::lock_guard<std::mutex> send_lock(send_mutex);
+  messages_sent++;
+  PendingMailboxWrite write;
+  write.target=target;
+  write.slot=slot;
+  write.slot_bytes=slot_bytes;
+  long long increment=1;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Fetch_and_op(&increment, &write.ticket, MPI_LONG_LONG, target, CONTROL_TAIL, MPI_SUM, control_window);
+  MPI_Win_flush(target, control_window);
+  if (large) {
+    // Started before the announcement is written, as the target blocks receiving the message once it reaches the announcement
+    LargeMailboxSend largeSend;
+    largeSend.buffer=message;
+    if (message_size <= eager_threshold) {
+      MPI_Isend(message, message_size, MPI_BYTE, target, MPI_RMA_LARGE_TAG, communicator, &largeSend.request);
+    } else {
+      MPI_Issend(message, message_size, MPI_BYTE, target, MPI_RMA_LARGE_TAG, communicator, &largeSend.request);
+    }
+    largeSends.push_back(largeSend);
+  }
+  bool written=writeToMailbox(write);
+  if (protectMPI) mpi_mutex.unlock();
+  if (!written) pendingWrites.push_back(write);
+}
+
+/**
+* Writes a message into its reserved slot in the target's mailbox, if the target has read the message that last used the slot. The slot is put
+* and completed before the sequence is put, so that the target never sees a partially written message. Must be called with the send mutex and
+* the MPI mutex (if protecting MPI) held, returns whether the message was written
+*/
+bool MPI_RMA_Messaging::writeToMailbox(PendingMailboxWrite & write) {
+  if (write.ticket >= remoteHeads[write.target] + mailbox_slots) {
+    MPI_Fetch_and_op(NULL, &remoteHeads[write.target], MPI_LONG_LONG, write.target, CONTROL_HEAD, MPI_NO_OP, control_window);
+    MPI_Win_flush(write.target, control_window);
+    if (write.ticket >= remoteHeads[write.target] + mailbox_slots) return false;
+  }
+  MPI_Aint displacement=(MPI_Aint) (write.ticket % mailbox_slots) * slot_size;
+  long long sequence=write.ticket + 1;
+  MPI_Put(&write.slot[sizeof(long long)], write.slot_bytes - sizeof(long long), MPI_BYTE, write.target, displacement + sizeof(long long),
+          write.slot_bytes - sizeof(long long), MPI_BYTE, mailbox_window);
+  MPI_Win_flush(write.target, mailbox_window);
+  MPI_Put(&sequence, 1, MPI_LONG_LONG, write.target, displacement, sizeof(long long), MPI_BYTE, mailbox_window);
+  MPI_Win_flush(write.target, mailbox_window);
+  free(write.slot);
+  return true;
+}
+
+/**
+* Writes the messages that are waiting for their slots to become free, once a write to a target fails then the rest to that target will too (as
+* they have later tickets) so these are skipped until the next poll
+*/
+void MPI_RMA_Messaging::writePendingMessages() {
+  std::lock_guard<std::mutex> send_lock(send_mutex);
+  if (pendingWrites.empty()) return;
+  std::set<int> blockedTargets;
+  std::deque<PendingMailboxWrite> stillPending;
+  if (protectMPI) mpi_mutex.lock();
+  for (PendingMailboxWrite & write : pendingWrites) {
+    if (blockedTargets.count(write.target) || !writeToMailbox(write)) {
+      blockedTargets.insert(write.target);
+      stillPending.push_back(write);
+    }
+  }
+  if (protectMPI) mpi_mutex.unlock();
+  pendingWrites.swap(stillPending);
+}
+
+/**
+* Tests the point to point sends of large messages for completion, freeing their buffers
+*/
+void MPI_RMA_Messaging::checkLargeSendsForProgress() {
+  std::lock_guard<std::mutex> send_lock(send_mutex);
+  if (largeSends.empty()) return;
+  if (protectMPI) mpi_mutex.lock();
+  for (size_t i=0;i<largeSends.size();) {
+    int completed;
+    MPI_Test(&largeSends[i].request, &completed, MPI_STATUS_IGNORE);
+    if (completed) {
+      free(largeSends[i].buffer);
+      largeSends[i]=largeSends.back();
+      largeSends.pop_back();
+    } else {
+      i++;
+    }
+  }
+  if (protectMPI) mpi_mutex.unlock();
+}
+
+/**
+* Determines whether the next message in the local mailbox has arrived, the window is synchronised so that puts from other processes are visible
+*/
+bool MPI_RMA_Messaging::isMailboxMessageWaiting() {
+  long long sequence;
+  if (protectMPI) mpi_mutex.lock();
+  MPI_Win_sync(mailbox_window);
+  if (protectMPI) mpi_mutex.unlock();
+  memcpy(&sequence, &mailbox[(mailbox_head % mailbox_slots) * slot_size], sizeof(long long));
+  return sequence == mailbox_head + 1;
+}
+
+/**
+* Reads the messages that have arrived in the local mailbox in ticket order, stopping at the first slot that has not yet been written (even if
+* later ones have, as messages from the same source must be processed in order.) Once messages have been read the head is published so that
+* senders waiting on these slots can write into them. Returns the number of messages processed
+*/
+int MPI_RMA_Messaging::drainMailbox() {
+  int number_processed=0;
+  while (number_processed < mailbox_slots && isMailboxMessageWaiting()) {
+    MailboxSlotHeader slot_header;
+    char * slot=&mailbox[(mailbox_head % mailbox_slots) * slot_size];
+    memcpy(&slot_header, slot, sizeof(MailboxSlotHeader));
+    char * message=(char*) malloc(slot_header.message_size);
+    if (slot_header.flags & MAILBOX_FLAG_LARGE) {
+      if (protectMPI) mpi_mutex.lock();
+      MPI_Recv(message, slot_header.message_size, MPI_BYTE, slot_header.source, MPI_RMA_LARGE_TAG, communicator, MPI_STATUS_IGNORE);
+      if (protectMPI) mpi_mutex.unlock();
+    } else {
+      memcpy(message, &slot[sizeof(MailboxSlotHeader)], slot_header.message_size);
+    }
+    mailbox_head++;
+    number_processed++;
+    messages_received++;
+    terminated=false;
+    scheduler.registerEvent(unpackEvent(message));
+    free(message);
+  }
+  if (number_processed > 0) {
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Accumulate(&mailbox_head, 1, MPI_LONG_LONG, my_rank, CONTROL_HEAD, 1, MPI_LONG_LONG, MPI_REPLACE, control_window);
+    MPI_Win_flush(my_rank, control_window);
+    if (protectMPI) mpi_mutex.unlock();
+  }
+  return number_processed;
+}
+
+/**
+* Unpacks a message into an event, the event is given its own copy of the payload data (or for a context, one re-materialised from the data)
+*/
+SpecificEvent * MPI_RMA_Messaging::unpackEvent(char * message) {
+  int message_header[5];
+  memcpy(message_header, message, MESSAGE_HEADER_SIZE);
+  int data_type=message_header[0], data_count=message_header[1], event_id_length=message_header[4];
+  int data_size=getTypeSize(data_type) * data_count;
+  char * data_buffer=NULL;
+  if (data_size > 0) {
+    data_buffer=(char*) malloc(data_size);
+    memcpy(data_buffer, &message[ALIGN_TO_PAYLOAD(MESSAGE_HEADER_SIZE + event_id_length)], data_size);
+  }
+  SpecificEvent * event=new SpecificEvent(message_header[2], data_size > 0 ? data_count : 0, data_size, data_type,
+                                          message_header[3] & MESSAGE_FLAG_PERSISTENT ? true : false, contextManager.isTypeAContext(data_type),
+                                          std::string(&message[MESSAGE_HEADER_SIZE], event_id_length), data_buffer);
+  return message_header[3] & MESSAGE_FLAG_CONTEXT ? unpackContextEvent(event) : event;
+}
+
+void MPI_RMA_Messaging::resetPolling() {
+  terminated=false;
+  eligable_for_termination=false;
+  previous_wave_completed=false;
+  Messaging::resetPolling();
+}
+
+/**
+* Locks the mutexes for testing for finalisation, this ensures whilst the finalisation test is going on there is no state change
+*/
+void MPI_RMA_Messaging::lockMutexForFinalisationTest() {
+  dataArrival_mutex.lock();
+  send_mutex.lock();
+}
+
+/**
+* Unlocks the mutexes for finalisation testing
+*/
+void MPI_RMA_Messaging::unlockMutexForFinalisationTest() {
+  dataArrival_mutex.unlock();
+  send_mutex.unlock();
+}
+
+/**
+* Determines whether the messaging is finished or not locally, which is when all messages have been written and the mailbox has been read
+*/
+bool MPI_RMA_Messaging::isFinished() {
+  return pendingWrites.empty() && largeSends.empty() && !isMailboxMessageWaiting();
+}
+
+/**
+* Finalises the messaging, closing the access epochs and freeing the windows. If MPI was initialised here then will finalise it
+*/
+void MPI_RMA_Messaging::finalise() {
+  continue_polling=false;
+  Messaging::finalise();
+  MPI_Win_unlock_all(mailbox_window);
+  MPI_Win_unlock_all(control_window);
+  MPI_Win_free(&mailbox_window);
+  MPI_Win_free(&control_window);
+  MPI_Comm_free(&termination_communicator);
+  delete[] remoteHeads;
+  if (mpiInitHere) MPI_Finalize();
+}
+
+/**
+* A single poll, which registers any buffered local events, writes any messages waiting for mailbox slots, checks large sends for completion and
+* reads the mailbox. If nothing has arrived then this checks for local termination and progresses the termination protocol
+*/
+bool MPI_RMA_Messaging::performSinglePoll(int *) {
+  #if DO_METRICS
+    unsigned long int timer_key_psp = metrics::METRICS->timerStart("performSinglePoll");
+  #endif
+  poll_messages_handled=registerBufferedLocalEvents() ? 1 : 0;
+  writePendingMessages();
+  checkLargeSendsForProgress();
+  std::unique_lock<std::mutex> dataArrivalLock(dataArrival_mutex);
+  int pending_message=drainMailbox();
+  dataArrivalLock.unlock();
+  poll_messages_handled+=pending_message;
+  if (!pending_message) terminated=checkForLocalTermination();
+  #if DO_METRICS
+    metrics::METRICS->timerStop("performSinglePoll", timer_key_psp);
+  #endif
+  return eligable_for_termination ? handleTerminationProtocol() : true;
+}
+
+/**
+* Runs the poll for events from within a progress thread, between polls the progress thread is throttled depending upon the configured progress mode
+*/
+void MPI_RMA_Messaging::runPollForEvents() {
+  int iteration_counter=0;
+  while (continue_polling) {
+    continue_polling=performSinglePoll(&iteration_counter);
+    if (continue_polling) throttleProgressThread(poll_messages_handled);
+  }
+}
+
+/**
+* Handles the termination protocol, which is the same four counter method as the point to point messaging. An idle process joins a wave of
+* non-blocking reductions of the totals of messages sent and received, and termination is determined once two consecutive waves have matching
+* totals that are unchanged between them. Returns false once termination has been determined
+*/
+bool MPI_RMA_Messaging::handleTerminationProtocol() {
+  bool continue_protocol=true;
+  if (termination_wave_request == MPI_REQUEST_NULL) {
+    if (terminated) {
+      {
+        std::lock_guard<std::mutex> send_lock(send_mutex);
+        termination_wave_counts[0]=messages_sent;
+      }
+      termination_wave_counts[1]=messages_received;
+      if (protectMPI) mpi_mutex.lock();
+      MPI_Iallreduce(termination_wave_counts, termination_wave_totals, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, termination_communicator,
+                     &termination_wave_request);
+      if (protectMPI) mpi_mutex.unlock();
+    }
+  } else {
+    int completed;
+    if (protectMPI) mpi_mutex.lock();
+    MPI_Test(&termination_wave_request, &completed, MPI_STATUS_IGNORE);
+    if (protectMPI) mpi_mutex.unlock();
+    if (completed) {
+      bool steady_state=termination_wave_totals[0] == termination_wave_totals[1];
+      if (previous_wave_completed) {
+        continue_protocol=!(steady_state && previous_wave_totals[0] == termination_wave_totals[0] &&
+                            previous_wave_totals[1] == termination_wave_totals[1]);
+      }
+      previous_wave_totals[0]=termination_wave_totals[0];
+      previous_wave_totals[1]=termination_wave_totals[1];
+      previous_wave_completed=true;
+    }
+  }
+  return continue_protocol;
+}
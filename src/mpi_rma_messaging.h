@@ -0,0 +1,105 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SRC_MPI_RMA_MESSAGING_H_
+#define SRC_MPI_RMA_MESSAGING_H_
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include "mpi.h"
+#include "messaging.h"
+#include "configuration.h"
+
+// A write into the mailbox of a target that has reserved its slot, but is waiting for the target to read the message that last used the slot
+struct PendingMailboxWrite {
+  int target, slot_bytes;
+  long long ticket;
+  char * slot;
+};
+
+// A large message that is being sent point to point, as it does not fit into a mailbox slot (which instead holds its announcement)
+struct LargeMailboxSend {
+  MPI_Request request;
+  char * buffer;
+};
+
+/**
+* Messaging over MPI one-sided communication, where each process exposes a mailbox of fixed size slots. A sender reserves the next slot of the
+* target's mailbox by atomically incrementing its tail with MPI_Fetch_and_op, and then puts the message into the slot followed by the slot's
+* sequence number. The target polls its mailbox in local memory, reading slots in sequence order, without any MPI matching. Messages that are too
+* large for a slot are sent point to point, with an announcement in the slot so that the ordering is preserved
+*/
+class MPI_RMA_Messaging : public Messaging {
+  bool protectMPI, mpiInitHere, terminated, eligable_for_termination;
+  int my_rank, total_ranks, mailbox_slots, slot_size, poll_messages_handled, eager_threshold;
+  MPI_Comm communicator, termination_communicator;
+  MPI_Win mailbox_window, control_window;
+  char * mailbox;
+  long long * mailbox_control;
+  // The ticket of the next slot to read from the local mailbox, and the most recently read heads of the mailboxes of the other processes
+  long long mailbox_head;
+  long long * remoteHeads;
+  std::deque<PendingMailboxWrite> pendingWrites;
+  std::vector<LargeMailboxSend> largeSends;
+  unsigned long long messages_sent, messages_received;
+  unsigned long long termination_wave_counts[2], termination_wave_totals[2], previous_wave_totals[2];
+  bool previous_wave_completed;
+  MPI_Request termination_wave_request=MPI_REQUEST_NULL;
+  std::mutex mpi_mutex, send_mutex, dataArrival_mutex;
+  void initialise(MPI_Comm);
+  void sendEvent(void*, int, int, int, bool, const char*, bool);
+  bool writeToMailbox(PendingMailboxWrite&);
+  void writePendingMessages();
+  void checkLargeSendsForProgress();
+  bool isMailboxMessageWaiting();
+  int drainMailbox();
+  SpecificEvent * unpackEvent(char*);
+  bool handleTerminationProtocol();
+protected:
+  bool performSinglePoll(int*);
+public:
+  MPI_RMA_Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&);
+  MPI_RMA_Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&, int);
+  virtual void lockMutexForFinalisationTest();
+  virtual void unlockMutexForFinalisationTest();
+  virtual void resetPolling();
+  virtual void runPollForEvents();
+  virtual void setEligableForTermination() { eligable_for_termination=true; };
+  virtual void finalise();
+  virtual void fireEvent(void *, int, int, int, bool, const char *);
+  virtual void fireEventOwned(void *, int, int, int, const char *, void (*)(void*));
+  virtual int getRank() { return my_rank; }
+  virtual int getNumRanks() { return total_ranks; }
+  virtual bool isFinished();
+  virtual void lockComms() { mpi_mutex.lock(); }
+  virtual void unlockComms() { mpi_mutex.unlock(); }
+};
+#endif
@@ -33,12 +33,15 @@
 #include "threadpool.h"
 #include "misc.h"
 #include "metrics.h"
+#include "compression.h"
 #include <map>
 #include <string>
 #include <mutex>
 #include <stdlib.h>
 #include <string.h>
 #include <queue>
+#include <deque>
+#include <algorithm>
 #include <utility>
 #include <set>
 
@@ -73,7 +76,7 @@ void Scheduler::registerTask(void (*task_fn)(EDAT_Event*, int), std::string task
     }
     bool continueEvtSearch=true, prev_added=false;
     while (continueEvtSearch) {
-      std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
+      std::map<DependencyKey, std::deque<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
       if (it != outstandingEvents.end() && !it->second.empty()) {
         prev_added=true;
         pendingTask->numArrivedEvents++;
@@ -85,9 +88,10 @@ void Scheduler::registerTask(void (*task_fn)(EDAT_Event*, int), std::string task
           specificEVTToAdd=it->second.front();
           // If not persistent then remove from outstanding events
           outstandingEventsToHandle--;
-          it->second.pop();
+          it->second.pop_front();
           if (it->second.empty()) outstandingEvents.erase(it);
         }
+        if (specificEVTToAdd->isUrgent()) pendingTask->urgent=true;
 
         std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator arrivedEventsIT = pendingTask->arrivedEvents.find(depKey);
         if (arrivedEventsIT == pendingTask->arrivedEvents.end()) {
@@ -120,6 +124,7 @@ void Scheduler::registerTask(void (*task_fn)(EDAT_Event*, int), std::string task
         pendingTask->outstandingDependencies.insert(std::pair<DependencyKey, int*>(dependency.first, new int(*(dependency.second))));
       }
       pendingTask->arrivedEvents.clear();
+      pendingTask->urgent=false;
       pendingTask->numArrivedEvents=0;
       registeredTasks.push_back(pendingTask);
     } else {
@@ -145,7 +150,7 @@ EDAT_Event* Scheduler::pauseTask(std::vector<std::pair<int, std::string>> depend
     DependencyKey depKey = DependencyKey(dependency.second, dependency.first);
     pausedTask->taskDependencyOrder.push_back(depKey);
 
-    std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
+    std::map<DependencyKey, std::deque<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
     if (it != outstandingEvents.end() && !it->second.empty()) {
       pausedTask->numArrivedEvents++;
       SpecificEvent * specificEVTToAdd;
@@ -156,7 +161,7 @@ EDAT_Event* Scheduler::pauseTask(std::vector<std::pair<int, std::string>> depend
         specificEVTToAdd=it->second.front();
         // If not persistent then remove from outstanding events
         outstandingEventsToHandle--;
-        it->second.pop();
+        it->second.pop_front();
         if (it->second.empty()) outstandingEvents.erase(it);
       }
 
@@ -179,14 +184,14 @@ EDAT_Event* Scheduler::pauseTask(std::vector<std::pair<int, std::string>> depend
   }
 
   if (pausedTask->outstandingDependencies.empty()) {
-    return generateEventsPayload(pausedTask, NULL);
+    return generateEventsPayload(pausedTask, NULL, NULL);
   } else {
     pausedTasks.push_back(pausedTask);
     // Now release any locks and keep track of the name of these
     std::vector<std::string> releasedLocks=concurrencyControl.releaseCurrentWorkerLocks();
     threadPool.pauseThread(pausedTask, &outstandTaskEvt_lock);
     concurrencyControl.aquireLocks(releasedLocks);  // Reacquire these locks before control goes back into user code
-    return generateEventsPayload(pausedTask, NULL);
+    return generateEventsPayload(pausedTask, NULL, NULL);
   }
 }
 
@@ -199,7 +204,7 @@ std::pair<int, EDAT_Event*> Scheduler::retrieveAnyMatchingEvents(std::vector<std
   std::unique_lock<std::mutex> outstandTaskEvt_lock(taskAndEvent_mutex);
   for (std::pair<int, std::string> dependency : dependencies) {
     DependencyKey depKey = DependencyKey(dependency.second, dependency.first);
-    std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
+    std::map<DependencyKey, std::deque<SpecificEvent*>>::iterator it=outstandingEvents.find(depKey);
     if (it != outstandingEvents.end() && !it->second.empty()) {
       if (it->second.front()->isPersistent()) {
         // If its persistent event then copy the event
@@ -208,7 +213,7 @@ std::pair<int, EDAT_Event*> Scheduler::retrieveAnyMatchingEvents(std::vector<std
         foundEvents.push(it->second.front());
         // If not persistent then remove from outstanding events
         outstandingEventsToHandle--;
-        it->second.pop();
+        it->second.pop_front();
         if (it->second.empty()) outstandingEvents.erase(it);
       }
     }
@@ -221,6 +226,7 @@ std::pair<int, EDAT_Event*> Scheduler::retrieveAnyMatchingEvents(std::vector<std
       foundEvents.pop();
       // Using a queue and iterating from the start guarantees event ordering
       generateEventPayload(specEvent, &events_payload[i]);
+      if (specEvent->getPayload() != NULL) copyOutOfPayloadBuffer(specEvent, &events_payload[i]);
       delete specEvent;
     }
     return std::pair<int, EDAT_Event*>(num_found_events, events_payload);
@@ -292,7 +298,7 @@ bool Scheduler::checkProgressPersistentTasks() {
     if (pendingTask->persistent) {
       std::vector<DependencyKey> dependenciesToRemove;
       for (std::pair<DependencyKey, int*> dependency : pendingTask->outstandingDependencies) {
-        std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator it=outstandingEvents.find(dependency.first);
+        std::map<DependencyKey, std::deque<SpecificEvent*>>::iterator it=outstandingEvents.find(dependency.first);
         if (it != outstandingEvents.end() && !it->second.empty()) {
           pendingTask->numArrivedEvents++;
           SpecificEvent * specificEVTToAdd;
@@ -303,9 +309,10 @@ bool Scheduler::checkProgressPersistentTasks() {
             specificEVTToAdd=it->second.front();
             // If not persistent then remove from outstanding events
             outstandingEventsToHandle--;
-            it->second.pop();
+            it->second.pop_front();
             if (it->second.empty()) outstandingEvents.erase(it);
           }
+          if (specificEVTToAdd->isUrgent()) pendingTask->urgent=true;
 
           std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator arrivedEventsIT = pendingTask->arrivedEvents.find(dependency.first);
           if (arrivedEventsIT == pendingTask->arrivedEvents.end()) {
@@ -330,6 +337,7 @@ bool Scheduler::checkProgressPersistentTasks() {
           pendingTask->outstandingDependencies.insert(std::pair<DependencyKey, int*>(dependency.first, new int(*(dependency.second))));
         }
         pendingTask->arrivedEvents.clear();
+        pendingTask->urgent=false;
         pendingTask->numArrivedEvents=0;
         readyToRunTask(exec_Task);
         progress=true;
@@ -360,6 +368,7 @@ void Scheduler::registerEvents(std::vector<SpecificEvent*> events) {
             events_to_remove.push_back(j);
             (*(dependency.second))--;
             pendingTask->numArrivedEvents++;
+            if (event->isUrgent()) pendingTask->urgent=true;
             std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator arrivedEventsIT = pendingTask->arrivedEvents.find(dK);
             if (arrivedEventsIT == pendingTask->arrivedEvents.end()) {
               std::queue<SpecificEvent*> eventQueue;
@@ -395,6 +404,7 @@ void Scheduler::registerEvents(std::vector<SpecificEvent*> events) {
             pendingTask->outstandingDependencies.insert(std::pair<DependencyKey, int*>(dependency.first, new int(*(dependency.second))));
           }
           pendingTask->arrivedEvents.clear();
+          pendingTask->urgent=false;
           pendingTask->numArrivedEvents=0;
         }
         tasksToRun.push_back(exec_Task);
@@ -439,6 +449,7 @@ void Scheduler::registerEvent(SpecificEvent * event) {
             pendingTask->outstandingDependencies.insert(std::pair<DependencyKey, int*>(dependency.first, new int(*(dependency.second))));
           }
           pendingTask->arrivedEvents.clear();
+          pendingTask->urgent=false;
           pendingTask->numArrivedEvents=0;
         }
         outstandTaskEvt_lock.unlock();
@@ -468,13 +479,16 @@ void Scheduler::registerEvent(SpecificEvent * event) {
   if (pendingEntry.first == NULL) {
     // Will always hit here if the event is persistent as it consumes in the above loop until there are no more pending, matching tasks
     DependencyKey dK=DependencyKey(event->getEventId(), event->getSourcePid());
-    std::map<DependencyKey, std::queue<SpecificEvent*>>::iterator it = outstandingEvents.find(dK);
+    std::map<DependencyKey, std::deque<SpecificEvent*>>::iterator it = outstandingEvents.find(dK);
     if (it == outstandingEvents.end()) {
-      std::queue<SpecificEvent*> eventQueue;
-      eventQueue.push(event);
-      outstandingEvents.insert(std::pair<DependencyKey, std::queue<SpecificEvent*>>(dK, eventQueue));
+      std::deque<SpecificEvent*> eventQueue;
+      eventQueue.push_back(event);
+      outstandingEvents.insert(std::pair<DependencyKey, std::deque<SpecificEvent*>>(dK, eventQueue));
+    } else if (event->isUrgent()) {
+      // Urgent events are stored ahead of the normal events with the same identifier (but behind earlier urgent ones) so are consumed first
+      it->second.insert(std::find_if(it->second.begin(), it->second.end(), [](SpecificEvent * e) { return !e->isUrgent(); }), event);
     } else {
-      it->second.push(event);
+      it->second.push_back(event);
     }
 
     if (!event->isPersistent()) outstandingEventsToHandle++;
@@ -519,6 +533,7 @@ std::pair<TaskDescriptor*, int> Scheduler::findTaskMatchingEventAndUpdate(Specif
 void Scheduler::updateMatchingEventInTaskDescriptor(TaskDescriptor * taskDescriptor, DependencyKey eventDep,
                                                     std::map<DependencyKey, int*>::iterator it, SpecificEvent * event) {
   taskDescriptor->numArrivedEvents++;
+  if (event->isUrgent()) taskDescriptor->urgent=true;
   (*(it->second))--;
   if (*(it->second) <= 0) {
     taskDescriptor->outstandingDependencies.erase(it);
@@ -546,10 +561,11 @@ void Scheduler::updateMatchingEventInTaskDescriptor(TaskDescriptor * taskDescrip
 * then the thread pool will queue it up for execution when a thread becomes available.
 */
 void Scheduler::readyToRunTask(PendingTaskDescriptor * taskDescriptor) {
-  threadPool.startThread(threadBootstrapperFunction, new TaskExecutionContext(taskDescriptor, &concurrencyControl));
+  threadPool.startThread(threadBootstrapperFunction, new TaskExecutionContext(taskDescriptor, &concurrencyControl), taskDescriptor->urgent);
 }
 
-EDAT_Event * Scheduler::generateEventsPayload(TaskDescriptor * taskContainer, std::set<int> * eventsThatAreContexts) {
+EDAT_Event * Scheduler::generateEventsPayload(TaskDescriptor * taskContainer, std::set<int> * eventsThatAreContexts,
+                                              std::map<int, PayloadBuffer*> * ownedPayloads) {
   EDAT_Event * events_payload = new EDAT_Event[taskContainer->numArrivedEvents];
   int i=0;
   if (taskContainer->greedyConsumerOfEvents) {
@@ -559,6 +575,13 @@ EDAT_Event * Scheduler::generateEventsPayload(TaskDescriptor * taskContainer, st
         SpecificEvent * event = events.second.front();
         events.second.pop();
         generateEventPayload(event, &events_payload[i]);
+        if (event->getPayload() != NULL) {
+          if (ownedPayloads != NULL) {
+            ownedPayloads->emplace(i, event->getPayload());
+          } else {
+            copyOutOfPayloadBuffer(event, &events_payload[i]);
+          }
+        }
         i++;
       }
     }
@@ -576,16 +599,56 @@ EDAT_Event * Scheduler::generateEventsPayload(TaskDescriptor * taskContainer, st
       arrivedEventsIT->second.pop();
       generateEventPayload(specEvent, &events_payload[i]);
       if (specEvent->isAContext() && eventsThatAreContexts != NULL) eventsThatAreContexts->emplace(i);
+      if (specEvent->getPayload() != NULL) {
+        if (ownedPayloads != NULL) {
+          ownedPayloads->emplace(i, specEvent->getPayload());
+        } else {
+          copyOutOfPayloadBuffer(specEvent, &events_payload[i]);
+        }
+      }
       i++;
     }
   }
   return events_payload;
 }
 
+/**
+* Events consumed via edatWait or edatRetrieveAny are handed to the task, which then owns the data, so where the data is held in a shared payload
+* buffer the event is given its own copy of it and the reference to the buffer released
+*/
+void Scheduler::copyOutOfPayloadBuffer(SpecificEvent * specEvent, EDAT_Event * event) {
+  if (!specEvent->isAContext() && event->data != NULL) {
+    char * data_copy=(char*) malloc(specEvent->getRawDataLength());
+    memcpy(data_copy, event->data, specEvent->getRawDataLength());
+    event->data=data_copy;
+  }
+  specEvent->getPayload()->release();
+  specEvent->setPayload(NULL);
+}
+
+/**
+* Decompresses the data of an event that arrived compressed, this is done by the worker that is about to run the task (rather than the progress
+* thread.) The event is given the decompressed data and the buffer that it was received into is released
+*/
+void Scheduler::decompressEvent(SpecificEvent * specEvent) {
+  char * data=(char*) malloc(specEvent->getRawDataLength());
+  decompressPayload(specEvent->getData(), specEvent->getCompressedLength(), specEvent->getRawDataLength() / specEvent->getMessageLength(), data,
+                    specEvent->getRawDataLength());
+  if (specEvent->getPayload() != NULL) {
+    specEvent->getPayload()->release();
+    specEvent->setPayload(NULL);
+  } else {
+    free(specEvent->getData());
+  }
+  specEvent->setData(data);
+  specEvent->setCompressedLength(0);
+}
+
 /**
 * Generates the EDAT_Event payload (that is provided to the user function) from the specific event object passed in
 */
 void Scheduler::generateEventPayload(SpecificEvent * specEvent, EDAT_Event * event) {
+  if (specEvent->isCompressed()) decompressEvent(specEvent);
   if (specEvent->isAContext()) {
     // If its a context then de-reference the pointer to point to the memory directly and don't free the pointer (as would free the context!)
     event->data=*((char**) specEvent->getData());
@@ -615,13 +678,22 @@ void Scheduler::threadBootstrapperFunction(void * pthreadRawData) {
   PendingTaskDescriptor * pendingTaskDescription=taskContext->taskDescriptor;
 
   std::set<int> eventsThatAreContexts;
+  std::map<int, PayloadBuffer*> ownedPayloads;
 
-  EDAT_Event * events_payload = generateEventsPayload(pendingTaskDescription, &eventsThatAreContexts);
+  EDAT_Event * events_payload = generateEventsPayload(pendingTaskDescription, &eventsThatAreContexts, &ownedPayloads);
   pendingTaskDescription->task_fn(events_payload, pendingTaskDescription->numArrivedEvents);
   taskContext->concurrencyControl->releaseCurrentWorkerLocks(); // Release any locks held by the task
   for (int j=0;j<pendingTaskDescription->numArrivedEvents;j++) {
     free(events_payload[j].metadata.event_id);
-    if (pendingTaskDescription->freeData && events_payload[j].data != NULL && eventsThatAreContexts.count(j) == 0) free(events_payload[j].data);
+    if (pendingTaskDescription->freeData && events_payload[j].data != NULL) {
+      std::map<int, PayloadBuffer*>::iterator ownedIt=ownedPayloads.find(j);
+      if (ownedIt != ownedPayloads.end()) {
+        // The data was handed over by the user or is held in the buffer it was received into, so release it rather than freeing it
+        ownedIt->second->release();
+      } else if (eventsThatAreContexts.count(j) == 0) {
+        free(events_payload[j].data);
+      }
+    }
   }
   delete[] events_payload;
   delete pendingTaskDescription;
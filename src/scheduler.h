@@ -39,16 +39,47 @@
 #include <string>
 #include <mutex>
 #include <queue>
+#include <deque>
 #include <utility>
 #include <set>
+#include <atomic>
+#include <functional>
 #include <stdlib.h>
 #include <string.h>
 
+/**
+* A reference counted payload buffer, this is either one whose ownership has been handed to EDAT by the user (shared between the local consumer and any
+* remote sends of the data) or a buffer that a message was received into (shared between the events unpacked from it, whose data points directly into
+* the buffer.) When the last of these has finished with it then the buffer is released via the release function (or freed if there is none.)
+*/
+class PayloadBuffer {
+  void * data;
+  std::function<void(void*)> release_fn;
+  std::atomic<int> references;
+public:
+  PayloadBuffer(void * data, std::function<void(void*)> release_fn, int references) : data(data), release_fn(release_fn), references(references) { }
+  void * getData() { return data; }
+  void retain() { references++; }
+  void release() {
+    if (--references == 0) {
+      if (release_fn) {
+        release_fn(data);
+      } else {
+        free(data);
+      }
+      delete this;
+    }
+  }
+};
+
 class SpecificEvent {
   int source_pid, message_length, raw_data_length, message_type;
   char* data;
   std::string event_id;
   bool persistent, aContext;
+  PayloadBuffer * payload=NULL;
+  int compressed_length=0;
+  bool urgent=false;
 
  public:
   SpecificEvent(int sourcePid, int message_length, int raw_data_length, int message_type, bool persistent, bool aContext, std::string event_id, char* data) {
@@ -77,10 +108,18 @@ class SpecificEvent {
       this->data = source.data;
     }
     this->persistent= source.persistent;
+    this->urgent=source.urgent;
   }
 
   char* getData() const { return data; }
   void setData(char* data) { this->data = data; }
+  PayloadBuffer * getPayload() { return payload; }
+  void setPayload(PayloadBuffer * payload) { this->payload = payload; }
+  bool isCompressed() { return compressed_length > 0; }
+  int getCompressedLength() { return compressed_length; }
+  void setCompressedLength(int compressed_length) { this->compressed_length = compressed_length; }
+  bool isUrgent() { return urgent; }
+  void setUrgent(bool urgent) { this->urgent = urgent; }
   int getSourcePid() const { return source_pid; }
   void setSourcePid(int sourcePid) { source_pid = sourcePid; }
   std::string getEventId() { return this->event_id; }
@@ -130,6 +169,8 @@ struct TaskDescriptor {
   std::vector<DependencyKey> taskDependencyOrder;
   int numArrivedEvents;
   bool greedyConsumerOfEvents=false;
+  // Set if any of the arrived events is urgent, in which case the task is run ahead of others waiting for a worker
+  bool urgent=false;
   virtual TaskDescriptorType getDescriptorType() = 0;
 };
 
@@ -158,7 +199,7 @@ class Scheduler {
     int outstandingEventsToHandle; // This tracks the non-persistent events for termination checking
     std::vector<PendingTaskDescriptor*> registeredTasks;
     std::vector<PausedTaskDescriptor*> pausedTasks;
-    std::map<DependencyKey, std::queue<SpecificEvent*>> outstandingEvents;
+    std::map<DependencyKey, std::deque<SpecificEvent*>> outstandingEvents;
     Configuration & configuration;
     ThreadPool & threadPool;
     ConcurrencyControl & concurrencyControl;
@@ -168,8 +209,10 @@ class Scheduler {
     void consumeEventsByPersistentTasks();
     bool checkProgressPersistentTasks();
     std::vector<PendingTaskDescriptor*>::iterator locatePendingTaskFromName(std::string);
-    static EDAT_Event * generateEventsPayload(TaskDescriptor*, std::set<int>*);
+    static EDAT_Event * generateEventsPayload(TaskDescriptor*, std::set<int>*, std::map<int, PayloadBuffer*>*);
+    static void copyOutOfPayloadBuffer(SpecificEvent*, EDAT_Event*);
     static void generateEventPayload(SpecificEvent*, EDAT_Event*);
+    static void decompressEvent(SpecificEvent*);
     void updateMatchingEventInTaskDescriptor(TaskDescriptor*, DependencyKey, std::map<DependencyKey, int*>::iterator, SpecificEvent*);
 public:
     Scheduler(ThreadPool & tp, Configuration & aconfig, ConcurrencyControl & cc) : threadPool(tp), configuration(aconfig),
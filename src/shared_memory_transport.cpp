@@ -0,0 +1,305 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "shared_memory_transport.h"
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+
+// Each record in a ring has a header of the total size of the record, its kind, the lane and the size of the message. A wrap record only has the
+// first two of these and marks that the rest of the ring is unused, so the next record starts at the beginning of the ring
+#define RECORD_HEADER_SIZE 16
+#define RECORD_INLINE 1
+#define RECORD_SLAB 2
+#define RECORD_WRAP 3
+#define RECORD_ALIGNMENT 8
+#define ALIGN_TO_RECORD(x) (((x) + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1))
+#define SHARED_ALIGNMENT 64
+#define ALIGN_TO_SHARED(x) (((x) + SHARED_ALIGNMENT - 1) & ~(SHARED_ALIGNMENT - 1))
+#define MIN_RING_SIZE 1024
+
+/**
+* Sets up the transport for the processes of the communicator that share a node with this one. Each process allocates its part of the shared window,
+* holding a ring and slab from every process on the node, and then locates the parts of the other processes where its outgoing rings reside. This is
+* collective over the communicator. Messages up to the maximum inline size (which is capped at a quarter of the ring) are written into the ring
+*/
+SharedMemoryTransport::SharedMemoryTransport(MPI_Comm communicator, int requested_ring_size, int requested_slab_size, int max_message_size) {
+  int my_rank, communicator_size;
+  MPI_Comm_rank(communicator, &my_rank);
+  MPI_Comm_size(communicator, &communicator_size);
+  MPI_Comm_split_type(communicator, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_communicator);
+  MPI_Comm_rank(node_communicator, &node_rank);
+  MPI_Comm_size(node_communicator, &node_size);
+
+  MPI_Group communicator_group, node_group;
+  MPI_Comm_group(communicator, &communicator_group);
+  MPI_Comm_group(node_communicator, &node_group);
+  int * peers=new int[node_size];
+  for (int i=0;i<node_size;i++) peers[i]=i;
+  communicatorRanks=new int[node_size];
+  MPI_Group_translate_ranks(node_group, node_size, peers, communicator_group, communicatorRanks);
+  delete[] peers;
+  MPI_Group_free(&communicator_group);
+  MPI_Group_free(&node_group);
+  nodeRanks=new int[communicator_size];
+  for (int i=0;i<communicator_size;i++) nodeRanks[i]=-1;
+  // Messages to this process itself never go through the transport
+  for (int i=0;i<node_size;i++) {
+    if (communicatorRanks[i] != my_rank) nodeRanks[communicatorRanks[i]]=i;
+  }
+
+  ring_size=ALIGN_TO_SHARED(std::max(requested_ring_size, MIN_RING_SIZE));
+  slab_size=ALIGN_TO_SHARED(std::max(requested_slab_size, 0));
+  max_inline_size=std::min(max_message_size, (ring_size / 4) - RECORD_HEADER_SIZE);
+  MPI_Aint ring_extent=ALIGN_TO_SHARED(sizeof(SharedRingControl)) + ring_size + slab_size;
+  char * segment;
+  MPI_Win_allocate_shared(ring_extent * node_size, 1, MPI_INFO_NULL, node_communicator, &segment, &window);
+  incomingRings=new SharedRing[node_size];
+  for (int i=0;i<node_size;i++) {
+    char * ring_base=segment + (ring_extent * i);
+    incomingRings[i].control=new (ring_base) SharedRingControl();
+    incomingRings[i].control->head.store(0);
+    incomingRings[i].control->tail.store(0);
+    incomingRings[i].control->slab_in_use.store(0);
+    incomingRings[i].data=ring_base + ALIGN_TO_SHARED(sizeof(SharedRingControl));
+    incomingRings[i].slab=incomingRings[i].data + ring_size;
+  }
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+  // All processes must have initialised their rings before any are written to
+  MPI_Barrier(node_communicator);
+  outgoingRings=new SharedRing[node_size];
+  for (int i=0;i<node_size;i++) {
+    MPI_Aint peer_segment_size;
+    int displacement_unit;
+    char * peer_segment;
+    MPI_Win_shared_query(window, i, &peer_segment_size, &displacement_unit, &peer_segment);
+    char * ring_base=peer_segment + (ring_extent * node_rank);
+    outgoingRings[i].control=(SharedRingControl*) ring_base;
+    outgoingRings[i].data=ring_base + ALIGN_TO_SHARED(sizeof(SharedRingControl));
+    outgoingRings[i].slab=outgoingRings[i].data + ring_size;
+  }
+  producer_mutexes=new std::mutex[node_size];
+  pendingTails=new unsigned long long[node_size];
+  overflowMessages=new std::deque<OverflowMessage>[node_size];
+  overflow_pending=0;
+}
+
+/**
+* Reserves space for a message to a target on the node from a specific lane, returning where the message should be written (or NULL if there is
+* no space.) Small messages are written into the ring and larger ones into the slab, if it is free. If a pointer is returned then the caller must
+* write the message and then commit it, which makes it visible to the target. Messages that overflowed the ring earlier are written first to
+* preserve the ordering, and if these do not all fit then no space is reserved
+*/
+char * SharedMemoryTransport::reserveMessage(int target, int lane, int size) {
+  int peer=nodeRanks[target];
+  producer_mutexes[peer].lock();
+  if (!overflowMessages[peer].empty() && !writeOverflowMessages(peer)) {
+    producer_mutexes[peer].unlock();
+    return NULL;
+  }
+  SharedRing & ring=outgoingRings[peer];
+  int record_header[4]={0, 0, lane, size};
+  if (size <= max_inline_size) {
+    record_header[0]=RECORD_HEADER_SIZE + ALIGN_TO_RECORD(size);
+    record_header[1]=RECORD_INLINE;
+    char * record=claimRecord(ring, record_header[0], &pendingTails[peer]);
+    if (record != NULL) {
+      memcpy(record, record_header, RECORD_HEADER_SIZE);
+      return record + RECORD_HEADER_SIZE;
+    }
+  } else if (size <= slab_size && ring.control->slab_in_use.load(std::memory_order_acquire) == 0) {
+    record_header[0]=RECORD_HEADER_SIZE;
+    record_header[1]=RECORD_SLAB;
+    char * record=claimRecord(ring, record_header[0], &pendingTails[peer]);
+    if (record != NULL) {
+      memcpy(record, record_header, RECORD_HEADER_SIZE);
+      ring.control->slab_in_use.store(1, std::memory_order_relaxed);
+      return ring.slab;
+    }
+  }
+  producer_mutexes[peer].unlock();
+  return NULL;
+}
+
+/**
+* Commits the message that has been written into the space reserved to a target, publishing it to the target
+*/
+void SharedMemoryTransport::commitMessage(int target) {
+  int peer=nodeRanks[target];
+  outgoingRings[peer].control->tail.store(pendingTails[peer], std::memory_order_release);
+  producer_mutexes[peer].unlock();
+}
+
+/**
+* Sends a small message that has already been packed to a target on the node, this takes ownership of the buffer. If the ring is full then the
+* message is held until there is space, which is written along with any later messages in order
+*/
+void SharedMemoryTransport::sendMessage(int target, int lane, char * data, int size) {
+  char * destination=reserveMessage(target, lane, size);
+  if (destination != NULL) {
+    memcpy(destination, data, size);
+    commitMessage(target);
+    free(data);
+  } else {
+    int peer=nodeRanks[target];
+    std::lock_guard<std::mutex> producer_lock(producer_mutexes[peer]);
+    OverflowMessage message;
+    message.data=data;
+    message.lane=lane;
+    message.size=size;
+    overflowMessages[peer].push_back(message);
+    overflow_pending++;
+  }
+}
+
+/**
+* Writes any messages that have overflowed the rings, as far as there is space
+*/
+void SharedMemoryTransport::flushOverflowMessages() {
+  for (int i=0;i<node_size;i++) {
+    std::lock_guard<std::mutex> producer_lock(producer_mutexes[i]);
+    if (!overflowMessages[i].empty()) writeOverflowMessages(i);
+  }
+}
+
+/**
+* Writes the messages that have overflowed the ring to a peer in order, must be called with the producer mutex of the peer held. Returns whether
+* all of these have been written
+*/
+bool SharedMemoryTransport::writeOverflowMessages(int peer) {
+  SharedRing & ring=outgoingRings[peer];
+  unsigned long long new_tail;
+  while (!overflowMessages[peer].empty()) {
+    OverflowMessage & message=overflowMessages[peer].front();
+    int record_header[4]={RECORD_HEADER_SIZE + ALIGN_TO_RECORD(message.size), RECORD_INLINE, message.lane, message.size};
+    char * record=claimRecord(ring, record_header[0], &new_tail);
+    if (record == NULL) return false;
+    memcpy(record, record_header, RECORD_HEADER_SIZE);
+    memcpy(record + RECORD_HEADER_SIZE, message.data, message.size);
+    ring.control->tail.store(new_tail, std::memory_order_release);
+    free(message.data);
+    overflowMessages[peer].pop_front();
+    overflow_pending--;
+  }
+  return true;
+}
+
+/**
+* Claims space for a record of a specific size in the ring, which must be contiguous. If the record would run past the end of the ring then the
+* remainder is marked as unused with a wrap record and the record starts at the beginning instead. Returns where to write the record and the tail
+* once it has been written (which is published to the receiver by the caller), or NULL if there is not enough free space.
+*/
+char * SharedMemoryTransport::claimRecord(SharedRing & ring, int record_size, unsigned long long * new_tail) {
+  unsigned long long tail=ring.control->tail.load(std::memory_order_relaxed);
+  unsigned long long head=ring.control->head.load(std::memory_order_acquire);
+  int offset=(int) (tail % ring_size);
+  int contiguous=ring_size - offset;
+  int required=record_size + (contiguous < record_size ? contiguous : 0);
+  if (tail + required - head > (unsigned long long) ring_size) return NULL;
+  if (contiguous < record_size) {
+    int wrap_header[2]={contiguous, RECORD_WRAP};
+    memcpy(&ring.data[offset], wrap_header, sizeof(wrap_header));
+    tail+=contiguous;
+    offset=0;
+  }
+  *new_tail=tail + record_size;
+  return &ring.data[offset];
+}
+
+/**
+* Determines whether any messages from other processes on the node are waiting in the rings to be read
+*/
+bool SharedMemoryTransport::hasPendingIncoming() {
+  for (int i=0;i<node_size;i++) {
+    if (incomingRings[i].control->head.load(std::memory_order_relaxed) != incomingRings[i].control->tail.load(std::memory_order_acquire)) return true;
+  }
+  return false;
+}
+
+/**
+* Reads the next message from a peer on the node, returning false if there is none waiting. The message remains in the ring until it is consumed
+*/
+bool SharedMemoryTransport::readMessage(int peer, SharedMessage * message) {
+  SharedRing & ring=incomingRings[peer];
+  unsigned long long head=ring.control->head.load(std::memory_order_relaxed);
+  while (head != ring.control->tail.load(std::memory_order_acquire)) {
+    int record_header[4];
+    char * record=&ring.data[head % ring_size];
+    memcpy(record_header, record, sizeof(int) * 2);
+    if (record_header[1] == RECORD_WRAP) {
+      head+=record_header[0];
+      ring.control->head.store(head, std::memory_order_release);
+      continue;
+    }
+    memcpy(record_header, record, RECORD_HEADER_SIZE);
+    message->record_size=record_header[0];
+    message->in_slab=record_header[1] == RECORD_SLAB;
+    message->lane=record_header[2];
+    message->size=record_header[3];
+    message->data=message->in_slab ? ring.slab : record + RECORD_HEADER_SIZE;
+    return true;
+  }
+  return false;
+}
+
+/**
+* Consumes a message that has been read from a peer, freeing its space in the ring. A message in the slab is still in use until the slab is released
+*/
+void SharedMemoryTransport::consumeMessage(int peer, SharedMessage * message) {
+  SharedRingControl * control=incomingRings[peer].control;
+  control->head.store(control->head.load(std::memory_order_relaxed) + message->record_size, std::memory_order_release);
+}
+
+/**
+* Releases the slab of messages from a peer, once no events point into it, so that the peer can send another large message through it
+*/
+void SharedMemoryTransport::releaseSlab(int peer) {
+  incomingRings[peer].control->slab_in_use.store(0, std::memory_order_release);
+}
+
+/**
+* Frees the shared window and the other resources of the transport, this is collective over the processes on the node
+*/
+void SharedMemoryTransport::finalise() {
+  MPI_Win_unlock_all(window);
+  MPI_Win_free(&window);
+  MPI_Comm_free(&node_communicator);
+  for (int i=0;i<node_size;i++) {
+    for (OverflowMessage & message : overflowMessages[i]) free(message.data);
+  }
+  delete[] overflowMessages;
+  delete[] pendingTails;
+  delete[] producer_mutexes;
+  delete[] incomingRings;
+  delete[] outgoingRings;
+  delete[] nodeRanks;
+  delete[] communicatorRanks;
+}
@@ -0,0 +1,102 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SRC_SHARED_MEMORY_TRANSPORT_H_
+#define SRC_SHARED_MEMORY_TRANSPORT_H_
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include "mpi.h"
+
+// The control of a ring from one process to another on the same node, this lives in the shared memory segment of the receiver. The head is only
+// advanced by the receiver and the tail by the sender, these are on separate cache lines so that the two processes do not contend
+struct SharedRingControl {
+  alignas(64) std::atomic<unsigned long long> head;
+  alignas(64) std::atomic<unsigned long long> tail;
+  // Set by the sender when it has copied a message into the slab, and cleared by the receiver once no events point into the slab
+  alignas(64) std::atomic<int> slab_in_use;
+};
+
+// A ring from one process to another along with the slab for messages too large to go through the ring
+struct SharedRing {
+  SharedRingControl * control;
+  char * data, * slab;
+};
+
+// A message that has been read from an incoming ring, either inline in the ring or in the slab
+struct SharedMessage {
+  char * data;
+  int lane, size, record_size;
+  bool in_slab;
+};
+
+// A message that could not be written into the ring as it was full, these are written in order once space is available
+struct OverflowMessage {
+  char * data;
+  int lane, size;
+};
+
+/**
+* Transport between processes on the same node through shared memory, each pair of processes has a single producer single consumer ring in an MPI-3
+* shared window. Small messages are written directly into the ring by the sender and copied out by the receiver, and larger ones are copied once into
+* a slab which the receiver delivers events from in place. Messages are only ordered with respect to others through the same ring
+*/
+class SharedMemoryTransport {
+  MPI_Comm node_communicator;
+  MPI_Win window;
+  int node_rank, node_size, ring_size, slab_size, max_inline_size;
+  // Mapping from ranks in the EDAT communicator to ranks on the node (-1 if the process is on a different node) and back again
+  int * nodeRanks, * communicatorRanks;
+  SharedRing * outgoingRings, * incomingRings;
+  std::mutex * producer_mutexes;
+  unsigned long long * pendingTails;
+  std::deque<OverflowMessage> * overflowMessages;
+  std::atomic<int> overflow_pending;
+  char * claimRecord(SharedRing&, int, unsigned long long*);
+  bool writeOverflowMessages(int);
+public:
+  SharedMemoryTransport(MPI_Comm, int, int, int);
+  bool isNodeLocal(int target) { return nodeRanks[target] >= 0; }
+  int getMaxInlineSize() { return max_inline_size; }
+  int getNumberPeers() { return node_size; }
+  int getCommunicatorRank(int peer) { return communicatorRanks[peer]; }
+  char * reserveMessage(int, int, int);
+  void commitMessage(int);
+  void sendMessage(int, int, char*, int);
+  void flushOverflowMessages();
+  bool hasPendingOutgoing() { return overflow_pending > 0; }
+  bool hasPendingIncoming();
+  bool readMessage(int, SharedMessage*);
+  void consumeMessage(int, SharedMessage*);
+  void releaseSlab(int);
+  void finalise();
+};
+#endif
@@ -33,6 +33,8 @@
 #include <mutex>
 #include "threadpackage.h"
 #include "misc.h"
+#include <limits.h>
+#include <string.h>
 
 /**
 * Attaches a thread if the core id is not -1 then map the thread to the specific core.
@@ -50,6 +52,70 @@ void ThreadPackage::attachThread(std::thread* tp, int core_id) {
   }
 }
 
+/**
+* Launches a new thread with the provided stack size (zero means the system default) and maps it to the core if the core id is not -1. This is
+* done via pthreads directly as the standard thread does not support controlling the stack size. The call blocks until the new thread has
+* published its thread id, so that it can immediately be located via doesMatch. The new thread inherits the rank context of the launching thread.
+*/
+void ThreadPackage::launchThread(std::function<void()> entryFunction, size_t stack_size, int core_id) {
+  this->entryFunction=entryFunction;
+  this->rank_context=getRankContext();
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (stack_size > 0) {
+    if (stack_size < (size_t) PTHREAD_STACK_MIN) stack_size=(size_t) PTHREAD_STACK_MIN;
+    if (pthread_attr_setstacksize(&attr, stack_size) != 0) raiseError("Error setting the stack size of a new thread");
+  }
+  pthread_attr_getstacksize(&attr, &this->stack_size);
+  if (core_id != -1) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(core_id, &cpuset);
+    if (pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset) != 0) raiseError("Error setting pthread affinity in mapping threads to cores");
+  }
+  std::unique_lock<std::mutex> lck=std::unique_lock<std::mutex>(*m);
+  int rc=pthread_create(&pthread, &attr, pthreadEntry, this);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) raiseError(("Error creating a new thread: " + std::string(strerror(rc))).c_str());
+  is_pthread=true;
+  cv->wait(lck, [this]{return (this->launched);});
+}
+
+/**
+* Entry point of threads launched via pthreads, this publishes the thread id and then calls into the provided entry function
+*/
+void * ThreadPackage::pthreadEntry(void * arg) {
+  ThreadPackage * package=(ThreadPackage*) arg;
+  {
+    std::unique_lock<std::mutex> lck=std::unique_lock<std::mutex>(*(package->m));
+    package->threadId=std::this_thread::get_id();
+    package->launched=true;
+    package->cv->notify_all();
+  }
+  setRankContext(package->rank_context);
+  package->entryFunction();
+  return NULL;
+}
+
+/**
+* Detaches the underlying thread, called by a thread that is about to exit (and delete its own package) so that the OS reclaims its resources
+*/
+void ThreadPackage::detachThread() {
+  if (thread != NULL) {
+    thread->detach();
+    delete thread;
+    thread=NULL;
+  } else if (is_pthread) {
+    pthread_detach(pthread);
+    is_pthread=false;
+  }
+}
+
+ThreadPackage::~ThreadPackage() {
+  delete m;
+  delete cv;
+}
+
 /**
 * Determines whether a specific thread ID matches the thread represented by this package or not
 */
@@ -75,6 +141,16 @@ void ThreadPackage::pause() {
   completed=false;
 }
 
+/**
+* Pauses the thread for at most the timeout, returning whether it was resumed (true) or the timeout expired first (false)
+*/
+bool ThreadPackage::pauseFor(std::chrono::duration<double> timeout) {
+  std::unique_lock<std::mutex> lck=std::unique_lock<std::mutex>(*m);
+  if (!completed && !cv->wait_for(lck, timeout, [this]{return (this->completed);})) return false;
+  completed=false;
+  return true;
+}
+
 /**
 * Resumes the thread
 */
@@ -33,24 +33,40 @@
 
 #include <thread>
 #include <condition_variable>
+#include <chrono>
 #include <mutex>
+#include <functional>
+#include <pthread.h>
 
 class ThreadPackage {
   std::thread * thread;
   std::thread::id threadId;
+  pthread_t pthread;
   std::mutex * m;
   std::condition_variable * cv;
   std::unique_lock<std::mutex> my_lock;
-  bool completed, abort_thread;
+  bool completed, abort_thread, launched, is_pthread;
+  size_t stack_size=0;
+  void * rank_context=NULL;
+  std::function<void()> entryFunction;
+  static void * pthreadEntry(void*);
 
 public:
-  ThreadPackage(std::thread * tp) : thread(tp), m(new std::mutex()), cv(new std::condition_variable()), completed(false), abort_thread(false) { }
-  ThreadPackage(std::thread::id aId) : thread(NULL), threadId(aId), m(new std::mutex()), cv(new std::condition_variable()), completed(false), abort_thread(false) { }
-  ThreadPackage() : thread(NULL), m(new std::mutex()), cv(new std::condition_variable()), completed(false), abort_thread(false) { }
+  ThreadPackage(std::thread * tp) : thread(tp), m(new std::mutex()), cv(new std::condition_variable()), completed(false), abort_thread(false),
+    launched(false), is_pthread(false) { }
+  ThreadPackage(std::thread::id aId) : thread(NULL), threadId(aId), m(new std::mutex()), cv(new std::condition_variable()), completed(false),
+    abort_thread(false), launched(false), is_pthread(false) { }
+  ThreadPackage() : thread(NULL), m(new std::mutex()), cv(new std::condition_variable()), completed(false), abort_thread(false), launched(false),
+    is_pthread(false) { }
+  ~ThreadPackage();
 
   void attachThread(std::thread*, int);
+  void launchThread(std::function<void()>, size_t, int);
+  void detachThread();
+  size_t getStackSize() { return stack_size; }
   bool doesMatch(std::thread::id);
   void pause();
+  bool pauseFor(std::chrono::duration<double>);
   void resume();
   bool shouldAbort() { return abort_thread; }
   void abort();
@@ -38,6 +38,7 @@
 #include <cstdlib>
 #include <string.h>
 #include <iostream>
+#include <new>
 #include <sched.h>
 #include <chrono>
 #include "misc.h"
@@ -50,7 +51,10 @@
 #define WORKER_MAPPING_LINEAR 1
 #define WORKER_MAPPING_LINEARFROMCORE 1
 
-#define NUMBER_POLL_THREAD_ITERATIONS_IGNORE_THREADBUSY 10
+#define BITS_PER_BITMAP_WORD 64
+
+#define DEFAULT_MAX_IDLE_THREADS_PER_WORKER 16
+#define DEFAULT_IDLE_THREAD_TIMEOUT 5.0
 
 static std::map<const char*, int> thread_mapping_lookup={{"auto", WORKER_MAPPING_AUTO},
   {"linear", WORKER_MAPPING_LINEAR}, {"linearfromcore", WORKER_MAPPING_LINEARFROMCORE}} ;
@@ -61,16 +65,23 @@ static std::map<const char*, int> thread_mapping_lookup={{"auto", WORKER_MAPPING
 ThreadPool::ThreadPool(Configuration & aconfig) : configuration(aconfig) {
   progressPollIdleThread=false;
   restartAnotherPoller=false;
-  pollingProgressThread=-1;
   number_of_workers=configuration.get("EDAT_NUM_WORKERS", std::thread::hardware_concurrency());
   main_thread_is_worker=configuration.get("EDAT_MAIN_THREAD_WORKER", false);
-
-  threadBusy = new bool[number_of_workers];
+  max_idle_threads_per_worker=configuration.get("EDAT_MAX_IDLE_THREADS_PER_WORKER", DEFAULT_MAX_IDLE_THREADS_PER_WORKER);
+  idle_thread_timeout=std::chrono::duration<double>(configuration.get("EDAT_IDLE_THREAD_TIMEOUT", DEFAULT_IDLE_THREAD_TIMEOUT));
+  int stack_size=configuration.get("EDAT_PAUSED_THREAD_STACK_SIZE", 0);
+  if (stack_size < 0) raiseError("The paused thread stack size must not be negative");
+  paused_thread_stack_size=(size_t) stack_size;
+  number_threads=0;
+  max_number_threads=0;
+  thread_stack_bytes=0;
+
+  busyWorkers.initialise(number_of_workers);
+  pollingWorkers.initialise(number_of_workers);
+  if (main_thread_is_worker) busyWorkers.set(0);
   next_suggested_idle_thread = 0;
-  int i;
-  for (i = 0; i < number_of_workers; i++) {
-    threadBusy[i] = (i==0 && main_thread_is_worker);
-  }
+  queuedThreads = 0;
+  queued_urgent_threads = 0;
 
   workers=new WorkerThread[number_of_workers];
   mapThreadsToCores(main_thread_is_worker);
@@ -79,10 +90,9 @@ ThreadPool::ThreadPool(Configuration & aconfig) : configuration(aconfig) {
     new (&workers[i]) WorkerThread();
     if (i==0 && main_thread_is_worker) {
       // If the main thread is a worker then link the active thread to this
-      workers[i].activeThread=new ThreadPackage(std::this_thread::get_id());
+      workers[i].activeThread.store(new ThreadPackage(std::this_thread::get_id()));
     } else {
-      workers[i].activeThread=new ThreadPackage();
-      workers[i].activeThread->attachThread(new std::thread(&ThreadPool::threadEntryProcedure, this, i), workers[i].core_id);
+      workers[i].activeThread.store(createWorkerThread(i, 0));
     }
   }
 
@@ -93,12 +103,7 @@ ThreadPool::ThreadPool(Configuration & aconfig) : configuration(aconfig) {
     std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
     // If we want to report the mapping of threads to cores then instruct all workers (apart from main worker if main maps to worker 0) to report this
     for (int i=0;i<number_of_workers; i++) {
-      if (!threadBusy[i]) {
-        threadBusy[i]=true;
-        workers[i].threadCommand.setCallFunction(threadReportCoreIdFunction);
-        workers[i].threadCommand.setData(new int(i));
-        workers[i].activeThread->resume();
-      }
+      if (busyWorkers.trySet(i)) activateWorker(i, threadReportCoreIdFunction, new int(i));
     }
   }
 }
@@ -140,12 +145,7 @@ int ThreadPool::getCurrentWorkerId() {
 * Retrieves the number of active workers who are currently processing
 */
 int ThreadPool::getNumberActiveWorkers() {
-  std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-  int numActive=0;
-  for (int i = 0; i < number_of_workers; i++) {
-    if (threadBusy[i]) numActive++;
-  }
-  return numActive;
+  return busyWorkers.count();
 }
 
 /**
@@ -160,26 +160,24 @@ void ThreadPool::pauseThread(PausedTaskDescriptor * pausedTaskDescriptor, std::u
     // If the thread is currently running on a worker
     std::unique_lock<std::mutex> pausedAndWaitingLock(workers[threadIndex].pausedAndWaitingMutex);
 
-    ThreadPackage * thisThread=workers[threadIndex].activeThread;
+    ThreadPackage * thisThread=workers[threadIndex].activeThread.load();
 
     workers[threadIndex].pausedThreads.insert(std::pair<PausedTaskDescriptor*, ThreadPackage*>(pausedTaskDescriptor, thisThread));
 
-    // This thread is now not active so update the status
-    threadBusy[threadIndex]=false;
-
+    // The worker stays marked as busy whilst it is handed over, the new active thread marks it idle once it finds nothing to run. Otherwise the
+    // worker could be claimed before the new active thread is installed, which would resume this (pausing) thread rather than the new one
+    ThreadPackage * newActiveThread;
+    reapIdleThreads(threadIndex);
     if (workers[threadIndex].idleThreads.empty()) {
       // If there are no idle threads then create a new one to be the new active thread
-      workers[threadIndex].activeThread=new ThreadPackage();
-      workers[threadIndex].activeThread->attachThread(new std::thread(&ThreadPool::threadEntryProcedure, this, threadIndex), workers[threadIndex].core_id);
-
-      workers[threadIndex].activeThread->resume();
+      newActiveThread=createWorkerThread(threadIndex, paused_thread_stack_size);
     } else {
-      // If there is an idle thread then we are going to reactivate it
-      ThreadPackage * reactivated=workers[threadIndex].idleThreads.front();
-      workers[threadIndex].idleThreads.pop();
-      workers[threadIndex].activeThread=reactivated;
-      reactivated->resume();
+      // If there is an idle thread then we are going to reactivate it, the most recently parked is taken as this is the most likely to be warm
+      newActiveThread=workers[threadIndex].idleThreads.back().thread;
+      workers[threadIndex].idleThreads.pop_back();
     }
+    workers[threadIndex].activeThread.store(newActiveThread);
+    newActiveThread->resume();
 
     std::unique_lock<std::mutex> pausedTasksLock(pausedTasksToWorkersMutex);
     // Now pops in the mapping from the descriptor to the specific worker that has paused that task (for resumption later on)
@@ -223,20 +221,16 @@ void ThreadPool::markThreadResume(PausedTaskDescriptor * pausedTaskDescriptor) {
       workers[threadIndex].pausedThreads.erase(it); // Remove this mapping
       workers[threadIndex].waitingThreads.push(it->second); // Place the paused thread package on the waiting (ready to run) queue
 
-      {
-        std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-        if (!threadBusy[threadIndex]) {
-          // If the worker is not busy then reactivate it here, this will effectively find the thread placed on the wait queue, pause the worker and resume to the other thread
-          threadBusy[threadIndex] = true;
-          workers[threadIndex].threadCommand.setCallFunction(NULL);
-          workers[threadIndex].activeThread->resume();
-        }
+      if (busyWorkers.trySet(threadIndex)) {
+        // If the worker is not busy then reactivate it here, this will effectively find the thread placed on the wait queue, pause the worker and resume to the other thread.
+        // Claiming the worker is safe without the thread start mutex as the worker only marks itself idle whilst holding the paused and waiting mutex
+        activateWorker(threadIndex, NULL, NULL);
       }
 
       if (progressPollIdleThread) {
         // If we reactivate the polling thread then can starve it. Hence if this is the case inform that thread it should attempt to reactivate another thread to poll
         std::unique_lock<std::mutex> pollingProgressLock(pollingProgressThreadMutex);
-        if (pollingProgressThread==threadIndex) restartAnotherPoller=true;
+        if (pollingWorkers.test(threadIndex)) restartAnotherPoller=true;
       }
 
     } else {
@@ -258,7 +252,7 @@ void ThreadPool::markThreadResume(PausedTaskDescriptor * pausedTaskDescriptor) {
 */
 int ThreadPool::findIndexFromThreadId(std::thread::id threadIDToFind) {
   for (int i = 0; i < number_of_workers; i++) {
-    if (workers[i].activeThread->doesMatch(threadIDToFind)) return i;
+    if (workers[i].activeThread.load()->doesMatch(threadIDToFind)) return i;
   }
   return -1;
 }
@@ -281,9 +275,8 @@ void ThreadPool::unlockMutexForFinalisationTest() {
 * Determines whether the thread pool is finished (idle) or not
 */
 bool ThreadPool::isThreadPoolFinished() {
-  int i;
-  for (i = 0; i < number_of_workers; i++) {
-    if (threadBusy[i]) return false;
+  if (!busyWorkers.none()) return false;
+  for (int i = 0; i < number_of_workers; i++) {
     std::unique_lock<std::mutex> pausedLock(workers[i].pausedAndWaitingMutex);
     if (!workers[i].pausedThreads.empty() || !workers[i].waitingThreads.empty()) return false;
   }
@@ -311,10 +304,9 @@ void ThreadPool::setMessaging(Messaging * messaging) {
 void ThreadPool::notifyMainThreadIsSleeping() {
   if (main_thread_is_worker) {
     std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-    threadBusy[0] = false;
-    // Creates a new active thread so that we can now use the worker to run tasks
-    workers[0].activeThread=new ThreadPackage();
-    workers[0].activeThread->attachThread(new std::thread(&ThreadPool::threadEntryProcedure, this, 0), workers[0].core_id);
+    // Creates a new active thread so that we can now use the worker to run tasks, this must be installed before the worker is marked idle
+    workers[0].activeThread.store(createWorkerThread(0, 0));
+    busyWorkers.clear(0);
   }
   if (number_of_workers == 1 && progressPollIdleThread) launchThreadToPollForProgressIfPossible();
 }
@@ -326,9 +318,9 @@ void ThreadPool::notifyMainThreadIsSleeping() {
 void ThreadPool::resetPolling() {
   if (main_thread_is_worker) {
     std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-    workers[0].activeThread->abort();
-    workers[0].activeThread=new ThreadPackage(std::this_thread::get_id());
-    threadBusy[0] = true;
+    busyWorkers.set(0);
+    workers[0].activeThread.load()->abort();
+    workers[0].activeThread.store(new ThreadPackage(std::this_thread::get_id()));
   }
   if (progressPollIdleThread) {
     launchThreadToPollForProgressIfPossible();
@@ -337,75 +329,82 @@ void ThreadPool::resetPolling() {
 
 /**
 * Launches a thread to poll for progress, this is ideally called when the code starts up but if there is not a free thread
-* (i.e. one worker only and the master is going to be repurposed as a worker) then is called when the main thread goes idle.
+* (i.e. one worker only and the master is going to be repurposed as a worker) then is called when the main thread goes idle. As with starting
+* a thread, the worker is claimed without the thread start mutex as its active thread can not be replaced once it has been claimed.
 */
 void ThreadPool::launchThreadToPollForProgressIfPossible() {
-  std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-  int idleThreadId = get_index_of_idle_thread();
+  int idleThreadId = claim_idle_thread();
   if (idleThreadId != -1) {
     // Do this to ensure that have waited until there is no thread polling for progress currently (hence be a bit careful where this is called from)
     progressMutex.lock();
     progressMutex.unlock();
-    threadBusy[idleThreadId] = true;
-    thread_start_lock.unlock();
-    workers[idleThreadId].threadCommand.setCallFunction(NULL);
-    workers[idleThreadId].activeThread->resume();
+    activateWorker(idleThreadId, NULL, NULL);
   }
 }
 
 /**
 * Will attemp to start a thread by mapping the calling function and arguments to a free thread. If this is not possible (they are all busy) then it will
-* queue up the thread and arguments to then be executed by the next available thread when it becomes idle.
+* queue up the thread and arguments to then be executed by the next available thread when it becomes idle. In the common case, where nothing is queued
+* and there is an idle worker, this claims the worker without taking any locks. Otherwise the thread is queued and, as a worker might have gone idle
+* between the claim and the queueing, we then try to claim an idle worker again to run the head of the queue. Urgent threads are queued behind
+* any other urgent ones but ahead of the rest, so they are picked up by the next worker to become available. Claiming a worker without the lock is
+* safe as a worker is only marked idle once its active thread has been installed, and that thread is only replaced whilst the worker is busy.
 */
-void ThreadPool::startThread(void (*callFunction)(void *), void *args) {
+void ThreadPool::startThread(void (*callFunction)(void *), void *args, bool urgent) {
+  if (queuedThreads.load(std::memory_order_acquire) == 0) {
+    int idleThreadId = claim_idle_thread();
+    if (idleThreadId != -1) {
+      activateWorker(idleThreadId, callFunction, args);
+      return;
+    }
+  }
   std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
-  int idleThreadId = threadQueue.empty() ? get_index_of_idle_thread() : -2; // Only do look up if the queue is empty (i.e. we care if there is a free thread)
-  if (threadQueue.empty() && idleThreadId != -1) {
-    threadBusy[idleThreadId] = true;
-    thread_start_lock.unlock();
-    workers[idleThreadId].threadCommand.setCallFunction(callFunction);
-    workers[idleThreadId].threadCommand.setData(args);
-    workers[idleThreadId].activeThread->resume();
+  PendingThreadContainer tc;
+  tc.callFunction=callFunction;
+  tc.args=args;
+  if (urgent) {
+    threadQueue.insert(threadQueue.begin() + queued_urgent_threads, tc);
+    queued_urgent_threads++;
   } else {
-    PendingThreadContainer tc;
-    tc.callFunction=callFunction;
-    tc.args=args;
-    threadQueue.push(tc);
+    threadQueue.push_back(tc);
+  }
+  queuedThreads++;
+  // Workers only mark themselves idle whilst holding the thread start mutex and having found the queue empty, so if one is idle now it will not pick this up
+  int idleThreadId = claim_idle_thread();
+  if (idleThreadId != -1) {
+    PendingThreadContainer pc=threadQueue.front();
+    threadQueue.pop_front();
+    if (queued_urgent_threads > 0) queued_urgent_threads--;
+    queuedThreads--;
+    thread_start_lock.unlock();
+    activateWorker(idleThreadId, pc.callFunction, pc.args);
   }
 }
 
 /**
-* Returns the index of the next idle thread, going in a roundrobin fashion starting from the previous thread that was
-* allocated. It returns -1 if there is no idle thread available. Note that if we are polling for progress without a helper thread
-* then effectively that is a free thread doing the polling, for optimisation that thread is the last one to be chosen in this case
-* as this avoids swapping in and out the progress polling so it is only used if all others are busy.
+* Activates a worker (that has already been claimed in the busy bitmap) to run the provided function and arguments, NULL as the function
+* means that the worker will just check for queued threads and paused threads that are ready to resume
 */
-int ThreadPool::get_index_of_idle_thread() {
-  int progressThread;
-  bool pendingProgressThread=false;
-  if (progressPollIdleThread) {
-    std::lock_guard<std::mutex> guard(pollingProgressThreadMutex);
-    progressThread=pollingProgressThread;
-  }
-  for (int i = next_suggested_idle_thread; i < number_of_workers; i++) {
-    if (!threadBusy[i]) {
-      if (progressPollIdleThread && progressThread==i) {
-        // This seems a bit strange but we do it this way to initially ignore the thread that is polling for updates and only use it if no others are free
-        pendingProgressThread=true;
-      } else {
-        next_suggested_idle_thread = i + 1;
-        if (next_suggested_idle_thread >= number_of_workers) next_suggested_idle_thread = 0;
-        return i;
-      }
-    }
-  }
-  if (pendingProgressThread) {
-    next_suggested_idle_thread = progressThread + 1;
-    if (next_suggested_idle_thread >= number_of_workers) next_suggested_idle_thread = 0;
-    return progressThread;
+void ThreadPool::activateWorker(int workerId, void (*callFunction)(void *), void *args) {
+  workers[workerId].threadCommand.setCallFunction(callFunction);
+  workers[workerId].threadCommand.setData(args);
+  workers[workerId].activeThread.load()->resume();
+}
+
+/**
+* Claims the next idle thread, going in a roundrobin fashion starting from the previous thread that was allocated and marks it as busy. It returns
+* -1 if there is no idle thread available. Note that if we are polling for progress without a helper thread then effectively that is a free thread
+* doing the polling, for optimisation that thread is the last one to be chosen in this case as this avoids swapping in and out the progress polling
+* so it is only used if all others are busy.
+*/
+int ThreadPool::claim_idle_thread() {
+  int start=next_suggested_idle_thread.load(std::memory_order_relaxed);
+  int claimed=busyWorkers.claimClearBit(start, progressPollIdleThread ? &pollingWorkers : NULL, false);
+  if (claimed == -1 && progressPollIdleThread) claimed=busyWorkers.claimClearBit(start, &pollingWorkers, true);
+  if (claimed != -1) {
+    next_suggested_idle_thread.store(claimed + 1 >= number_of_workers ? 0 : claimed + 1, std::memory_order_relaxed);
   }
-  next_suggested_idle_thread = 0;
-  return -1;
+  return claimed;
 }
 
 /**
@@ -425,21 +424,19 @@ void ThreadPool::threadReportCoreIdFunction(void * pthreadRawData) {
 * run then if we have no progress thread this will poll for progress (as it is now an idle thread) if there are no other threads doing
 * the polling. It might be interupted from this polling at any point, which is fine.
 */
-void ThreadPool::threadEntryProcedure(int myThreadId) {
+void ThreadPool::threadEntryProcedure(int myThreadId, ThreadPackage * myThreadPackage) {
   bool should_report_mapping=configuration.get("EDAT_REPORT_WORKER_MAPPING", false);
   #if DO_METRICS
     std::chrono::steady_clock::time_point thread_activated;
   #endif
 
-  ThreadPackage * myThreadPackage=workers[myThreadId].activeThread;
-
   while (1) {
     myThreadPackage->pause();
     #if DO_METRICS
       thread_activated = std::chrono::steady_clock::now();
     #endif
     if (myThreadPackage->shouldAbort()) {
-      delete myThreadPackage;
+      retireThread(myThreadPackage);
       return;
     }
 
@@ -457,7 +454,9 @@ void ThreadPool::threadEntryProcedure(int myThreadId) {
       std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex);
       if (!threadQueue.empty()) {
         PendingThreadContainer pc=threadQueue.front();
-        threadQueue.pop();
+        threadQueue.pop_front();
+        if (queued_urgent_threads > 0) queued_urgent_threads--;
+        queuedThreads--;
         thread_start_lock.unlock();
         #if DO_METRICS
           unsigned long int timer_key = metrics::METRICS->timerStart("Task");
@@ -474,17 +473,33 @@ void ThreadPool::threadEntryProcedure(int myThreadId) {
           ThreadPackage * reactivateThread=workers[myThreadId].waitingThreads.front();
           workers[myThreadId].waitingThreads.pop();
 
-          workers[myThreadId].idleThreads.push(myThreadPackage); // Add me as an idle thread that can be reused in future
+          reapIdleThreads(myThreadId);
+          // Add me as an idle thread that can be reused in future, unless the pool is full in which case this thread exits
+          bool retire=(int) workers[myThreadId].idleThreads.size() >= max_idle_threads_per_worker;
+          if (!retire) workers[myThreadId].idleThreads.push_back(IdleThread(myThreadPackage, std::chrono::steady_clock::now()));
+          #if DO_METRICS
+            metrics::METRICS->recordValue("Idle threads", workers[myThreadId].idleThreads.size());
+          #endif
 
-          workers[myThreadId].activeThread=reactivateThread;  // The active thread is now the reactivated one
+          workers[myThreadId].activeThread.store(reactivateThread);  // The active thread is now the reactivated one
           pausedAndWaitingLock.unlock();
           thread_start_lock.unlock();
-          workers[myThreadId].activeThread->resume(); // Resume the reactivated thread
-          myThreadPackage->pause();  // Pause myself (worker given over to the reactivated thread)
+          reactivateThread->resume(); // Resume the reactivated thread
+          if (retire) {
+            retireThread(myThreadPackage);
+            return;
+          }
+          // Pause myself (worker given over to the reactivated thread), retiring if idle for longer than the timeout
+          if (!myThreadPackage->pauseFor(idle_thread_timeout) && retireTimedOutIdleThread(myThreadId, myThreadPackage)) return;
+          if (myThreadPackage->shouldAbort()) {
+            // Reaped whilst idle
+            retireThread(myThreadPackage);
+            return;
+          }
         } else {
           pollQueue=false;
           // Return this thread back to the pool, do this in here to avoid a queued entry falling between cracks
-          threadBusy[myThreadId] = false;
+          busyWorkers.clear(myThreadId);
         }
       }
     }
@@ -494,37 +509,18 @@ void ThreadPool::threadEntryProcedure(int myThreadId) {
 
     if (progressPollIdleThread && messaging != NULL) {
       if (progressMutex.try_lock()) {
-        {
-          std::lock_guard<std::mutex> guard(pollingProgressThreadMutex);
-          pollingProgressThread=myThreadId;
-        }
-        int non_lock_iterations=0;
+        pollingWorkers.set(myThreadId);
         bool continue_poll=true;
         bool firstIt=true; // Always do a poll on the first iteration
         while (firstIt || continue_poll) {
           continue_poll=messaging->pollForEvents();
-          if (continue_poll) {
-            // Try to lock the thread_start_mutex and check the thread busy status for this thread. If this is not possible then allow a number of polling
-            // iterations to proceed without the lock, but there is a maximum number as you don't want to starve a task waiting for the thread!
-            std::unique_lock<std::mutex> thread_start_lock(thread_start_mutex, std::defer_lock);
-            bool isLocked=thread_start_lock.try_lock();
-            if (!isLocked) {
-              non_lock_iterations++;
-              if (non_lock_iterations > NUMBER_POLL_THREAD_ITERATIONS_IGNORE_THREADBUSY) {
-                thread_start_lock.lock();
-                isLocked=true;
-              }
-            }
-            if (isLocked) {
-              continue_poll=!threadBusy[myThreadId];
-              non_lock_iterations=0;
-            }
-          }
+          // Keep polling until this worker has been claimed to run something else
+          if (continue_poll) continue_poll=!busyWorkers.test(myThreadId);
           firstIt=false;
         }
         {
           std::lock_guard<std::mutex> guard(pollingProgressThreadMutex);
-          pollingProgressThread=-1;
+          pollingWorkers.clear(myThreadId);
           restartPoll=restartAnotherPoller;
           if (restartAnotherPoller) restartAnotherPoller=false;
         }
@@ -534,3 +530,188 @@ void ThreadPool::threadEntryProcedure(int myThreadId) {
     }
   }
 }
+
+/**
+* Creates a new thread for the specific worker with the provided stack size (zero is the system default). This thread starts off paused
+* and is then resumed to run on that worker
+*/
+ThreadPackage * ThreadPool::createWorkerThread(int workerId, size_t stack_size) {
+  ThreadPackage * package=new ThreadPackage();
+  package->launchThread(std::bind(&ThreadPool::threadEntryProcedure, this, workerId, package), stack_size, workers[workerId].core_id);
+  int current_threads=++number_threads;
+  thread_stack_bytes+=package->getStackSize();
+  int previous_max=max_number_threads.load();
+  while (current_threads > previous_max && !max_number_threads.compare_exchange_weak(previous_max, current_threads));
+  #if DO_METRICS
+    metrics::METRICS->recordValue("Threads", current_threads);
+    metrics::METRICS->recordValue("Thread stack bytes", thread_stack_bytes.load());
+  #endif
+  return package;
+}
+
+/**
+* Reaps the idle threads of a worker which have been idle for longer than the timeout, these are the oldest and hence at the front. Must be
+* called with the paused and waiting mutex of the worker held. Reaped threads are aborted which wakes them up so that they exit
+*/
+void ThreadPool::reapIdleThreads(int workerId) {
+  std::chrono::steady_clock::time_point now=std::chrono::steady_clock::now();
+  while (!workers[workerId].idleThreads.empty() &&
+          (now - workers[workerId].idleThreads.front().idleSince > idle_thread_timeout ||
+          (int) workers[workerId].idleThreads.size() > max_idle_threads_per_worker)) {
+    ThreadPackage * reaped=workers[workerId].idleThreads.front().thread;
+    workers[workerId].idleThreads.pop_front();
+    reaped->abort();
+  }
+}
+
+/**
+* Called by an idle thread whose timeout expired whilst it was paused, this removes it from the worker's idle threads and retires it. If the thread
+* is no longer idle then it has just been claimed for reuse or reaped, so instead this waits for the resume that follows and returns false
+*/
+bool ThreadPool::retireTimedOutIdleThread(int workerId, ThreadPackage * package) {
+  std::unique_lock<std::mutex> pausedAndWaitingLock(workers[workerId].pausedAndWaitingMutex);
+  for (std::deque<IdleThread>::iterator it=workers[workerId].idleThreads.begin();it != workers[workerId].idleThreads.end();++it) {
+    if (it->thread == package) {
+      workers[workerId].idleThreads.erase(it);
+      pausedAndWaitingLock.unlock();
+      retireThread(package);
+      return true;
+    }
+  }
+  pausedAndWaitingLock.unlock();
+  package->pause();
+  return false;
+}
+
+/**
+* Called by a thread that is about to exit, this detaches the thread so that the OS reclaims its resources and deletes the thread package
+*/
+void ThreadPool::retireThread(ThreadPackage * package) {
+  package->detachThread();
+  thread_stack_bytes-=package->getStackSize();
+  delete package;
+  number_threads--;
+}
+
+/**
+* Returns the number of threads (active, paused and idle) currently held by the pool
+*/
+int ThreadPool::getNumberThreads() {
+  return number_threads.load();
+}
+
+/**
+* Returns the maximum number of threads that have been held by the pool at any one time
+*/
+int ThreadPool::getMaxNumberThreads() {
+  return max_number_threads.load();
+}
+
+/**
+* Initialises the bitmap to hold the provided number of bits, all of which are initially clear. The words are allocated aligned to the
+* cache line size
+*/
+void WorkerBitmap::initialise(int number_bits) {
+  this->number_bits=number_bits;
+  number_words=(number_bits + BITS_PER_BITMAP_WORD - 1) / BITS_PER_BITMAP_WORD;
+  if (number_words == 0) number_words=1;
+  void * memory;
+  if (posix_memalign(&memory, alignof(WorkerBitmapWord), sizeof(WorkerBitmapWord) * number_words) != 0) {
+    raiseError("Unable to allocate memory for the worker bitmap");
+  }
+  words=(WorkerBitmapWord*) memory;
+  for (int i=0;i<number_words;i++) new (&words[i].bits) std::atomic<unsigned long long>(0);
+}
+
+/**
+* Returns the mask of bits in a word that correspond to actual members of the set (the last word might only be partially used)
+*/
+unsigned long long WorkerBitmap::getValidMask(int word) {
+  int bits_in_word=number_bits - (word * BITS_PER_BITMAP_WORD);
+  if (bits_in_word >= BITS_PER_BITMAP_WORD) return ~0ULL;
+  if (bits_in_word <= 0) return 0ULL;
+  return (1ULL << bits_in_word) - 1;
+}
+
+/**
+* Tests whether a specific bit is set
+*/
+bool WorkerBitmap::test(int bit) {
+  return (words[bit / BITS_PER_BITMAP_WORD].bits.load(std::memory_order_acquire) & (1ULL << (bit % BITS_PER_BITMAP_WORD))) != 0;
+}
+
+/**
+* Sets a specific bit
+*/
+void WorkerBitmap::set(int bit) {
+  words[bit / BITS_PER_BITMAP_WORD].bits.fetch_or(1ULL << (bit % BITS_PER_BITMAP_WORD), std::memory_order_acq_rel);
+}
+
+/**
+* Clears a specific bit
+*/
+void WorkerBitmap::clear(int bit) {
+  words[bit / BITS_PER_BITMAP_WORD].bits.fetch_and(~(1ULL << (bit % BITS_PER_BITMAP_WORD)), std::memory_order_acq_rel);
+}
+
+/**
+* Sets a specific bit if it is currently clear, returning true if this call set it and false if it was already set
+*/
+bool WorkerBitmap::trySet(int bit) {
+  unsigned long long mask=1ULL << (bit % BITS_PER_BITMAP_WORD);
+  return (words[bit / BITS_PER_BITMAP_WORD].bits.fetch_or(mask, std::memory_order_acq_rel) & mask) == 0;
+}
+
+/**
+* Finds a clear bit, searching round robin from the starting bit, and claims it by setting it with compare and swap. If an exclusion bitmap
+* is provided then only bits which are set (if inExclusion is true) or clear (if inExclusion is false) in that bitmap are candidates. Returns
+* the index of the claimed bit or -1 if there were no candidates.
+*/
+int WorkerBitmap::claimClearBit(int start_bit, WorkerBitmap * exclusion, bool inExclusion) {
+  if (start_bit >= number_bits || start_bit < 0) start_bit=0;
+  int start_word=start_bit / BITS_PER_BITMAP_WORD;
+  for (int i=0;i<=number_words;i++) {
+    int word=(start_word + i) % number_words;
+    unsigned long long search_mask=getValidMask(word);
+    if (i == 0) {
+      // On the first word only consider bits from the start bit onwards, the bits before are considered once we have wrapped round
+      search_mask&=~0ULL << (start_bit % BITS_PER_BITMAP_WORD);
+    } else if (i == number_words) {
+      search_mask&=~(~0ULL << (start_bit % BITS_PER_BITMAP_WORD));
+    }
+    unsigned long long current=words[word].bits.load(std::memory_order_acquire);
+    while (true) {
+      unsigned long long candidates=~current & search_mask;
+      if (exclusion != NULL) {
+        unsigned long long excluded=exclusion->words[word].bits.load(std::memory_order_acquire);
+        candidates&=inExclusion ? excluded : ~excluded;
+      }
+      if (candidates == 0) break;
+      int bit=__builtin_ctzll(candidates);
+      if (words[word].bits.compare_exchange_weak(current, current | (1ULL << bit), std::memory_order_acq_rel, std::memory_order_acquire)) {
+        return (word * BITS_PER_BITMAP_WORD) + bit;
+      }
+      // If the compare and swap failed then current has been updated with the latest value so try again with this
+    }
+  }
+  return -1;
+}
+
+/**
+* Determines whether no bits are set
+*/
+bool WorkerBitmap::none() {
+  for (int i=0;i<number_words;i++) {
+    if (words[i].bits.load(std::memory_order_acquire) != 0) return false;
+  }
+  return true;
+}
+
+/**
+* Returns the number of bits that are set
+*/
+int WorkerBitmap::count() {
+  int total=0;
+  for (int i=0;i<number_words;i++) total+=__builtin_popcountll(words[i].bits.load(std::memory_order_acquire));
+  return total;
+}
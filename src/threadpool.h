@@ -35,6 +35,10 @@
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <deque>
+#include <chrono>
+#include <atomic>
+#include <map>
 #include "configuration.h"
 #include "threadpackage.h"
 
@@ -61,10 +65,44 @@ struct PendingThreadContainer {
   void *args;
 };
 
+// Each word of the bitmap sits on its own cache line to avoid false sharing between workers updating their status
+struct alignas(64) WorkerBitmapWord {
+  std::atomic<unsigned long long> bits;
+};
+
+/**
+* A set of workers tracked as atomic bitmaps, a set bit represents a member of the set. Bits can be claimed (set if clear) by compare and
+* swap which means that workers can be allocated without requiring a mutex.
+*/
+class WorkerBitmap {
+  WorkerBitmapWord * words;
+  int number_words, number_bits;
+  unsigned long long getValidMask(int);
+public:
+  WorkerBitmap() : words(NULL), number_words(0), number_bits(0) { }
+  void initialise(int);
+  bool test(int);
+  void set(int);
+  void clear(int);
+  bool trySet(int);
+  int claimClearBit(int, WorkerBitmap*, bool);
+  bool none();
+  int count();
+};
+
+// A thread that has been parked for reuse by the worker, along with the time at which it went idle
+struct IdleThread {
+  ThreadPackage * thread;
+  std::chrono::steady_clock::time_point idleSince;
+  IdleThread(ThreadPackage * thread, std::chrono::steady_clock::time_point idleSince) : thread(thread), idleSince(idleSince) { }
+};
+
 struct WorkerThread {
-  ThreadPackage * activeThread;
+  // Only replaced whilst the worker is marked busy, but read by any thread looking up which worker it is running on
+  std::atomic<ThreadPackage*> activeThread;
   std::map<PausedTaskDescriptor*, ThreadPackage*> pausedThreads;
-  std::queue<ThreadPackage*> waitingThreads, idleThreads;
+  std::queue<ThreadPackage*> waitingThreads;
+  std::deque<IdleThread> idleThreads;
   std::mutex pausedAndWaitingMutex;
   int core_id=-1;
   ThreadPoolCommand threadCommand;
@@ -72,21 +110,34 @@ struct WorkerThread {
 
 class ThreadPool {
   Configuration & configuration;
-  int number_of_workers, pollingProgressThread;
+  int number_of_workers, max_idle_threads_per_worker;
+  size_t paused_thread_stack_size;
+  std::chrono::duration<double> idle_thread_timeout;
+  std::atomic<int> number_threads, max_number_threads;
+  std::atomic<size_t> thread_stack_bytes;
   bool main_thread_is_worker, restartAnotherPoller;
   ThreadPackage * mainThreadPackage;
   PausedTaskDescriptor* pausedMainThreadDescriptor=NULL;
   WorkerThread * workers;
   std::mutex thread_start_mutex, progressMutex, pollingProgressThreadMutex, pausedTasksToWorkersMutex;
-  std::queue<PendingThreadContainer> threadQueue;
+  // Tasks waiting for a worker, those that are urgent are held at the front (in the order that they were queued)
+  std::deque<PendingThreadContainer> threadQueue;
+  std::atomic<int> queuedThreads;
+  int queued_urgent_threads;
   std::map<PausedTaskDescriptor*, int> pausedTasksToWorkers;
 
-  bool *threadBusy, progressPollIdleThread;
-  int next_suggested_idle_thread;
+  WorkerBitmap busyWorkers, pollingWorkers;
+  bool progressPollIdleThread;
+  std::atomic<int> next_suggested_idle_thread;
   Messaging * messaging=NULL;
 
-  void threadEntryProcedure(int);
-  int get_index_of_idle_thread();
+  void threadEntryProcedure(int, ThreadPackage*);
+  int claim_idle_thread();
+  void activateWorker(int, void (*)(void *), void *);
+  ThreadPackage * createWorkerThread(int, size_t);
+  void reapIdleThreads(int);
+  bool retireTimedOutIdleThread(int, ThreadPackage*);
+  void retireThread(ThreadPackage*);
   void mapThreadsToCores(bool);
   void launchThreadToPollForProgressIfPossible();
   int findIndexFromThreadId(std::thread::id);
@@ -95,7 +146,7 @@ class ThreadPool {
   ThreadPool(Configuration&);
   void lockMutexForFinalisationTest();
   void unlockMutexForFinalisationTest();
-  void startThread(void (*)(void *), void *);
+  void startThread(void (*)(void *), void *, bool);
   bool isThreadPoolFinished();
   void setMessaging(Messaging*);
   void notifyMainThreadIsSleeping();
@@ -105,6 +156,8 @@ class ThreadPool {
   int getNumberOfWorkers() { return number_of_workers; }
   int getCurrentWorkerId();
   int getNumberActiveWorkers();
+  int getNumberThreads();
+  int getMaxNumberThreads();
 };
 
 #endif /* SRC_THREADPOOL_H_ */
@@ -0,0 +1,275 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "threads_messaging.h"
+#include "misc.h"
+#include "scheduler.h"
+#include "metrics.h"
+#include <string.h>
+#include <stdlib.h>
+#include <mutex>
+#include <thread>
+#include <new>
+
+#ifndef DO_METRICS
+#define DO_METRICS false
+#endif
+
+/**
+* Creates the exchange for the provided number of ranks, the inboxes are allocated aligned to the cache line size so that each rank's inbox sits on
+* lines of its own
+*/
+ThreadsExchange::ThreadsExchange(int number_ranks) : number_ranks(number_ranks), events_sent(0), events_received(0), activations(0), generation(0) {
+  if (number_ranks < 1) raiseError("The number of ranks must be at least one");
+  void * memory;
+  if (posix_memalign(&memory, alignof(ThreadsInbox), sizeof(ThreadsInbox) * number_ranks) != 0) {
+    raiseError("Unable to allocate memory for the inboxes of the ranks");
+  }
+  inboxes=(ThreadsInbox*) memory;
+  for (int i=0;i<number_ranks;i++) new (&inboxes[i]) ThreadsInbox();
+}
+
+/**
+* Creates the messaging for a logical rank, this registers with the rank's inbox so that the progress thread can be woken when events are handed over
+*/
+Threads_Messaging::Threads_Messaging(Scheduler & a_scheduler, ThreadPool & a_threadPool, ContextManager& a_contextManager, Configuration & aconfig,
+                                     ThreadsExchange & a_exchange, int rank) : Messaging(a_scheduler, a_threadPool, a_contextManager, aconfig),
+                                     exchange(a_exchange) {
+  my_rank=rank;
+  total_ranks=exchange.getNumRanks();
+  terminated=false;
+  eligable_for_termination=false;
+  participating_generation=exchange.generation.load();
+  {
+    ThreadsInbox & inbox=exchange.getInbox(my_rank);
+    std::lock_guard<std::mutex> inbox_lock(inbox.mutex);
+    inbox.messaging=this;
+  }
+  if (doesProgressThreadExist()) startProgressThread();
+}
+
+/**
+* Fires an event, either remote or local event. Also handles when we are sending to all targets rather than just one specific rank
+*/
+void Threads_Messaging::fireEvent(void * data, int data_count, int data_type, int target, bool persistent, const char * event_id) {
+  if (target == my_rank || target == EDAT_ALL) {
+    registerLocalEvent(createEvent(data, data_count, data_type, persistent, event_id));
+  }
+  if (target != my_rank) {
+    if (target != EDAT_ALL) {
+      handOverEvent(createEvent(data, data_count, data_type, persistent, event_id), target);
+    } else {
+      for (int i=0;i<total_ranks;i++) {
+        if (i != my_rank) handOverEvent(createEvent(data, data_count, data_type, persistent, event_id), i);
+      }
+    }
+  }
+  wakeProgressThread();
+}
+
+/**
+* Fires an event where the ownership of the data buffer is handed over to EDAT. The buffer itself is handed to the target without any copy, when
+* sending to all ranks then the other ranks are given copies (which are taken first, as the buffer can be released as soon as it is handed over)
+*/
+void Threads_Messaging::fireEventOwned(void * data, int data_count, int data_type, int target, const char * event_id, void (*release_fn)(void*)) {
+  if (contextManager.isTypeAContext(data_type)) raiseError("Can not transfer ownership of a context when firing an event");
+  PayloadBuffer * payload=new PayloadBuffer(data, release_fn, 1);
+  if (data == NULL || data_count == 0) {
+    fireEvent(NULL, 0, data_type, target, false, event_id);
+    payload->release();
+    return;
+  }
+  int owning_target=target == EDAT_ALL ? my_rank : target;
+  if (target == EDAT_ALL) {
+    for (int i=0;i<total_ranks;i++) {
+      if (i != my_rank) handOverEvent(createEvent(data, data_count, data_type, false, event_id), i);
+    }
+  }
+  SpecificEvent* event=new SpecificEvent(my_rank, data_count, data_count * getTypeSize(data_type), data_type, false, false,
+                                         std::string(event_id), (char*) data);
+  event->setPayload(payload);
+  if (owning_target == my_rank) {
+    registerLocalEvent(event);
+  } else {
+    handOverEvent(event, owning_target);
+  }
+  wakeProgressThread();
+}
+
+/**
+* Creates an event from this rank holding a copy of the provided data, or for a context the pointer to the context data rather than the data itself
+*/
+SpecificEvent * Threads_Messaging::createEvent(void * data, int data_count, int data_type, bool persistent, const char * event_id) {
+  int data_size=getTypeSize(data_type) * data_count;
+  char * buffer_data=(char*) malloc(data_size);
+  if (contextManager.isTypeAContext(data_type)) {
+    memcpy(buffer_data, &data, data_size);
+  } else {
+    memcpy(buffer_data, data, data_size);
+  }
+  return new SpecificEvent(my_rank, data_count, data_size, data_type, persistent, contextManager.isTypeAContext(data_type),
+                           std::string(event_id), buffer_data);
+}
+
+/**
+* Hands an event over to another rank by placing it in that rank's inbox and waking its progress thread. The event is counted as sent before it is
+* placed in the inbox, so that the totals never show it as received but not sent
+*/
+void Threads_Messaging::handOverEvent(SpecificEvent * event, int target) {
+  if (target < 0 || target >= total_ranks) raiseError("The target rank of an event is out of range");
+  exchange.events_sent++;
+  ThreadsInbox & inbox=exchange.getInbox(target);
+  Threads_Messaging * target_messaging;
+  {
+    std::lock_guard<std::mutex> inbox_lock(inbox.mutex);
+    inbox.events.push_back(event);
+    target_messaging=inbox.messaging;
+  }
+  // The target might not yet have initialised its messaging, in which case the events will be picked up once it starts polling
+  if (target_messaging != NULL) target_messaging->notifyEventArrival();
+}
+
+/**
+* Takes all events from this rank's inbox and registers them with the scheduler, returning the number of events. If any have arrived then the rank
+* is marked as active (and the activation counted) before the events are counted as received, so termination can not be determined meanwhile
+*/
+int Threads_Messaging::drainInbox() {
+  ThreadsInbox & inbox=exchange.getInbox(my_rank);
+  std::vector<SpecificEvent*> arrived;
+  {
+    std::lock_guard<std::mutex> inbox_lock(inbox.mutex);
+    if (inbox.events.empty()) return 0;
+    arrived.swap(inbox.events);
+  }
+  inbox.idle_generation=-1;
+  exchange.activations++;
+  for (SpecificEvent * event : arrived) {
+    scheduler.registerEvent(event);
+  }
+  exchange.events_received+=arrived.size();
+  return arrived.size();
+}
+
+void Threads_Messaging::resetPolling() {
+  terminated=false;
+  eligable_for_termination=false;
+  Messaging::resetPolling();
+}
+
+/**
+* Locks the mutexes for testing for finalisation, this ensures whilst the finalisation test is going on there is no state change
+*/
+void Threads_Messaging::lockMutexForFinalisationTest() {
+  dataArrival_mutex.lock();
+}
+
+/**
+* Unlocks the mutexes for finalisation testing
+*/
+void Threads_Messaging::unlockMutexForFinalisationTest() {
+  dataArrival_mutex.unlock();
+}
+
+/**
+* Determines whether the messaging is finished or not locally, which is when there are no events waiting in the inbox
+*/
+bool Threads_Messaging::isFinished() {
+  ThreadsInbox & inbox=exchange.getInbox(my_rank);
+  std::lock_guard<std::mutex> inbox_lock(inbox.mutex);
+  return inbox.events.empty();
+}
+
+void Threads_Messaging::finalise() {
+  continue_polling=false;
+  Messaging::finalise();
+}
+
+/**
+* A single poll, which registers any buffered local events and any events handed over by other ranks. If nothing has arrived then this checks for
+* local termination and progresses the termination protocol
+*/
+bool Threads_Messaging::performSinglePoll(int *) {
+  #if DO_METRICS
+    unsigned long int timer_key_psp = metrics::METRICS->timerStart("performSinglePoll");
+  #endif
+  poll_messages_handled=registerBufferedLocalEvents() ? 1 : 0;
+  std::unique_lock<std::mutex> dataArrivalLock(dataArrival_mutex);
+  int pending_message=drainInbox();
+  dataArrivalLock.unlock();
+  poll_messages_handled+=pending_message;
+  terminated=pending_message == 0 && checkForLocalTermination();
+  #if DO_METRICS
+    metrics::METRICS->timerStop("performSinglePoll", timer_key_psp);
+  #endif
+  return eligable_for_termination ? handleTerminationProtocol() : true;
+}
+
+/**
+* Runs the poll for events from within a progress thread, between polls the progress thread is throttled depending upon the configured progress mode.
+* As the progress threads of all ranks share the cores of the one process, a poll that found nothing to do also yields the core
+*/
+void Threads_Messaging::runPollForEvents() {
+  int iteration_counter=0;
+  while (continue_polling) {
+    continue_polling=performSinglePoll(&iteration_counter);
+    if (continue_polling) {
+      throttleProgressThread(poll_messages_handled);
+      if (poll_messages_handled == 0) std::this_thread::yield();
+    }
+  }
+}
+
+/**
+* Handles the termination protocol using the counters shared between the ranks. An idle rank marks itself as idle in the current generation and then
+* checks whether all ranks are idle in this generation and the totals of events sent and received match. As a rank that was seen as idle might have
+* been activated by an arriving event whilst the check was in progress, the number of activations must also be unchanged across the check. The rank
+* that determines termination moves the generation on, and the other ranks terminate once they see this. Returns false once terminated
+*/
+bool Threads_Messaging::handleTerminationProtocol() {
+  if (exchange.generation.load() != participating_generation) {
+    participating_generation++;
+    eligable_for_termination=false;
+    return false;
+  }
+  if (!terminated) return true;
+  exchange.getInbox(my_rank).idle_generation=participating_generation;
+  unsigned long long activations=exchange.activations.load();
+  for (int i=0;i<total_ranks;i++) {
+    if (exchange.getInbox(i).idle_generation.load() != participating_generation) return true;
+  }
+  unsigned long long received=exchange.events_received.load();
+  unsigned long long sent=exchange.events_sent.load();
+  if (sent != received || activations != exchange.activations.load()) return true;
+  int expected_generation=participating_generation;
+  exchange.generation.compare_exchange_strong(expected_generation, participating_generation+1);
+  participating_generation++;
+  eligable_for_termination=false;
+  return false;
+}
@@ -0,0 +1,99 @@
+/*
+* Copyright (c) 2018, EPCC, The University of Edinburgh
+* All rights reserved.
+*
+* Redistribution and use in source and binary forms, with or without
+* modification, are permitted provided that the following conditions are met:
+*
+* 1. Redistributions of source code must retain the above copyright notice, this
+*    list of conditions and the following disclaimer.
+*
+* 2. Redistributions in binary form must reproduce the above copyright notice,
+*    this list of conditions and the following disclaimer in the documentation
+*    and/or other materials provided with the distribution.
+*
+* 3. Neither the name of the copyright holder nor the names of its
+*    contributors may be used to endorse or promote products derived from
+*    this software without specific prior written permission.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+* AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+* IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+* FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+* DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+* SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+* CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+* OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+* OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef SRC_THREADS_MESSAGING_H_
+#define SRC_THREADS_MESSAGING_H_
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "messaging.h"
+#include "configuration.h"
+
+class Threads_Messaging;
+
+// The events handed over to a rank by the other ranks of the process, along with the generation of termination that the rank was last idle in
+struct alignas(64) ThreadsInbox {
+  std::mutex mutex;
+  std::vector<SpecificEvent*> events;
+  Threads_Messaging * messaging=NULL;
+  std::atomic<int> idle_generation;
+  ThreadsInbox() : idle_generation(-1) { }
+};
+
+/**
+* The state shared between all the logical ranks running as threads within the one process. This is an inbox per rank and the counters used for
+* termination, which are the total number of events sent and received across all ranks, the number of times that an idle rank has been activated by
+* an arriving event and the generation of termination (incremented each time that termination has been determined.)
+*/
+class ThreadsExchange {
+  int number_ranks;
+  ThreadsInbox * inboxes;
+public:
+  std::atomic<unsigned long long> events_sent, events_received, activations;
+  std::atomic<int> generation;
+  ThreadsExchange(int);
+  int getNumRanks() { return number_ranks; }
+  ThreadsInbox & getInbox(int rank) { return inboxes[rank]; }
+};
+
+/**
+* Messaging between logical ranks that run as groups of threads within the one process, hence no MPI is involved. Events are handed over to the
+* target by pointer via its inbox, and termination is determined from the counters held in the shared exchange
+*/
+class Threads_Messaging : public Messaging {
+  ThreadsExchange & exchange;
+  bool terminated, eligable_for_termination;
+  int my_rank, total_ranks, participating_generation, poll_messages_handled;
+  std::mutex comms_mutex, dataArrival_mutex;
+  SpecificEvent * createEvent(void*, int, int, bool, const char*);
+  void handOverEvent(SpecificEvent*, int);
+  int drainInbox();
+  bool handleTerminationProtocol();
+protected:
+  bool performSinglePoll(int*);
+public:
+  Threads_Messaging(Scheduler&, ThreadPool&, ContextManager&, Configuration&, ThreadsExchange&, int);
+  virtual void lockMutexForFinalisationTest();
+  virtual void unlockMutexForFinalisationTest();
+  virtual void resetPolling();
+  virtual void runPollForEvents();
+  virtual void setEligableForTermination() { eligable_for_termination=true; };
+  virtual void finalise();
+  virtual void fireEvent(void *, int, int, int, bool, const char *);
+  virtual void fireEventOwned(void *, int, int, int, const char *, void (*)(void*));
+  virtual int getRank() { return my_rank; }
+  virtual int getNumRanks() { return total_ranks; }
+  virtual bool isFinished();
+  virtual void lockComms() { comms_mutex.lock(); }
+  virtual void unlockComms() { comms_mutex.unlock(); }
+  void notifyEventArrival() { wakeProgressThread(); }
+};
+#endif